@@ -44,6 +44,58 @@
 #define xdl_free(ptr) free(ptr)
 #define xdl_realloc(ptr, x) realloc(ptr, x)
 
+/*
+ * Storage class for the scratch buffers xdiff keeps per thread between
+ * calls. Leave it undefined to allocate scratch memory on every call.
+ */
+#if defined(_MSC_VER)
+# define XDL_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+# define XDL_THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+# define XDL_THREAD_LOCAL _Thread_local
+#endif
+
+/*
+ * Threads for the XDF_PARALLEL algorithms. Without XDL_THREADS, the
+ * flag is accepted but everything runs on the calling thread.
+ *
+ * XDL_MUTEX says the xdl_mutex_* primitives exist, which xdl_cache_new()
+ * needs to hand out a cache that threads can share. Windows has them
+ * without XDL_THREADS.
+ */
+#if !defined(_MSC_VER) && !defined(XDL_NO_THREADS)
+
+# include <pthread.h>
+# include <unistd.h>
+
+# define XDL_THREADS
+# define XDL_MUTEX
+# define xdl_thread_t pthread_t
+# define xdl_thread_create(t, fn, arg) pthread_create(t, NULL, fn, arg)
+# define xdl_thread_join(t) pthread_join(t, NULL)
+# define xdl_mutex_t pthread_mutex_t
+# define xdl_mutex_init(m) pthread_mutex_init(m, NULL)
+# define xdl_mutex_destroy(m) pthread_mutex_destroy(m)
+# define xdl_mutex_lock(m) pthread_mutex_lock(m)
+# define xdl_mutex_unlock(m) pthread_mutex_unlock(m)
+# if defined(_SC_NPROCESSORS_ONLN)
+#  define xdl_online_cpus() sysconf(_SC_NPROCESSORS_ONLN)
+# endif
+
+#elif defined(_MSC_VER) && !defined(XDL_NO_THREADS)
+
+# include <windows.h>
+
+# define XDL_MUTEX
+# define xdl_mutex_t SRWLOCK
+# define xdl_mutex_init(m) (InitializeSRWLock(m), 0)
+# define xdl_mutex_destroy(m) ((void) (m))
+# define xdl_mutex_lock(m) AcquireSRWLockExclusive(m)
+# define xdl_mutex_unlock(m) ReleaseSRWLockExclusive(m)
+
+#endif
+
 #define XDL_BUG(msg) do { fprintf(stderr, "fatal: %s\n", msg); exit(128); } while(0)
 
 #if defined(_MSC_VER) && !defined(XDL_REGEX)
@@ -91,6 +91,7 @@ xpparam_t *create_xpparam(
             }
         }
         xpparam->anchors_nr = anchors_count;
+        xpparam->max_threads = 0;
     }
     return xpparam;
 }
@@ -0,0 +1,165 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+/*
+ * Built against a library whose histogram index holds only
+ * XDL_HISTOGRAM_MAX_PTR lines, so that most of these files are too long
+ * for it and take the fallback to the classic diff. Every diff must still
+ * apply back to the second file, and merging a change with the unchanged
+ * base must give the change.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xdiff.h"
+
+/* git-xdiff.h leaves the external definition to the application */
+extern int xdl_regexec_buf(const xdl_regex_t *preg, const char *buf,
+			   size_t size, size_t nmatch,
+			   xdl_regmatch_t pmatch[], int eflags);
+
+#define ROUNDS 2000
+
+typedef struct s_buf {
+	char *ptr;
+	long size, alloc;
+} buf_t;
+
+static int buf_out(void *priv, mmbuffer_t *mb, int nbuf)
+{
+	buf_t *b = priv;
+	int i;
+
+	for (i = 0; i < nbuf; i++) {
+		if (b->size + mb[i].size > b->alloc) {
+			b->alloc = 2 * (b->size + mb[i].size) + 64;
+			if (!(b->ptr = realloc(b->ptr, b->alloc)))
+				return -1;
+		}
+		memcpy(b->ptr + b->size, mb[i].ptr, mb[i].size);
+		b->size += mb[i].size;
+	}
+	return 0;
+}
+
+/* n lines drawn from m distinct ones */
+static long gen_file(char *p, long n, int m)
+{
+	long i, size = 0;
+
+	for (i = 0; i < n; i++)
+		size += sprintf(p + size, "l%d\n", rand() % m);
+	return size;
+}
+
+/* drop about one line in ten of src and insert as many new ones */
+static long gen_change(char *p, char const *src, long size, int m)
+{
+	long i = 0, e, n = 0;
+	int r;
+
+	for (; i < size; i = e) {
+		for (e = i; src[e] != '\n'; e++);
+		e++;
+		if ((r = rand() % 10)) {
+			memcpy(p + n, src + i, e - i);
+			n += e - i;
+		}
+		if (r == 1)
+			n += sprintf(p + n, "x%d\n", rand() % m);
+	}
+	return n;
+}
+
+static int check(mmfile_t *mf1, mmfile_t *mf2, long flags)
+{
+	xpparam_t xpp;
+	xdemitconf_t xecfg;
+	xdemitcb_t ecb;
+	xapparam_t xap;
+	xmparam_t xmp;
+	buf_t patch = { NULL, 0, 0 };
+	mmbuffer_t pb, res;
+	int bad = 0;
+
+	memset(&xpp, 0, sizeof(xpp));
+	memset(&xecfg, 0, sizeof(xecfg));
+	memset(&xap, 0, sizeof(xap));
+	memset(&xmp, 0, sizeof(xmp));
+	xpp.flags = flags;
+	xecfg.ctxlen = 3;
+	ecb.priv = &patch;
+	ecb.out_hunk = NULL;
+	ecb.out_line = buf_out;
+
+	if (xdl_diff(mf1, mf2, &xpp, &xecfg, &ecb) < 0)
+		return 1;
+	pb.ptr = patch.ptr;
+	pb.size = patch.size;
+	if (xdl_apply(mf1, &pb, &xap, &res))
+		bad = 1;
+	else {
+		bad = res.size != mf2->size || memcmp(res.ptr, mf2->ptr, res.size);
+		free(res.ptr);
+	}
+	free(patch.ptr);
+
+	xmp.xpp = xpp;
+	xmp.level = XDL_MERGE_ZEALOUS;
+	if (xdl_merge(mf1, mf2, mf1, &xmp, &res))
+		bad = 1;
+	else if (res.size != mf2->size || memcmp(res.ptr, mf2->ptr, res.size))
+		bad = 1;
+	free(res.ptr);
+
+	return bad;
+}
+
+int main(void)
+{
+	mmfile_t mf1, mf2;
+	long n, over = 0;
+	int i, m, bad = 0;
+
+	srand(9);
+	for (i = 0; i < ROUNDS; i++) {
+		n = rand() % (8 * XDL_HISTOGRAM_MAX_PTR);
+		m = 2 + rand() % 60;
+		over += n > XDL_HISTOGRAM_MAX_PTR;
+		mf1.ptr = malloc(12 * n + 1);
+		mf2.ptr = malloc(24 * n + 64);
+		if (!mf1.ptr || !mf2.ptr)
+			return 1;
+		mf1.size = gen_file(mf1.ptr, n, m);
+		mf2.size = gen_change(mf2.ptr, mf1.ptr, mf1.size, m);
+		bad += check(&mf1, &mf2, XDF_HISTOGRAM_DIFF);
+		bad += check(&mf1, &mf2, XDF_HISTOGRAM_DIFF | XDF_PARALLEL);
+		free(mf1.ptr);
+		free(mf2.ptr);
+	}
+
+	printf("%d of %d rounds failed, %ld past the index ceiling\n",
+	       bad, 2 * ROUNDS, 2 * over);
+	return bad != 0;
+}
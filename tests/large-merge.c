@@ -0,0 +1,115 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+/*
+ * Merge files of more than 2 GiB, with the classic and the histogram
+ * diff, through xdl_merge_stream(). One side drops the first line and the
+ * other adds a last one, so the result is known without a second copy.
+ * This needs about 2 GiB of memory and some minutes, so it only runs
+ * when XDL_TEST_LARGE is set in the environment.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xdiff.h"
+
+/* git-xdiff.h leaves the external definition to the application */
+extern int xdl_regexec_buf(const xdl_regex_t *preg, const char *buf,
+			   size_t size, size_t nmatch,
+			   xdl_regmatch_t pmatch[], int eflags);
+
+#define LINE_LEN 1000
+#define NR_LINES 2150000L
+#define SKIP 77
+
+struct expect {
+	char const *ptr;
+	long size, pos;
+	int bad;
+};
+
+static int expect_out(void *priv, mmbuffer_t *mb, int nbuf)
+{
+	struct expect *ex = priv;
+	int i;
+
+	for (i = 0; i < nbuf; i++) {
+		if (ex->pos + mb[i].size > ex->size ||
+		    memcmp(ex->ptr + ex->pos, mb[i].ptr, mb[i].size))
+			ex->bad = 1;
+		ex->pos += mb[i].size;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	long size = LINE_LEN * (NR_LINES + 1), i;
+	mmfile_t orig, mf1, mf2;
+	xmparam_t xmp;
+	xdmergecb_t cb;
+	struct expect ex;
+	char *buf;
+	int a, ret, bad = 0;
+
+	if (!getenv("XDL_TEST_LARGE")) {
+		printf("skipped, set XDL_TEST_LARGE to run\n");
+		return SKIP;
+	}
+	if (!(buf = malloc(size)))
+		return SKIP;
+	for (i = 0; i <= NR_LINES; i++) {
+		memset(buf + i * LINE_LEN, 'a' + i % 26, LINE_LEN - 1);
+		sprintf(buf + i * LINE_LEN, "%09ld", i);
+		buf[i * LINE_LEN + 9] = ' ';
+		buf[i * LINE_LEN + LINE_LEN - 1] = '\n';
+	}
+	orig.ptr = buf;
+	orig.size = size - LINE_LEN;
+	mf1.ptr = buf;
+	mf1.size = size;
+	mf2.ptr = buf + LINE_LEN;
+	mf2.size = size - 2 * LINE_LEN;
+
+	for (a = 0; a < 2; a++) {
+		memset(&xmp, 0, sizeof(xmp));
+		xmp.level = XDL_MERGE_ZEALOUS;
+		xmp.xpp.flags = a ? XDF_HISTOGRAM_DIFF : 0;
+		ex.ptr = buf + LINE_LEN;
+		ex.size = size - LINE_LEN;
+		ex.pos = 0;
+		ex.bad = 0;
+		cb.priv = &ex;
+		cb.out = expect_out;
+		ret = xdl_merge_stream(&orig, &mf1, &mf2, &xmp, &cb);
+		if (ret || ex.bad || ex.pos != ex.size)
+			bad++;
+		printf("%s: merge of %ld bytes returned %d, %ld bytes out, %s\n",
+		       a ? "histogram" : "classic", orig.size, ret, ex.pos,
+		       ex.bad || ex.pos != ex.size ? "wrong" : "ok");
+	}
+	free(buf);
+
+	return bad != 0;
+}
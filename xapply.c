@@ -0,0 +1,491 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+#include "xinclude.h"
+
+/* lines sampled to size the record array of a file */
+#define XDL_APPLY_GUESS_NLINES 20
+
+/*
+ * A line of the file or the patch, hashed like xdl_prepare_ctx() does so
+ * that context is mostly compared by hash alone.
+ */
+struct apply_rec {
+	char const *ptr;
+	long size;
+	unsigned long ha;
+};
+
+struct apply_line {
+	struct apply_rec rec;
+	char op;		/* ' ', '-' or '+' */
+};
+
+struct apply_hunk {
+	long pos;		/* first line it expects, counting from 0 */
+	long first, nr;		/* its lines in apply_patch */
+	long npre;		/* context and removed lines */
+	long lead, trail;	/* context lines at its start and end */
+};
+
+struct apply_patch {
+	struct apply_line *line;
+	long nline, aline;
+	struct apply_hunk *hunk;
+	long nhunk, ahunk;
+	long added;		/* bytes of all '+' lines */
+};
+
+struct apply_file {
+	mmfile_t *mf;
+	struct apply_rec *rec;
+	long nrec;
+};
+
+
+static char const *apply_eol(char const *ptr, char const *top)
+{
+	char const *eol = memchr(ptr, '\n', top - ptr);
+
+	return eol ? eol + 1 : top;
+}
+
+static int apply_num(char const **ptr, char const *top, long *val)
+{
+	char const *cur = *ptr;
+	long v = 0;
+
+	for (; cur < top && XDL_ISDIGIT(*cur); cur++) {
+		if (v > (LONG_MAX - (*cur - '0')) / 10)
+			return -1;
+		v = v * 10 + (*cur - '0');
+	}
+	if (cur == *ptr)
+		return -1;
+	*ptr = cur;
+	*val = v;
+
+	return 0;
+}
+
+/*
+ * Parse "@@ -a[,b] +c[,d] @@" at ptr into h, and the number of old and
+ * new lines that follow it.
+ */
+static int apply_header(char const *ptr, char const *top,
+			struct apply_hunk *h, long *nold, long *nnew)
+{
+	long start, nstart;
+
+	ptr += 4;
+	if (apply_num(&ptr, top, &start) < 0)
+		return -1;
+	*nold = 1;
+	if (ptr < top && *ptr == ',' && (ptr++, apply_num(&ptr, top, nold) < 0))
+		return -1;
+	if (top - ptr < 2 || memcmp(ptr, " +", 2))
+		return -1;
+	ptr += 2;
+	if (apply_num(&ptr, top, &nstart) < 0)
+		return -1;
+	*nnew = 1;
+	if (ptr < top && *ptr == ',' && (ptr++, apply_num(&ptr, top, nnew) < 0))
+		return -1;
+	if (top - ptr < 3 || memcmp(ptr, " @@", 3))
+		return -1;
+
+	/* an empty old side names the line it follows */
+	if (*nold && !start)
+		return -1;
+	h->pos = *nold ? start - 1 : start;
+
+	return 0;
+}
+
+static int apply_add_line(struct apply_patch *ap, char op, char const *ptr,
+			  long size)
+{
+	if (XDL_ALLOC_GROW(ap->line, ap->nline + 1, ap->aline))
+		return -1;
+	ap->line[ap->nline].rec.ptr = ptr;
+	ap->line[ap->nline].rec.size = size;
+	ap->line[ap->nline++].op = op;
+	if (op == '+')
+		ap->added += size;
+
+	return 0;
+}
+
+/*
+ * Split the unified diff in patch into hunks. Everything outside of them,
+ * like file headers, is skipped.
+ */
+static int apply_parse(mmbuffer_t const *patch, long flags,
+		       struct apply_patch *ap)
+{
+	char const *cur = patch->ptr, *top = patch->ptr + patch->size, *eol;
+	char const *ptr;
+	struct apply_rec *rec;
+	struct apply_hunk h;
+	long nold, nnew, k;
+	char op;
+
+	while (cur < top) {
+		eol = apply_eol(cur, top);
+		if (eol - cur < 4 || memcmp(cur, "@@ -", 4)) {
+			cur = eol;
+			continue;
+		}
+		if (apply_header(cur, eol, &h, &nold, &nnew) < 0)
+			return -1;
+		h.first = ap->nline;
+		for (cur = eol; nold > 0 || nnew > 0 ||
+			     (cur < top && *cur == '\\'); cur = eol) {
+			if (cur >= top)
+				return -1;
+			eol = apply_eol(cur, top);
+			op = *cur;
+			ptr = cur + 1;
+			if (op == '\\') {
+				/* "\ No newline at end of file" */
+				rec = ap->nline > h.first ?
+					&ap->line[ap->nline - 1].rec : NULL;
+				if (rec && rec->size &&
+				    rec->ptr[rec->size - 1] == '\n')
+					rec->size--;
+				continue;
+			}
+			if (op == '\n') {
+				/* a blank context line that lost its space */
+				op = ' ';
+				ptr = cur;
+			}
+			if (op == ' ' || op == '-')
+				nold--;
+			if (op == ' ' || op == '+')
+				nnew--;
+			if ((op != ' ' && op != '-' && op != '+') ||
+			    nold < 0 || nnew < 0 ||
+			    apply_add_line(ap, op, ptr, (long) (eol - ptr)) < 0)
+				return -1;
+		}
+
+		h.nr = ap->nline - h.first;
+		for (h.npre = 0, k = h.first; k < ap->nline; k++)
+			if (ap->line[k].op != '+')
+				h.npre++;
+		for (h.lead = 0; h.lead < h.nr &&
+			     ap->line[h.first + h.lead].op == ' '; h.lead++);
+		for (h.trail = 0; h.trail < h.nr - h.lead &&
+			     ap->line[ap->nline - 1 - h.trail].op == ' '; h.trail++);
+		if (XDL_ALLOC_GROW(ap->hunk, ap->nhunk + 1, ap->ahunk))
+			return -1;
+		ap->hunk[ap->nhunk++] = h;
+	}
+
+	for (k = 0; k < ap->nline; k++) {
+		rec = &ap->line[k].rec;
+		ptr = rec->ptr;
+		rec->ha = xdl_hash_record(&ptr, ptr + rec->size, flags);
+	}
+
+	return 0;
+}
+
+static int apply_split(mmfile_t *mf, long flags, struct apply_file *af)
+{
+	char const *cur = mf->ptr, *top = mf->ptr + mf->size, *prev;
+	mmbuffer_t chunk;
+	mmrope_t mr;
+	long narec;
+
+	af->mf = mf;
+	af->nrec = 0;
+	xdl_file_rope(mf, &chunk, &mr);
+	narec = xdl_guess_lines(&mr, XDL_APPLY_GUESS_NLINES);
+	if (!XDL_ALLOC_ARRAY(af->rec, narec))
+		return -1;
+	while (cur < top) {
+		if (XDL_ALLOC_GROW(af->rec, af->nrec + 1, narec)) {
+			xdl_free(af->rec);
+			return -1;
+		}
+		prev = cur;
+		af->rec[af->nrec].ha = xdl_hash_record(&cur, top, flags);
+		af->rec[af->nrec].ptr = prev;
+		af->rec[af->nrec++].size = (long) (cur - prev);
+	}
+
+	return 0;
+}
+
+/*
+ * Check the lines of h from its lead-th to its trail-th last, '+' lines
+ * aside, against the file from line pos.
+ */
+static int apply_match(struct apply_file *af, long pos, struct apply_patch *ap,
+		       struct apply_hunk *h, long lead, long trail, long flags)
+{
+	struct apply_rec *fr, *pl;
+	long k;
+
+	for (k = h->first + lead; k < h->first + h->nr - trail; k++) {
+		if (ap->line[k].op == '+')
+			continue;
+		fr = af->rec + pos++;
+		pl = &ap->line[k].rec;
+		if (fr->ha != pl->ha ||
+		    !xdl_recmatch(fr->ptr, fr->size, pl->ptr, pl->size, flags))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Find where h applies, no earlier than line lo: at its own position
+ * shifted by offset, or as close to it as possible, first with all its
+ * context, then dropping up to fuzz context lines at each end. Returns
+ * the line matching the first line kept, or -1.
+ */
+static long apply_locate(struct apply_file *af, struct apply_patch *ap,
+			 struct apply_hunk *h, long offset, long lo,
+			 xapparam_t const *xap, long *lead, long *trail)
+{
+	long f, at, hi, d;
+
+	for (f = 0; f <= xap->fuzz; f++) {
+		*lead = XDL_MIN(f, h->lead);
+		*trail = XDL_MIN(f, h->trail);
+		/* no context left to drop */
+		if (f && *lead < f && *trail < f)
+			break;
+		at = XDL_MIN(h->pos, af->nrec) + offset + *lead;
+		hi = af->nrec - (h->npre - *lead - *trail);
+		for (d = 0; at + d <= hi || at - d >= lo; d++) {
+			if (at + d >= lo && at + d <= hi &&
+			    apply_match(af, at + d, ap, h, *lead, *trail,
+					xap->xpp.flags))
+				return at + d;
+			if (d && at - d >= lo && at - d <= hi &&
+			    apply_match(af, at - d, ap, h, *lead, *trail,
+					xap->xpp.flags))
+				return at - d;
+		}
+	}
+
+	return -1;
+}
+
+static unsigned int apply_hash(struct apply_file *af, long i, long n)
+{
+	char const *start, *end;
+
+	if (!n)
+		return xdl_span_hash(NULL, 0, 0);
+	start = af->rec[i].ptr;
+	end = af->rec[i + n - 1].ptr + af->rec[i + n - 1].size;
+
+	return xdl_span_hash(start, (long) (end - start), n);
+}
+
+static char *apply_copy(char *out, struct apply_file *af, long from, long to)
+{
+	char const *top = af->mf->ptr + af->mf->size;
+	char const *start = from < af->nrec ? af->rec[from].ptr : top;
+	char const *end = to < af->nrec ? af->rec[to].ptr : top;
+
+	if (end > start)
+		memcpy(out, start, end - start);
+
+	return out + (end - start);
+}
+
+static int apply_unified(mmfile_t *mf, mmbuffer_t const *patch,
+			 xapparam_t const *xap, mmbuffer_t *result)
+{
+	struct apply_patch ap;
+	struct apply_file af;
+	struct apply_hunk *h;
+	long i, k, pos, cur, offset, lead, trail;
+	int failed = 0;
+	char *out;
+
+	memset(&ap, 0, sizeof(ap));
+	af.rec = NULL;
+	if (apply_parse(patch, xap->xpp.flags, &ap) < 0 ||
+	    apply_split(mf, xap->xpp.flags, &af) < 0 ||
+	    !(result->ptr = out = xdl_malloc(mf->size + ap.added + 1))) {
+		failed = -1;
+		goto out;
+	}
+
+	for (i = 0, cur = 0, offset = 0; i < ap.nhunk; i++) {
+		h = ap.hunk + i;
+		if (h->lead == h->nr)
+			continue;
+		pos = apply_locate(&af, &ap, h, offset, cur, xap, &lead, &trail);
+		if (pos < 0) {
+			failed++;
+			continue;
+		}
+		out = apply_copy(out, &af, cur, pos);
+		for (k = h->first + lead; k < h->first + h->nr - trail; k++) {
+			if (ap.line[k].op == '+') {
+				memcpy(out, ap.line[k].rec.ptr, ap.line[k].rec.size);
+				out += ap.line[k].rec.size;
+				continue;
+			}
+			if (ap.line[k].op == ' ')
+				out = apply_copy(out, &af, pos, pos + 1);
+			pos++;
+		}
+		offset = pos - (h->npre - trail) - h->pos;
+		cur = pos;
+	}
+	out = apply_copy(out, &af, cur, af.nrec);
+	result->size = out - result->ptr;
+
+out:
+	xdl_free(af.rec);
+	xdl_free(ap.hunk);
+	xdl_free(ap.line);
+	return failed;
+}
+
+/*
+ * Apply a binary script carrying its text. It only applies to the file
+ * it was made from: all its changes fail on a file with another number
+ * of lines, and each change whose lines do not have the hash recorded
+ * for them, if any, is left out.
+ */
+static int apply_script(mmfile_t *mf, mmbuffer_t const *patch,
+			mmbuffer_t *result)
+{
+	xdsheader_t hdr;
+	xdscript_t script;
+	unsigned int *hash;
+	mmbuffer_t *text;
+	struct apply_file af;
+	xdedit_t *e;
+	long k, cur, added;
+	int failed = -1;
+	char *out;
+
+	af.rec = NULL;
+	if (xdl_script_parse(patch, &hdr, &script, &hash, &text) < 0)
+		return -1;
+	if (!(hdr.flags & XDL_SCRIPT_TEXT) || apply_split(mf, 0, &af) < 0)
+		goto out;
+	for (k = 0, added = 0; k < script.nr; k++)
+		added += text[k].size;
+	if (!(result->ptr = out = xdl_malloc(mf->size + added + 1)))
+		goto out;
+
+	failed = 0;
+	if (af.nrec != hdr.nrec1) {
+		failed = (int) XDL_MIN(script.nr, INT_MAX);
+		script.nr = 0;
+	}
+	for (k = 0, cur = 0; k < script.nr; k++) {
+		e = script.edit + k;
+		if (hash && hash[2 * k] != apply_hash(&af, e->i1, e->chg1)) {
+			failed++;
+			continue;
+		}
+		out = apply_copy(out, &af, cur, e->i1);
+		if (text[k].size)
+			memcpy(out, text[k].ptr, text[k].size);
+		out += text[k].size;
+		cur = e->i1 + e->chg1;
+	}
+	out = apply_copy(out, &af, cur, af.nrec);
+	result->size = out - result->ptr;
+
+out:
+	xdl_free(af.rec);
+	xdl_free(text);
+	xdl_free(hash);
+	xdl_free_edit_script(&script);
+	return failed;
+}
+
+int xdl_apply(mmfile_t *mf, mmbuffer_t const *patch, xapparam_t const *xap,
+	      mmbuffer_t *result)
+{
+	int status;
+
+	result->ptr = NULL;
+	result->size = 0;
+	if (xdl_script_magic(patch))
+		status = apply_script(mf, patch, result);
+	else
+		status = apply_unified(mf, patch, xap, result);
+	if (status < 0) {
+		xdl_free(result->ptr);
+		result->ptr = NULL;
+		result->size = 0;
+	}
+
+	return status;
+}
+
+struct apply_batch {
+	xdapplyjob_t *job;
+	xapparam_t xap;
+};
+
+static int apply_job(void *priv, long k)
+{
+	struct apply_batch *ab = priv;
+	xdapplyjob_t *job = ab->job + k;
+
+	job->status = xdl_apply(&job->mf, &job->patch, &ab->xap, &job->result);
+	return 0;
+}
+
+int xdl_apply_batch(xdapplyjob_t *job, long nr, xapparam_t const *xap)
+{
+	struct apply_batch ab;
+	xdpool_t pool;
+	mmbuffer_t chunk;
+	mmrope_t mr;
+	long k, lines;
+
+	for (k = 0, lines = 0; k < nr; k++) {
+		job[k].result.ptr = NULL;
+		job[k].result.size = 0;
+		job[k].status = -1;
+		xdl_file_rope(&job[k].mf, &chunk, &mr);
+		lines += xdl_guess_lines(&mr, XDL_APPLY_GUESS_NLINES);
+	}
+	if (xdl_pool_init(&pool, &xap->xpp) < 0)
+		return -1;
+	ab.job = job;
+	ab.xap = *xap;
+	ab.xap.xpp.flags &= ~XDF_PARALLEL;
+	xdl_pool_run(&pool, nr, lines, apply_job, &ab);
+	xdl_pool_free(&pool);
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+#include "xinclude.h"
+
+
+/*
+ * The revisions are walked from the last one back. Each is prepared once,
+ * in a file set, so that the diff of a revision with its parent only
+ * copies records that are already classified. The lines of the last
+ * revision that are still unattributed are kept as a list, sorted by
+ * where they are in the current revision, and moved to the parent along
+ * the unchanged lines of the diff. Those the diff marks as changed come
+ * from the current revision.
+ */
+struct blame_pending {
+	long *fin;	/* line of the last revision */
+	long *pos;	/* where it is in the current revision */
+	long nr;
+};
+
+/*
+ * Diff par with cur, attribute the pending lines that cur changes to
+ * revision k and move the others to their lines in par.
+ */
+static int blame_step(xdfile_t *par, xdfile_t *cur, long k,
+		      xpparam_t const *xpp, struct blame_pending *pd,
+		      xdblame_t *blame)
+{
+	xdfenv_t xe;
+	long i1, i2, j, out;
+
+	if (xdl_prepare_range_env(par, 0, par->nrec, cur, 0, cur->nrec,
+				  xpp, &xe) < 0)
+		return -1;
+	if (xdl_diff_env(xpp, &xe) < 0 ||
+	    xdl_change_compact(&xe.xdf1, &xe.xdf2, xpp->flags) < 0 ||
+	    xdl_change_compact(&xe.xdf2, &xe.xdf1, xpp->flags) < 0) {
+
+		xdl_free_env(&xe);
+		return -1;
+	}
+
+	for (i1 = i2 = j = out = 0; j < pd->nr; i2++) {
+		if (XDL_CHANGED(&xe.xdf2, i2)) {
+			if (pd->pos[j] == i2) {
+				blame[pd->fin[j]].rev = k;
+				blame[pd->fin[j]].line = i2;
+				j++;
+			}
+			continue;
+		}
+		while (XDL_CHANGED(&xe.xdf1, i1))
+			i1++;
+		if (pd->pos[j] == i2) {
+			pd->fin[out] = pd->fin[j];
+			pd->pos[out++] = i1;
+			j++;
+		}
+		i1++;
+	}
+	pd->nr = out;
+	xdl_free_env(&xe);
+
+	return 0;
+}
+
+int xdl_blame(mmfile_t *rev, long nr, xpparam_t const *xpp,
+	      xdblame_t **blame, long *nlines)
+{
+	xdfileset_t *fs = NULL;
+	xdfile_t *cur, *par;
+	mmfile_t **mf = NULL;
+	struct blame_pending pd;
+	long i, k;
+	int ret = -1;
+
+	*blame = NULL;
+	*nlines = 0;
+	pd.fin = pd.pos = NULL;
+	if (nr <= 0 || !XDL_ALLOC_ARRAY(mf, nr))
+		return -1;
+	for (k = 0; k < nr; k++)
+		mf[k] = rev + k;
+	if (!(fs = xdl_fileset_new(xpp, mf, nr)) ||
+	    !(cur = xdl_fileset_add(fs, rev + nr - 1)))
+		goto out;
+
+	pd.nr = cur->nrec;
+	if (!XDL_ALLOC_ARRAY(*blame, pd.nr + 1) ||
+	    !XDL_ALLOC_ARRAY(pd.fin, pd.nr + 1) ||
+	    !XDL_ALLOC_ARRAY(pd.pos, pd.nr + 1))
+		goto out;
+	*nlines = pd.nr;
+	for (i = 0; i < pd.nr; i++)
+		pd.fin[i] = pd.pos[i] = i;
+
+	/* stop as soon as every line is attributed */
+	for (k = nr - 1; k > 0 && pd.nr; k--) {
+		if (!(par = xdl_fileset_add(fs, rev + k - 1)) ||
+		    blame_step(par, cur, k, xpp, &pd, *blame) < 0)
+			goto out;
+		xdl_fileset_drop(fs, cur);
+		cur = par;
+	}
+	for (i = 0; i < pd.nr; i++) {
+		(*blame)[pd.fin[i]].rev = 0;
+		(*blame)[pd.fin[i]].line = pd.pos[i];
+	}
+	ret = 0;
+
+out:
+	if (ret < 0) {
+		xdl_free(*blame);
+		*blame = NULL;
+		*nlines = 0;
+	}
+	xdl_free(pd.pos);
+	xdl_free(pd.fin);
+	xdl_fileset_free(fs);
+	xdl_free(mf);
+	return ret;
+}
+
+void xdl_free_blame(xdblame_t *blame)
+{
+	xdl_free(blame);
+}
@@ -0,0 +1,357 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+#include "xinclude.h"
+
+/* independently locked parts of the cache, a power of two */
+#define XDL_CACHE_SHARDS 16
+
+
+/*
+ * The cache is split in shards, picked by the key hash, each with its own
+ * lock, hash table, LRU list and share of the size budget, so threads
+ * only contend when they hit the same shard. Entries hold the edit
+ * script of a diff; hits split the files into lines again, without
+ * hashing them, and emit the script with the caller's xdemitconf_t.
+ */
+typedef struct s_xdcachekey {
+	uint64_t h1[2], h2[2];	/* content hashes of mf1 and mf2 */
+	long size1, size2;
+	unsigned long flags;
+	uint64_t anchors;
+} xdcachekey_t;
+
+typedef struct s_xdcentry {
+	struct s_xdcentry *next;	/* hash chain */
+	struct s_xdcentry *prev_lru, *next_lru;
+	xdcachekey_t key;
+	long size;
+	long nr;
+	xdedit_t *edit;
+} xdcentry_t;
+
+struct cache_shard {
+#if defined(XDL_MUTEX)
+	xdl_mutex_t lock;
+#endif
+	xdcentry_t **bucket;
+	long nbucket, nr;
+	xdcentry_t *head, *tail;	/* most and least recently used */
+	long size, max_size;
+};
+
+struct s_xdcache {
+	struct cache_shard shard[XDL_CACHE_SHARDS];
+};
+
+
+static void cache_mix(uint64_t *h, uint64_t w)
+{
+	h[0] = (h[0] ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+	h[0] ^= h[0] >> 29;
+	h[1] = (h[1] + w) * UINT64_C(0xc2b2ae3d27d4eb4f);
+	h[1] ^= h[1] >> 31;
+}
+
+/*
+ * A 128-bit hash of the contents, eight bytes at a time. It is not meant
+ * to resist crafted collisions, only to make accidental ones unlikely.
+ */
+static void cache_hash(uint64_t *h, char const *ptr, long size)
+{
+	uint64_t w;
+	long i;
+
+	h[0] = UINT64_C(0x243f6a8885a308d3);
+	h[1] = UINT64_C(0x13198a2e03707344);
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&w, ptr + i, 8);
+		cache_mix(h, w);
+	}
+	w = 0;
+	if (i < size)
+		memcpy(&w, ptr + i, size - i);
+	cache_mix(h, w);
+	cache_mix(h, (uint64_t) size);
+}
+
+static void cache_key(xdcachekey_t *key, mmfile_t *mf1, mmfile_t *mf2,
+		      xpparam_t const *xpp)
+{
+	uint64_t h[2];
+	size_t i;
+
+	memset(key, 0, sizeof(*key));
+	cache_hash(key->h1, mf1->ptr, mf1->size);
+	cache_hash(key->h2, mf2->ptr, mf2->size);
+	key->size1 = mf1->size;
+	key->size2 = mf2->size;
+	/* neither XDF_PARALLEL nor XDF_PACKED_CHANGES change the result */
+	key->flags = xpp->flags & ~(XDF_PARALLEL | XDF_PACKED_CHANGES);
+	for (i = 0; i < xpp->anchors_nr; i++) {
+		cache_hash(h, xpp->anchors[i], (long) strlen(xpp->anchors[i]));
+		key->anchors = (key->anchors ^ h[0]) * UINT64_C(0x100000001b3);
+	}
+}
+
+static int cache_init_shard(struct cache_shard *sh, long max_size)
+{
+	memset(sh, 0, sizeof(*sh));
+	sh->max_size = max_size;
+	sh->nbucket = 64;
+	if (!XDL_CALLOC_ARRAY(sh->bucket, sh->nbucket))
+		return -1;
+#if defined(XDL_MUTEX)
+	if (xdl_mutex_init(&sh->lock)) {
+		xdl_free(sh->bucket);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static void cache_free_shard(struct cache_shard *sh)
+{
+	xdcentry_t *e, *next;
+
+	for (e = sh->head; e; e = next) {
+		next = e->next_lru;
+		xdl_free(e);
+	}
+	xdl_free(sh->bucket);
+#if defined(XDL_MUTEX)
+	xdl_mutex_destroy(&sh->lock);
+#endif
+}
+
+xdcache_t *xdl_cache_new(long max_size)
+{
+	xdcache_t *cache;
+	long i;
+
+#if !defined(XDL_MUTEX)
+	/* nothing would keep threads sharing the cache from corrupting it */
+	return NULL;
+#endif
+	if (!(cache = xdl_malloc(sizeof(*cache))))
+		return NULL;
+	for (i = 0; i < XDL_CACHE_SHARDS; i++)
+		if (cache_init_shard(&cache->shard[i],
+				     max_size / XDL_CACHE_SHARDS) < 0) {
+			while (i--)
+				cache_free_shard(&cache->shard[i]);
+			xdl_free(cache);
+			return NULL;
+		}
+
+	return cache;
+}
+
+void xdl_cache_free(xdcache_t *cache)
+{
+	long i;
+
+	if (!cache)
+		return;
+	for (i = 0; i < XDL_CACHE_SHARDS; i++)
+		cache_free_shard(&cache->shard[i]);
+	xdl_free(cache);
+}
+
+static xdcentry_t **cache_slot(struct cache_shard *sh, xdcachekey_t const *key)
+{
+	xdcentry_t **pe;
+
+	pe = &sh->bucket[(long) (key->h1[1] ^ key->h2[1]) & (sh->nbucket - 1)];
+	for (; *pe; pe = &(*pe)->next)
+		if (!memcmp(&(*pe)->key, key, sizeof(*key)))
+			break;
+	return pe;
+}
+
+static void cache_unlink_lru(struct cache_shard *sh, xdcentry_t *e)
+{
+	if (e->prev_lru)
+		e->prev_lru->next_lru = e->next_lru;
+	else
+		sh->head = e->next_lru;
+	if (e->next_lru)
+		e->next_lru->prev_lru = e->prev_lru;
+	else
+		sh->tail = e->prev_lru;
+}
+
+static void cache_push_lru(struct cache_shard *sh, xdcentry_t *e)
+{
+	e->prev_lru = NULL;
+	e->next_lru = sh->head;
+	if (sh->head)
+		sh->head->prev_lru = e;
+	else
+		sh->tail = e;
+	sh->head = e;
+}
+
+/*
+ * Double the hash table of a shard; a failure only leaves the chains
+ * longer.
+ */
+static void cache_grow(struct cache_shard *sh)
+{
+	xdcentry_t **bucket, *e, *next;
+	long i, n = 2 * sh->nbucket, hi;
+
+	if (!XDL_CALLOC_ARRAY(bucket, n))
+		return;
+	for (i = 0; i < sh->nbucket; i++)
+		for (e = sh->bucket[i]; e; e = next) {
+			next = e->next;
+			hi = (long) (e->key.h1[1] ^ e->key.h2[1]) & (n - 1);
+			e->next = bucket[hi];
+			bucket[hi] = e;
+		}
+	xdl_free(sh->bucket);
+	sh->bucket = bucket;
+	sh->nbucket = n;
+}
+
+/*
+ * Look key up, and copy its script to xscr on a hit. Returns 1 on a hit,
+ * 0 on a miss and -1 on failure.
+ */
+static int cache_lookup(struct cache_shard *sh, xdcachekey_t const *key,
+			xdchange_t **xscr)
+{
+	xdcentry_t *e;
+	int res = 0;
+
+#if defined(XDL_MUTEX)
+	xdl_mutex_lock(&sh->lock);
+#endif
+	if ((e = *cache_slot(sh, key))) {
+		cache_unlink_lru(sh, e);
+		cache_push_lru(sh, e);
+		res = xdl_edits_script(e->edit, e->nr, xscr) < 0 ? -1 : 1;
+	}
+#if defined(XDL_MUTEX)
+	xdl_mutex_unlock(&sh->lock);
+#endif
+	return res;
+}
+
+/*
+ * Store the script of xscr under key, evicting the least recently used
+ * entries over the budget of the shard.
+ */
+static void cache_store(struct cache_shard *sh, xdcachekey_t const *key,
+			xdchange_t *xscr)
+{
+	xdcentry_t *e, **pe;
+	xdchange_t *xch;
+	long nr, size, i;
+
+	for (nr = 0, xch = xscr; xch; xch = xch->next)
+		nr++;
+	size = sizeof(*e) + nr * sizeof(xdedit_t);
+	if (size > sh->max_size || !(e = xdl_malloc(size)))
+		return;
+	e->key = *key;
+	e->size = size;
+	e->nr = nr;
+	e->edit = (xdedit_t *) (e + 1);
+	for (i = 0, xch = xscr; xch; xch = xch->next, i++) {
+		e->edit[i].i1 = xch->i1;
+		e->edit[i].chg1 = xch->chg1;
+		e->edit[i].i2 = xch->i2;
+		e->edit[i].chg2 = xch->chg2;
+		e->edit[i].ignore = xch->ignore;
+	}
+
+#if defined(XDL_MUTEX)
+	xdl_mutex_lock(&sh->lock);
+#endif
+	if (*(pe = cache_slot(sh, key))) {
+		/* another thread got there first */
+		xdl_free(e);
+	} else {
+		e->next = NULL;
+		*pe = e;
+		cache_push_lru(sh, e);
+		sh->size += size;
+		if (++sh->nr > sh->nbucket)
+			cache_grow(sh);
+		while (sh->size > sh->max_size) {
+			e = sh->tail;
+			cache_unlink_lru(sh, e);
+			for (pe = cache_slot(sh, &e->key); *pe != e; pe = &(*pe)->next)
+				;
+			*pe = e->next;
+			sh->size -= e->size;
+			sh->nr--;
+			xdl_free(e);
+		}
+	}
+#if defined(XDL_MUTEX)
+	xdl_mutex_unlock(&sh->lock);
+#endif
+}
+
+int xdl_diff_cached(xdcache_t *cache, mmfile_t *mf1, mmfile_t *mf2,
+		    xpparam_t const *xpp, xdemitconf_t const *xecfg,
+		    xdemitcb_t *ecb)
+{
+	xdcachekey_t key;
+	struct cache_shard *sh;
+	xdchange_t *xscr;
+	xdfenv_t xe;
+	int hit, res;
+
+	/*
+	 * Regexes cannot be told apart by content, and hits have no class
+	 * ids to find moves with.
+	 */
+	if (!cache || xpp->ignore_regex || xecfg->flags & XDL_EMIT_MOVES)
+		return xdl_diff(mf1, mf2, xpp, xecfg, ecb);
+
+	cache_key(&key, mf1, mf2, xpp);
+	sh = &cache->shard[(long) key.h1[0] & (XDL_CACHE_SHARDS - 1)];
+	if ((hit = cache_lookup(sh, &key, &xscr)) < 0)
+		return -1;
+
+	if (hit) {
+		if (xdl_prepare_split_env(mf1, mf2, xpp, &xe) < 0) {
+			xdl_free_script(xscr);
+			return -1;
+		}
+	} else {
+		if (xdl_prepare_env(mf1, mf2, xpp, &xe) < 0 ||
+		    xdl_env_to_script(xpp, &xe, &xscr) < 0)
+			return -1;
+		cache_store(sh, &key, xscr);
+	}
+
+	res = xdl_emit_changes(&xe, xscr, ecb, xecfg);
+	xdl_free_script(xscr);
+	xdl_free_env(&xe);
+
+	return res;
+}
@@ -0,0 +1,156 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+#include "xinclude.h"
+
+
+/*
+ * Changes of ab and bc are intervals of lines of B: [i2, i2 + chg2) for
+ * ab and [i1, i1 + chg1) for bc, where an empty interval still has a
+ * position. Intervals that overlap or touch are merged into a single
+ * change of ac. Outside of them, a line of B maps to a line of A and to
+ * a line of C by the differences in size that the changes before it add
+ * up to, which gives the ends of the merged change in A and C.
+ */
+int xdl_compose_scripts(xdscript_t const *ab, xdscript_t const *bc,
+			xdscript_t *ac)
+{
+	xdedit_t const *e1 = ab->edit, *e2 = bc->edit;
+	long i = 0, j = 0, d1 = 0, d2 = 0, b0, b1, a0, c0, nr = 0, alloc;
+	xdedit_t *edit;
+	int ignore, more;
+
+	ac->edit = NULL;
+	ac->nr = 0;
+	alloc = ab->nr + bc->nr;
+	if (alloc && !XDL_ALLOC_ARRAY(ac->edit, alloc))
+		return -1;
+
+	while (i < ab->nr || j < bc->nr) {
+		if (j >= bc->nr || (i < ab->nr && e1[i].i2 <= e2[j].i1))
+			b0 = e1[i].i2;
+		else
+			b0 = e2[j].i1;
+		a0 = b0 - d1;
+		c0 = b0 + d2;
+		ignore = 1;
+		for (b1 = b0, more = 1; more;) {
+			more = 0;
+			if (i < ab->nr && e1[i].i2 <= b1) {
+				b1 = XDL_MAX(b1, e1[i].i2 + e1[i].chg2);
+				d1 += e1[i].chg2 - e1[i].chg1;
+				ignore &= e1[i].ignore;
+				i++;
+				more = 1;
+			}
+			if (j < bc->nr && e2[j].i1 <= b1) {
+				b1 = XDL_MAX(b1, e2[j].i1 + e2[j].chg1);
+				d2 += e2[j].chg2 - e2[j].chg1;
+				ignore &= e2[j].ignore;
+				j++;
+				more = 1;
+			}
+		}
+
+		/* a line inserted by ab and removed by bc leaves no change */
+		if (b1 - d1 == a0 && b1 + d2 == c0)
+			continue;
+		edit = ac->edit + nr++;
+		edit->i1 = a0;
+		edit->chg1 = b1 - d1 - a0;
+		edit->i2 = c0;
+		edit->chg2 = b1 + d2 - c0;
+		edit->ignore = ignore;
+	}
+	ac->nr = nr;
+
+	return 0;
+}
+
+/*
+ * The n lines of xdf from line i, as a file of their own.
+ */
+static void refine_slice(xdfile_t *xdf, long i, long n, mmfile_t *mf)
+{
+	xrecord_t *last = xdf->recs[i + n - 1];
+
+	mf->ptr = (char *) xdf->recs[i]->ptr;
+	mf->size = (long) (last->ptr + last->size - mf->ptr);
+}
+
+int xdl_refine_script(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
+		      xdscript_t *script)
+{
+	xpparam_t spp;
+	xdfenv_t xe;
+	xdscript_t sub;
+	xdedit_t *edit = NULL, *e;
+	mmfile_t s1, s2;
+	long k, l, nr = 0, alloc = script->nr;
+	int ret = -1;
+
+	memset(&spp, 0, sizeof(spp));
+	if (xdl_prepare_split_env(mf1, mf2, &spp, &xe) < 0)
+		return -1;
+	if (alloc && !XDL_ALLOC_ARRAY(edit, alloc))
+		goto out;
+
+	for (k = 0; k < script->nr; k++) {
+		e = script->edit + k;
+		if (e->i1 < 0 || e->chg1 < 0 || e->i1 > xe.xdf1.nrec - e->chg1 ||
+		    e->i2 < 0 || e->chg2 < 0 || e->i2 > xe.xdf2.nrec - e->chg2)
+			goto out;
+
+		/* only a change on both sides can shrink */
+		if (!e->chg1 || !e->chg2) {
+			if (XDL_ALLOC_GROW(edit, nr + 1, alloc))
+				goto out;
+			edit[nr++] = *e;
+			continue;
+		}
+		refine_slice(&xe.xdf1, e->i1, e->chg1, &s1);
+		refine_slice(&xe.xdf2, e->i2, e->chg2, &s2);
+		if (xdl_diff_script(&s1, &s2, xpp, &sub) < 0)
+			goto out;
+		if (XDL_ALLOC_GROW(edit, nr + sub.nr, alloc)) {
+			xdl_free_edit_script(&sub);
+			goto out;
+		}
+		for (l = 0; l < sub.nr; l++, nr++) {
+			edit[nr] = sub.edit[l];
+			edit[nr].i1 += e->i1;
+			edit[nr].i2 += e->i2;
+		}
+		xdl_free_edit_script(&sub);
+	}
+
+	xdl_free(script->edit);
+	script->edit = edit;
+	script->nr = nr;
+	edit = NULL;
+	ret = 0;
+out:
+	xdl_free(edit);
+	xdl_free_env(&xe);
+	return ret;
+}
@@ -50,10 +50,34 @@ extern "C" {
 
 #define XDF_INDENT_HEURISTIC (1 << 23)
 
+/* run independent regions of patience/histogram diffs on several threads */
+#define XDF_PARALLEL (1 << 24)
+
+/* xdl_diff_lines(): lines with equal hashes are equal, do not compare them */
+#define XDF_TRUST_HASHES (1 << 25)
+
+/* keep change maps as one bit per line, not a byte; ignores XDF_PARALLEL */
+#define XDF_PACKED_CHANGES (1 << 26)
+
 /* xdemitconf_t.flags */
 #define XDL_EMIT_FUNCNAMES (1 << 0)
 #define XDL_EMIT_NO_HUNK_HDR (1 << 1)
 #define XDL_EMIT_FUNCCONTEXT (1 << 2)
+/* report blocks moved within the file with the origins below */
+#define XDL_EMIT_MOVES (1 << 3)
+
+/* out_line origins, in place of '-' and '+', of moved lines */
+#define XDL_ORIGIN_MOVED_FROM '<'
+#define XDL_ORIGIN_MOVED_TO '>'
+
+/* xdl_script_encode() flags */
+#define XDL_SCRIPT_HASHES (1 << 0)
+#define XDL_SCRIPT_TEXT (1 << 1)
+
+/* line status from xdl_linemap_line() */
+#define XDL_LINE_SAME 0
+#define XDL_LINE_DELETED 1
+#define XDL_LINE_INSERTED 2
 
 /* merge simplification levels */
 #define XDL_MERGE_MINIMAL 0
@@ -70,6 +94,13 @@ extern "C" {
 #define XDL_MERGE_DIFF3 1
 #define XDL_MERGE_ZEALOUS_DIFF3 2
 
+/* merge region types */
+#define XDL_REGION_CLEAN 0
+#define XDL_REGION_OURS 1
+#define XDL_REGION_THEIRS 2
+#define XDL_REGION_BOTH 3
+#define XDL_REGION_CONFLICT 4
+
 typedef struct s_mmfile {
 	char *ptr;
 	long size;
@@ -80,6 +111,15 @@ typedef struct s_mmbuffer {
 	long size;
 } mmbuffer_t;
 
+/*
+ * A file held in several chunks, in order. Lines may run across chunk
+ * boundaries.
+ */
+typedef struct s_mmrope {
+	mmbuffer_t *chunk;
+	long nr;
+} mmrope_t;
+
 typedef struct s_xpparam {
 	unsigned long flags;
 
@@ -90,6 +130,9 @@ typedef struct s_xpparam {
 	/* See Documentation/diff-options.txt. */
 	char **anchors;
 	size_t anchors_nr;
+
+	/* XDF_PARALLEL: number of threads to use, 0 for one per CPU */
+	int max_threads;
 } xpparam_t;
 
 typedef struct s_xdemitcb {
@@ -127,6 +170,227 @@ long xdl_mmfile_size(mmfile_t *mmf);
 int xdl_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 	     xdemitconf_t const *xecfg, xdemitcb_t *ecb);
 
+/*
+ * One change of an edit script: chg1 lines of mf1 starting at i1 are
+ * replaced by chg2 lines of mf2 starting at i2, counting from 0. ignore
+ * is set for changes that XDF_IGNORE_BLANK_LINES or ignore_regex hide.
+ */
+typedef struct s_xdedit {
+	long i1, chg1;
+	long i2, chg2;
+	int ignore;
+} xdedit_t;
+
+typedef struct s_xdscript {
+	xdedit_t *edit;
+	long nr;
+} xdscript_t;
+
+/*
+ * Diff mf1 and mf2 like xdl_diff(), but return the changes as an array
+ * instead of emitting them. Free it with xdl_free_edit_script().
+ */
+int xdl_diff_script(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
+		    xdscript_t *script);
+void xdl_free_edit_script(xdscript_t *script);
+
+/*
+ * Encode the script of a diff of mf1 and mf2 into a compact binary form
+ * in out, which the caller frees. With XDL_SCRIPT_HASHES, a hash of the
+ * lines of each change is added; with XDL_SCRIPT_TEXT, the lines each
+ * change takes from mf2, so that xdl_apply() can rebuild mf2 from mf1.
+ * xdl_script_decode() turns it back into a script; xdl_script_replay()
+ * emits it against mf1 and mf2 like xdl_diff() would, without diffing
+ * them, and fails if they do not have the line counts or, when present,
+ * the hashes it was encoded with.
+ */
+int xdl_script_encode(xdscript_t const *script, mmfile_t *mf1, mmfile_t *mf2,
+		      unsigned long flags, mmbuffer_t *out);
+int xdl_script_decode(mmbuffer_t const *enc, xdscript_t *script);
+int xdl_script_replay(mmbuffer_t const *enc, mmfile_t *mf1, mmfile_t *mf2,
+		      xdemitconf_t const *xecfg, xdemitcb_t *ecb);
+
+/*
+ * Compose the script ab of a diff of files A and B with the script bc of
+ * a diff of B and C into a script ac of A and C, in time linear in the
+ * number of changes. Changes of ab and bc that overlap or touch in B
+ * become a single change of ac, which may be larger than needed.
+ * xdl_refine_script() re-diffs each change of a script of mf1 and mf2
+ * on its own, splitting it into the changes that xdl_diff_script()
+ * finds between its lines.
+ */
+int xdl_compose_scripts(xdscript_t const *ab, xdscript_t const *bc,
+			xdscript_t *ac);
+int xdl_refine_script(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
+		      xdscript_t *script);
+
+/*
+ * An index of the changes of a script, for translating line numbers,
+ * counting from 0, from one side of the diff to the other in
+ * O(log changes). xdl_linemap_line() maps line of side 1 (mf1) to side
+ * 2, or the other way. A line left alone by the script gets status
+ * XDL_LINE_SAME and its new number. A line the script removes from
+ * side 1 gets XDL_LINE_DELETED, and one it inserts in side 2 gets
+ * XDL_LINE_INSERTED, and both map to where their change starts on the
+ * other side. xdl_linemap_lines() maps nr lines into out and status; it
+ * takes linear time in nr plus the number of changes when line is
+ * sorted.
+ */
+typedef struct s_xdlinemap xdlinemap_t;
+
+xdlinemap_t *xdl_linemap_new(xdscript_t const *script);
+void xdl_linemap_free(xdlinemap_t *map);
+long xdl_linemap_line(xdlinemap_t const *map, int side, long line, int *status);
+void xdl_linemap_lines(xdlinemap_t const *map, int side, long const *line,
+		       long nr, long *out, int *status);
+
+/* Where a line of the last revision given to xdl_blame() comes from. */
+typedef struct s_xdblame {
+	long rev;	/* index of the revision that introduced it */
+	long line;	/* its line there, counting from 0 */
+} xdblame_t;
+
+/*
+ * Attribute each line of rev[nr - 1] to the revision, of the nr in rev
+ * from oldest to newest, that introduced it, by diffing each revision
+ * with the one before it, newest first. Each revision is split and
+ * hashed once, and the walk stops as soon as every line is attributed;
+ * lines that make it back to rev[0] come from there. Stores an array of
+ * one entry per line in blame and its size in nlines; free it with
+ * xdl_free_blame().
+ */
+int xdl_blame(mmfile_t *rev, long nr, xpparam_t const *xpp,
+	      xdblame_t **blame, long *nlines);
+void xdl_free_blame(xdblame_t *blame);
+
+/*
+ * Similarity of files, for telling renames and copies apart. Scores run
+ * from 0 to XDL_SIMILARITY_MAX, which means equal: twice the lines two
+ * files have in common over their total number of lines.
+ *
+ * xdl_sketch() sums up the lines of a file, hashed under the whitespace
+ * flags of xpp, in a sketch of fixed size. xdl_sketch_similarity()
+ * compares two sketches in constant time for an estimated score, which
+ * ignores the order of lines and so tends to be above the exact one.
+ * xdl_similarity_estimate() does both for a single pair, in time linear
+ * in the files, and xdl_similarity() scores a pair exactly, with a diff
+ * that only counts lines. All return < 0 on error.
+ */
+#define XDL_SIMILARITY_MAX 10000
+#define XDL_SKETCH_BITS 6
+#define XDL_SKETCH_BINS (1 << XDL_SKETCH_BITS)
+
+typedef struct s_xdsketch {
+	uint32_t min[XDL_SKETCH_BINS];
+	long nrec;
+} xdsketch_t;
+
+int xdl_sketch(mmfile_t *mf, xpparam_t const *xpp, xdsketch_t *sk);
+long xdl_sketch_similarity(xdsketch_t const *a, xdsketch_t const *b);
+long xdl_similarity_estimate(mmfile_t *mf1, mmfile_t *mf2,
+			     xpparam_t const *xpp);
+long xdl_similarity(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp);
+
+typedef struct s_xdsimpair {
+	long src, dst;	/* indexes in the src and dst arrays */
+	long score;
+} xdsimpair_t;
+
+/*
+ * Find the files of src that dst files are most similar to. Every file
+ * is sketched once and every pair estimated; the ncand best estimates
+ * of each dst file are then scored exactly, and those scoring at least
+ * min_score are returned in pairs, by dst and then best score first.
+ * Free the array with xdl_free_pairs().
+ */
+int xdl_similar_pairs(mmfile_t *src, long nsrc, mmfile_t *dst, long ndst,
+		      xpparam_t const *xpp, long min_score, long ncand,
+		      xdsimpair_t **pairs, long *npairs);
+void xdl_free_pairs(xdsimpair_t *pairs);
+
+/*
+ * A line the caller has already split off and hashed. Lines that are to
+ * match, under the whitespace flags in use, must have equal hashes.
+ */
+typedef struct s_xdline {
+	char const *ptr;
+	long size;
+	uint64_t hash;
+} xdline_t;
+
+typedef struct s_xdlines {
+	xdline_t const *line;
+	long nr;
+} xdlines_t;
+
+/*
+ * Like xdl_diff(), on files held in chunks. Only the lines running across
+ * a chunk boundary are copied.
+ */
+int xdl_diff_rope(mmrope_t *mr1, mmrope_t *mr2, xpparam_t const *xpp,
+		  xdemitconf_t const *xecfg, xdemitcb_t *ecb);
+
+/*
+ * Like xdl_diff() and xdl_diff_script(), on lines that are already split
+ * and hashed. Only the hashes are used to tell lines apart, plus a byte
+ * comparison of lines with equal hashes unless XDF_TRUST_HASHES is set.
+ */
+int xdl_diff_lines(xdlines_t const *l1, xdlines_t const *l2, xpparam_t const *xpp,
+		   xdemitconf_t const *xecfg, xdemitcb_t *ecb);
+int xdl_diff_lines_script(xdlines_t const *l1, xdlines_t const *l2,
+			  xpparam_t const *xpp, xdscript_t *script);
+
+/*
+ * An incremental diff of two files that keep being edited. The session
+ * holds its own copy of the text; each edit re-diffs only the stretch of
+ * the files around it, so the script may occasionally differ from what
+ * xdl_diff_script() would return on the whole files, but it always
+ * describes a correct diff. xpp is copied; what its pointers refer to
+ * must outlive the session.
+ *
+ * xdl_session_replace() replaces nr lines of side 1 (mf1) or 2 (mf2),
+ * counting from line 0, with the lines of text. Only the last line of a
+ * file may lack a newline. xdl_session_replace_bytes() replaces len
+ * bytes from offset off of the side's current text instead; the lines
+ * the range touches are re-split and replaced as a whole. Both return 0
+ * once the edit is made, and -1 if it is invalid or could not be made,
+ * which leaves the session as it was. xdl_session_script() returns -1 if
+ * it runs out of memory.
+ */
+typedef struct s_xdsession xdsession_t;
+
+xdsession_t *xdl_session_new(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp);
+int xdl_session_replace(xdsession_t *s, int side, long line, long nr,
+			mmfile_t *text);
+int xdl_session_replace_bytes(xdsession_t *s, int side, long off, long len,
+			      mmfile_t *text);
+int xdl_session_script(xdsession_t *s, xdscript_t *script);
+void xdl_session_free(xdsession_t *s);
+
+/*
+ * A cache of diff results, keyed by the contents of the two files and by
+ * xpp, holding up to about max_size bytes. xdl_diff_cached() works like
+ * xdl_diff(); a hit skips the diff and emits the stored script with the
+ * xecfg of the call. Diffs with an ignore_regex are not cached. The
+ * cache can be shared between threads. Builds without a lock primitive
+ * (XDL_NO_THREADS) have no cache: xdl_cache_new() returns NULL there, and
+ * xdl_diff_cached() with a NULL cache is just xdl_diff().
+ */
+typedef struct s_xdcache xdcache_t;
+
+xdcache_t *xdl_cache_new(long max_size);
+void xdl_cache_free(xdcache_t *cache);
+int xdl_diff_cached(xdcache_t *cache, mmfile_t *mf1, mmfile_t *mf2,
+		    xpparam_t const *xpp, xdemitconf_t const *xecfg,
+		    xdemitcb_t *ecb);
+
+/*
+ * Release the scratch memory xdiff keeps around between calls in the
+ * calling thread. Long-lived threads never need this; threads about to
+ * exit should call it.
+ */
+void xdl_free_thread_cache(void);
+
 typedef struct s_xmparam {
 	xpparam_t xpp;
 	int marker_size;
@@ -140,9 +404,158 @@ typedef struct s_xmparam {
 
 #define DEFAULT_CONFLICT_MARKER_SIZE 7
 
+/*
+ * Receives the merge result in order, one or more pieces at a time. The
+ * pieces usually point into the input files and are only valid during
+ * the call.
+ */
+typedef struct s_xdmergecb {
+	void *priv;
+	int (*out)(void *, mmbuffer_t *, int);
+} xdmergecb_t;
+
 int xdl_merge(mmfile_t *orig, mmfile_t *mf1, mmfile_t *mf2,
 		xmparam_t const *xmp, mmbuffer_t *result);
 
+/*
+ * Like xdl_merge(), but stream the result to cb instead of building it
+ * in memory.
+ */
+int xdl_merge_stream(mmfile_t *orig, mmfile_t *mf1, mmfile_t *mf2,
+		     xmparam_t const *xmp, xdmergecb_t *cb);
+
+/*
+ * Like xdl_merge() and xdl_merge_stream(), on files held in chunks.
+ */
+int xdl_merge_rope(mmrope_t *orig, mmrope_t *mr1, mmrope_t *mr2,
+		   xmparam_t const *xmp, mmbuffer_t *result);
+int xdl_merge_rope_stream(mmrope_t *orig, mmrope_t *mr1, mmrope_t *mr2,
+			  xmparam_t const *xmp, xdmergecb_t *cb);
+
+/*
+ * One region of a merge result. Together, the regions cover each of
+ * orig, mf1 and mf2 from start to end. i0/chg0, i1/chg1 and i2/chg2 are
+ * 0-based line ranges in orig, mf1 and mf2, and base, ours and theirs
+ * are views of the same lines in the input files.
+ *
+ * XDL_REGION_CLEAN: neither side changed the lines, or both changed
+ *	them the same way; the result has the lines from mf1.
+ * XDL_REGION_OURS, XDL_REGION_THEIRS: only one side changed the lines
+ *	(or favor resolved a conflict); the result has that side's lines.
+ * XDL_REGION_BOTH: the result has the lines of mf1, then those of mf2.
+ * XDL_REGION_CONFLICT: the sides disagree. Conflicts split by the
+ *	zealous levels report the whole base with their first piece.
+ *
+ * If one side did not change orig at all, the result is a single region
+ * taking the other side.
+ */
+typedef struct s_xdmregion {
+	int type;
+	long i0, chg0;
+	long i1, chg1;
+	long i2, chg2;
+	mmbuffer_t base, ours, theirs;
+} xdmregion_t;
+
+/* One merge of a batch, see xdl_merge_batch(). */
+typedef struct s_xdmergejob {
+	mmfile_t orig, mf1, mf2;
+	mmbuffer_t result;
+	int status;	/* number of conflicts, or < 0 on error */
+} xdmergejob_t;
+
+/*
+ * Run xdl_merge() on each of the nr jobs, with the same parameters.
+ * Inputs with identical contents, e.g. an ancestor shared by several
+ * merges, are split and hashed only once. With XDF_PARALLEL the merges
+ * run on worker threads. Returns < 0 if the batch could not be set up;
+ * otherwise each job holds its own result and status.
+ */
+int xdl_merge_batch(xdmergejob_t *job, long nr, xmparam_t const *xmp);
+
+/*
+ * Merge like xdl_merge(), but return the result as an array of regions
+ * instead of rendering it. Returns the number of conflicts, or < 0 on
+ * error. Free the array with xdl_free_regions().
+ */
+int xdl_merge_regions(mmfile_t *orig, mmfile_t *mf1, mmfile_t *mf2,
+		      xmparam_t const *xmp, xdmregion_t **regions, long *nr);
+void xdl_free_regions(xdmregion_t *regions);
+
+typedef struct s_xapparam {
+	/* whitespace flags for matching context, XDF_PARALLEL for batches */
+	xpparam_t xpp;
+	/* context lines a hunk may drop at each end to find its place */
+	long fuzz;
+} xapparam_t;
+
+/*
+ * Apply patch to mf, and store the patched file in result, which the
+ * caller frees. patch is either a unified diff of a single file, or a
+ * script from xdl_script_encode() with XDL_SCRIPT_TEXT.
+ *
+ * A hunk of a unified diff is tried first at its line number, shifted
+ * by how far the hunks before it moved, then at the closest line where
+ * its context matches, under the whitespace flags of xap->xpp. Hunks
+ * that do not match anywhere, even after dropping up to xap->fuzz
+ * context lines at each end, are left out. A script only applies to the
+ * file it was made from.
+ *
+ * Returns the number of hunks or changes left out, or < 0 on error.
+ */
+int xdl_apply(mmfile_t *mf, mmbuffer_t const *patch, xapparam_t const *xap,
+	      mmbuffer_t *result);
+
+/* One patch of a batch, see xdl_apply_batch(). */
+typedef struct s_xdapplyjob {
+	mmfile_t mf;
+	mmbuffer_t patch;
+	mmbuffer_t result;
+	int status;	/* what xdl_apply() returned */
+} xdapplyjob_t;
+
+/*
+ * Run xdl_apply() on each of the nr jobs, with the same parameters. With
+ * XDF_PARALLEL the patches are applied on worker threads. Returns < 0 if
+ * the batch could not be set up; otherwise each job holds its own
+ * result and status.
+ */
+int xdl_apply_batch(xdapplyjob_t *job, long nr, xapparam_t const *xap);
+
+/*
+ * Return the length of the key of the record rec, of size bytes with its
+ * newline, and point key at it; < 0 keys the record by all of its text.
+ */
+typedef long (*xdl_key_func_t)(const char *rec, long size, const char **key,
+			       void *priv);
+
+typedef struct s_xdkeyparam {
+	/*
+	 * Whitespace flags apply to records, and to keys unless the files
+	 * are sorted: the merge join compares keys byte for byte.
+	 */
+	xpparam_t xpp;
+	/* NULL keys each record by all of its text */
+	xdl_key_func_t key_func;
+	void *key_priv;
+	/* both files are sorted by key, in byte order; see xpp above */
+	int sorted;
+} xdkeyparam_t;
+
+/*
+ * Diff mf1 and mf2 as sets of keyed records, such as CSV rows or
+ * key-value exports, instead of as sequences of lines. Records are paired
+ * by key, with a hash join or, if xkp->sorted, a merge join, so the cost
+ * is about linear however much changed. Paired records that keep their
+ * order and contents are the common lines; modified records are emitted
+ * as a deletion and an insertion in the same hunk, records whose key is
+ * only in mf1 or mf2 as removed or added, and, without xkp->sorted,
+ * records that moved relative to the others as removed and added again.
+ * The output goes to ecb, or to xecfg->hunk_func, like xdl_diff().
+ */
+int xdl_diff_keyed(mmfile_t *mf1, mmfile_t *mf2, xdkeyparam_t const *xkp,
+		   xdemitconf_t const *xecfg, xdemitcb_t *ecb);
+
 #ifdef __cplusplus
 }
 #endif /* #ifdef __cplusplus */
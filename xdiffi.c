@@ -33,293 +33,49 @@ typedef struct s_xdpsplit {
 	int min_lo, min_hi;
 } xdpsplit_t;
 
-/*
- * See "An O(ND) Difference Algorithm and its Variations", by Eugene Myers.
- * Basically considers a "box" (off1, off2, lim1, lim2) and scan from both
- * the forward diagonal starting from (off1, off2) and the backward diagonal
- * starting from (lim1, lim2). If the K values on the same diagonal crosses
- * returns the furthest point of reach. We might encounter expensive edge cases
- * using this algorithm, so a little bit of heuristic is needed to cut the
- * search and to return a suboptimal point.
- */
-static long xdl_split(unsigned long const *ha1, long off1, long lim1,
-		      unsigned long const *ha2, long off2, long lim2,
-		      long *kvdf, long *kvdb, int need_min, xdpsplit_t *spl,
-		      xdalgoenv_t *xenv) {
-	long dmin = off1 - lim2, dmax = lim1 - off2;
-	long fmid = off1 - off2, bmid = lim1 - lim2;
-	long odd = (fmid - bmid) & 1;
-	long fmin = fmid, fmax = fmid;
-	long bmin = bmid, bmax = bmid;
-	long ec, d, i1, i2, prev1, best, dd, v, k;
-
-	/*
-	 * Set initial diagonal values for both forward and backward path.
-	 */
-	kvdf[fmid] = off1;
-	kvdb[bmid] = lim1;
-
-	for (ec = 1;; ec++) {
-		int got_snake = 0;
-
-		/*
-		 * We need to extend the diagonal "domain" by one. If the next
-		 * values exits the box boundaries we need to change it in the
-		 * opposite direction because (max - min) must be a power of
-		 * two.
-		 *
-		 * Also we initialize the external K value to -1 so that we can
-		 * avoid extra conditions in the check inside the core loop.
-		 */
-		if (fmin > dmin)
-			kvdf[--fmin - 1] = -1;
-		else
-			++fmin;
-		if (fmax < dmax)
-			kvdf[++fmax + 1] = -1;
-		else
-			--fmax;
-
-		for (d = fmax; d >= fmin; d -= 2) {
-			if (kvdf[d - 1] >= kvdf[d + 1])
-				i1 = kvdf[d - 1] + 1;
-			else
-				i1 = kvdf[d + 1];
-			prev1 = i1;
-			i2 = i1 - d;
-			for (; i1 < lim1 && i2 < lim2 && ha1[i1] == ha2[i2]; i1++, i2++);
-			if (i1 - prev1 > xenv->snake_cnt)
-				got_snake = 1;
-			kvdf[d] = i1;
-			if (odd && bmin <= d && d <= bmax && kvdb[d] <= i1) {
-				spl->i1 = i1;
-				spl->i2 = i2;
-				spl->min_lo = spl->min_hi = 1;
-				return ec;
-			}
-		}
-
-		/*
-		 * We need to extend the diagonal "domain" by one. If the next
-		 * values exits the box boundaries we need to change it in the
-		 * opposite direction because (max - min) must be a power of
-		 * two.
-		 *
-		 * Also we initialize the external K value to -1 so that we can
-		 * avoid extra conditions in the check inside the core loop.
-		 */
-		if (bmin > dmin)
-			kvdb[--bmin - 1] = XDL_LINE_MAX;
-		else
-			++bmin;
-		if (bmax < dmax)
-			kvdb[++bmax + 1] = XDL_LINE_MAX;
-		else
-			--bmax;
-
-		for (d = bmax; d >= bmin; d -= 2) {
-			if (kvdb[d - 1] < kvdb[d + 1])
-				i1 = kvdb[d - 1];
-			else
-				i1 = kvdb[d + 1] - 1;
-			prev1 = i1;
-			i2 = i1 - d;
-			for (; i1 > off1 && i2 > off2 && ha1[i1 - 1] == ha2[i2 - 1]; i1--, i2--);
-			if (prev1 - i1 > xenv->snake_cnt)
-				got_snake = 1;
-			kvdb[d] = i1;
-			if (!odd && fmin <= d && d <= fmax && i1 <= kvdf[d]) {
-				spl->i1 = i1;
-				spl->i2 = i2;
-				spl->min_lo = spl->min_hi = 1;
-				return ec;
-			}
-		}
-
-		if (need_min)
-			continue;
-
-		/*
-		 * If the edit cost is above the heuristic trigger and if
-		 * we got a good snake, we sample current diagonals to see
-		 * if some of them have reached an "interesting" path. Our
-		 * measure is a function of the distance from the diagonal
-		 * corner (i1 + i2) penalized with the distance from the
-		 * mid diagonal itself. If this value is above the current
-		 * edit cost times a magic factor (XDL_K_HEUR) we consider
-		 * it interesting.
-		 */
-		if (got_snake && ec > xenv->heur_min) {
-			for (best = 0, d = fmax; d >= fmin; d -= 2) {
-				dd = d > fmid ? d - fmid: fmid - d;
-				i1 = kvdf[d];
-				i2 = i1 - d;
-				v = (i1 - off1) + (i2 - off2) - dd;
-
-				if (v > XDL_K_HEUR * ec && v > best &&
-				    off1 + xenv->snake_cnt <= i1 && i1 < lim1 &&
-				    off2 + xenv->snake_cnt <= i2 && i2 < lim2) {
-					for (k = 1; ha1[i1 - k] == ha2[i2 - k]; k++)
-						if (k == xenv->snake_cnt) {
-							best = v;
-							spl->i1 = i1;
-							spl->i2 = i2;
-							break;
-						}
-				}
-			}
-			if (best > 0) {
-				spl->min_lo = 1;
-				spl->min_hi = 0;
-				return ec;
-			}
-
-			for (best = 0, d = bmax; d >= bmin; d -= 2) {
-				dd = d > bmid ? d - bmid: bmid - d;
-				i1 = kvdb[d];
-				i2 = i1 - d;
-				v = (lim1 - i1) + (lim2 - i2) - dd;
-
-				if (v > XDL_K_HEUR * ec && v > best &&
-				    off1 < i1 && i1 <= lim1 - xenv->snake_cnt &&
-				    off2 < i2 && i2 <= lim2 - xenv->snake_cnt) {
-					for (k = 0; ha1[i1 + k] == ha2[i2 + k]; k++)
-						if (k == xenv->snake_cnt - 1) {
-							best = v;
-							spl->i1 = i1;
-							spl->i2 = i2;
-							break;
-						}
-				}
-			}
-			if (best > 0) {
-				spl->min_lo = 0;
-				spl->min_hi = 1;
-				return ec;
-			}
-		}
+#define XDL_KV_T int32_t
+#define XDL_KV_MAX INT32_MAX
+#define XDL_KV_FN(n) n##_32
+#include "xsplit.h"
 
-		/*
-		 * Enough is enough. We spent too much time here and now we
-		 * collect the furthest reaching path using the (i1 + i2)
-		 * measure.
-		 */
-		if (ec >= xenv->mxcost) {
-			long fbest, fbest1, bbest, bbest1;
-
-			fbest = fbest1 = -1;
-			for (d = fmax; d >= fmin; d -= 2) {
-				i1 = XDL_MIN(kvdf[d], lim1);
-				i2 = i1 - d;
-				if (lim2 < i2)
-					i1 = lim2 + d, i2 = lim2;
-				if (fbest < i1 + i2) {
-					fbest = i1 + i2;
-					fbest1 = i1;
-				}
-			}
+#define XDL_KV_T long
+#define XDL_KV_MAX XDL_LINE_MAX
+#define XDL_KV_FN(n) n##_long
+#include "xsplit.h"
 
-			bbest = bbest1 = XDL_LINE_MAX;
-			for (d = bmax; d >= bmin; d -= 2) {
-				i1 = XDL_MAX(off1, kvdb[d]);
-				i2 = i1 - d;
-				if (i2 < off2)
-					i1 = off2 + d, i2 = off2;
-				if (i1 + i2 < bbest) {
-					bbest = i1 + i2;
-					bbest1 = i1;
-				}
-			}
 
-			if ((lim1 + lim2) - bbest < fbest - (off1 + off2)) {
-				spl->i1 = fbest1;
-				spl->i2 = fbest - fbest1;
-				spl->min_lo = 1;
-				spl->min_hi = 0;
-			} else {
-				spl->i1 = bbest1;
-				spl->i2 = bbest - bbest1;
-				spl->min_lo = 0;
-				spl->min_hi = 1;
-			}
-			return ec;
-		}
-	}
-}
-
-
-/*
- * Rule: "Divide et Impera" (divide & conquer). Recursively split the box in
- * sub-boxes by calling the box splitting function. Note that the real job
- * (marking changed lines) is done in the two boundary reaching checks.
- */
 int xdl_recs_cmp(diffdata_t *dd1, long off1, long lim1,
 		 diffdata_t *dd2, long off2, long lim2,
 		 long *kvdf, long *kvdb, int need_min, xdalgoenv_t *xenv) {
-	unsigned long const *ha1 = dd1->ha, *ha2 = dd2->ha;
 
-	/*
-	 * Shrink the box by walking through each diagonal snake (SW and NE).
-	 */
-	for (; off1 < lim1 && off2 < lim2 && ha1[off1] == ha2[off2]; off1++, off2++);
-	for (; off1 < lim1 && off2 < lim2 && ha1[lim1 - 1] == ha2[lim2 - 1]; lim1--, lim2--);
-
-	/*
-	 * If one dimension is empty, then all records on the other one must
-	 * be obviously changed.
-	 */
-	if (off1 == lim1) {
-		char *rchg2 = dd2->rchg;
-		long *rindex2 = dd2->rindex;
-
-		for (; off2 < lim2; off2++)
-			rchg2[rindex2[off2]] = 1;
-	} else if (off2 == lim2) {
-		char *rchg1 = dd1->rchg;
-		long *rindex1 = dd1->rindex;
-
-		for (; off1 < lim1; off1++)
-			rchg1[rindex1[off1]] = 1;
-	} else {
-		xdpsplit_t spl;
-		spl.i1 = spl.i2 = 0;
-
-		/*
-		 * Divide ...
-		 */
-		if (xdl_split(ha1, off1, lim1, ha2, off2, lim2, kvdf, kvdb,
-			      need_min, &spl, xenv) < 0) {
+	return xdl_recs_cmp_long(dd1, off1, lim1, dd2, off2, lim2,
+				 kvdf, kvdb, need_min, xenv);
+}
 
-			return -1;
-		}
 
-		/*
-		 * ... et Impera.
-		 */
-		if (xdl_recs_cmp(dd1, off1, spl.i1, dd2, off2, spl.i2,
-				 kvdf, kvdb, spl.min_lo, xenv) < 0 ||
-		    xdl_recs_cmp(dd1, spl.i1, lim1, dd2, spl.i2, lim2,
-				 kvdf, kvdb, spl.min_hi, xenv) < 0) {
+int xdl_do_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
+		xdfenv_t *xe) {
 
-			return -1;
-		}
-	}
+	if (xdl_prepare_env(mf1, mf2, xpp, xe) < 0)
+		return -1;
 
-	return 0;
+	return xdl_diff_env(xpp, xe);
 }
 
 
-int xdl_do_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
-		xdfenv_t *xe) {
-	long ndiags;
-	long *kvd, *kvdf, *kvdb;
+/*
+ * Run the diff algorithm on an environment that has already been set up
+ * by xdl_prepare_env() or xdl_prepare_merge_env(). The environment is
+ * freed on failure.
+ */
+int xdl_diff_env(xpparam_t const *xpp, xdfenv_t *xe) {
+	long ndiags, koff;
+	void *kvd;
+	int narrow;
 	xdalgoenv_t xenv;
 	diffdata_t dd1, dd2;
 	int res;
 
-	if (xdl_prepare_env(mf1, mf2, xpp, xe) < 0)
-		return -1;
-
 	if (XDF_DIFF_ALG(xpp->flags) == XDF_PATIENCE_DIFF) {
 		res = xdl_do_patience_diff(xpp, xe);
 		goto out;
@@ -335,17 +91,18 @@ int xdl_do_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 	 * algorithm.
 	 *
 	 * One is to store the forward path and one to store the backward path.
+	 * They live in the per-thread scratch buffer, and are only as wide as
+	 * the number of records requires.
 	 */
 	ndiags = xe->xdf1.nreff + xe->xdf2.nreff + 3;
-	if (!XDL_ALLOC_ARRAY(kvd, 2 * ndiags + 2)) {
+	narrow = ndiags < INT32_MAX;
+	if (!(kvd = xdl_kvd_get(2 * ndiags + 2,
+				narrow ? sizeof(int32_t) : sizeof(long)))) {
 
 		xdl_free_env(xe);
 		return -1;
 	}
-	kvdf = kvd;
-	kvdb = kvdf + ndiags;
-	kvdf += xe->xdf2.nreff + 1;
-	kvdb += xe->xdf2.nreff + 1;
+	koff = xe->xdf2.nreff + 1;
 
 	xenv.mxcost = xdl_bogosqrt(ndiags);
 	if (xenv.mxcost < XDL_MAX_COST_MIN)
@@ -355,17 +112,26 @@ int xdl_do_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 
 	dd1.nrec = xe->xdf1.nreff;
 	dd1.ha = xe->xdf1.ha;
-	dd1.rchg = xe->xdf1.rchg;
+	dd1.xdf = &xe->xdf1;
 	dd1.rindex = xe->xdf1.rindex;
 	dd2.nrec = xe->xdf2.nreff;
 	dd2.ha = xe->xdf2.ha;
-	dd2.rchg = xe->xdf2.rchg;
+	dd2.xdf = &xe->xdf2;
 	dd2.rindex = xe->xdf2.rindex;
 
-	res = xdl_recs_cmp(&dd1, 0, dd1.nrec, &dd2, 0, dd2.nrec,
-			   kvdf, kvdb, (xpp->flags & XDF_NEED_MINIMAL) != 0,
-			   &xenv);
-	xdl_free(kvd);
+	if (narrow)
+		res = xdl_recs_cmp_32(&dd1, 0, dd1.nrec, &dd2, 0, dd2.nrec,
+				      (int32_t *) kvd + koff,
+				      (int32_t *) kvd + ndiags + koff,
+				      (xpp->flags & XDF_NEED_MINIMAL) != 0,
+				      &xenv);
+	else
+		res = xdl_recs_cmp_long(&dd1, 0, dd1.nrec, &dd2, 0, dd2.nrec,
+					(long *) kvd + koff,
+					(long *) kvd + ndiags + koff,
+					(xpp->flags & XDF_NEED_MINIMAL) != 0,
+					&xenv);
+	xdl_kvd_put(kvd);
  out:
 	if (res < 0)
 		xdl_free_env(xe);
@@ -374,23 +140,6 @@ int xdl_do_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 }
 
 
-static xdchange_t *xdl_add_change(xdchange_t *xscr, long i1, long i2, long chg1, long chg2) {
-	xdchange_t *xch;
-
-	if (!(xch = (xdchange_t *) xdl_malloc(sizeof(xdchange_t))))
-		return NULL;
-
-	xch->next = xscr;
-	xch->i1 = i1;
-	xch->i2 = i2;
-	xch->chg1 = chg1;
-	xch->chg2 = chg2;
-	xch->ignore = 0;
-
-	return xch;
-}
-
-
 static int recs_match(xrecord_t *rec1, xrecord_t *rec2)
 {
 	return (rec1->ha == rec2->ha);
@@ -433,6 +182,18 @@ static int get_indent(xrecord_t *rec)
 	return -1;
 }
 
+/*
+ * The indent heuristic looks at the same records over and over again, so
+ * xdl_change_compact() keeps the get_indent() of each record, offset by
+ * 2 so that 0 means "not computed yet" (see the MAX_INDENT note above).
+ */
+static int get_indent_cached(const xdfile_t *xdf, unsigned char *indent, long i)
+{
+	if (!indent[i])
+		indent[i] = get_indent(xdf->recs[i]) + 2;
+	return indent[i] - 2;
+}
+
 /*
  * If more than this number of consecutive blank rows are found, just return
  * this value. This avoids requiring O(N^2) work for pathological cases, and
@@ -487,8 +248,8 @@ struct split_score {
 /*
  * Fill m with information about a hypothetical split of xdf above line split.
  */
-static void measure_split(const xdfile_t *xdf, long split,
-			  struct split_measurement *m)
+static void measure_split(const xdfile_t *xdf, unsigned char *indent,
+			  long split, struct split_measurement *m)
 {
 	long i;
 
@@ -497,13 +258,13 @@ static void measure_split(const xdfile_t *xdf, long split,
 		m->indent = -1;
 	} else {
 		m->end_of_file = 0;
-		m->indent = get_indent(xdf->recs[split]);
+		m->indent = get_indent_cached(xdf, indent, split);
 	}
 
 	m->pre_blank = 0;
 	m->pre_indent = -1;
 	for (i = split - 1; i >= 0; i--) {
-		m->pre_indent = get_indent(xdf->recs[i]);
+		m->pre_indent = get_indent_cached(xdf, indent, i);
 		if (m->pre_indent != -1)
 			break;
 		m->pre_blank += 1;
@@ -516,7 +277,7 @@ static void measure_split(const xdfile_t *xdf, long split,
 	m->post_blank = 0;
 	m->post_indent = -1;
 	for (i = split + 1; i < xdf->nrec; i++) {
-		m->post_indent = get_indent(xdf->recs[i]);
+		m->post_indent = get_indent_cached(xdf, indent, i);
 		if (m->post_indent != -1)
 			break;
 		m->post_blank += 1;
@@ -672,6 +433,20 @@ static void score_add_split(const struct split_measurement *m, struct split_scor
 	}
 }
 
+/*
+ * The score of the split of xdf above line split, on its own.
+ */
+static void score_split(const xdfile_t *xdf, unsigned char *indent,
+			long split, struct split_score *s)
+{
+	struct split_measurement m;
+
+	s->effective_indent = 0;
+	s->penalty = 0;
+	measure_split(xdf, indent, split, &m);
+	score_add_split(&m, s);
+}
+
 static int score_cmp(struct split_score *s1, struct split_score *s2)
 {
 	/* -1 if s1.effective_indent < s2->effective_indent, etc. */
@@ -693,8 +468,9 @@ static int score_cmp(struct split_score *s1, struct split_score *s2)
  * to the line preceding the group, then the group can be slid up. See
  * group_slide_down() and group_slide_up().
  *
- * Note that loops that are testing for changed lines in xdf->rchg do not need
- * index bounding since the array is prepared with a zero at position -1 and N.
+ * Note that loops that are testing for changed lines with XDL_CHANGED() do not
+ * need index bounding since the map is prepared with a zero at position -1
+ * and N.
  */
 struct xdlgroup {
 	/*
@@ -716,7 +492,7 @@ struct xdlgroup {
 static void group_init(xdfile_t *xdf, struct xdlgroup *g)
 {
 	g->start = g->end = 0;
-	while (xdf->rchg[g->end])
+	while (XDL_CHANGED(xdf, g->end))
 		g->end++;
 }
 
@@ -730,7 +506,7 @@ static inline int group_next(xdfile_t *xdf, struct xdlgroup *g)
 		return -1;
 
 	g->start = g->end + 1;
-	for (g->end = g->start; xdf->rchg[g->end]; g->end++)
+	for (g->end = g->start; XDL_CHANGED(xdf, g->end); g->end++)
 		;
 
 	return 0;
@@ -746,12 +522,46 @@ static inline int group_previous(xdfile_t *xdf, struct xdlgroup *g)
 		return -1;
 
 	g->end = g->start - 1;
-	for (g->start = g->end; xdf->rchg[g->start - 1]; g->start--)
+	for (g->start = g->end; XDL_CHANGED(xdf, g->start - 1); g->start--)
 		;
 
 	return 0;
 }
 
+/*
+ * Move g past the empty groups ahead of it, to the next group holding
+ * changes or to the end of the file, and move go along by as many groups,
+ * as a run of group_next() calls on both would. Return -1 if g is already
+ * at the end of the file.
+ */
+static int group_skip_unchanged(xdfile_t *xdf, struct xdlgroup *g,
+				xdfile_t *xdfo, struct xdlgroup *go)
+{
+	long k, end;
+
+	if (g->end == xdf->nrec)
+		return -1;
+
+	g->start = xdl_rchg_next(xdf, g->end + 1, xdf->nrec);
+	k = g->start - g->end;
+	g->end = xdl_rchg_nth_unchanged(xdf, g->start, xdf->nrec + 1, 1);
+
+	/*
+	 * After k steps go ends at the k-th unchanged record past its old
+	 * end, counting the sentinel at nrec, and starts past the one before.
+	 */
+	end = k > 1 ? xdl_rchg_nth_unchanged(xdfo, go->end + 1,
+					     xdfo->nrec + 1, k - 1) : go->end;
+	if (end >= xdfo->nrec)
+		XDL_BUG("group sync broken moving to next group");
+	go->start = end + 1;
+	go->end = xdl_rchg_nth_unchanged(xdfo, go->start, xdfo->nrec + 1, 1);
+	if (go->end > xdfo->nrec)
+		XDL_BUG("group sync broken moving to next group");
+
+	return 0;
+}
+
 /*
  * If g can be slid toward the end of the file, do so, and if it bumps into a
  * following group, expand this group to include it. Return 0 on success or -1
@@ -761,10 +571,12 @@ static int group_slide_down(xdfile_t *xdf, struct xdlgroup *g)
 {
 	if (g->end < xdf->nrec &&
 	    recs_match(xdf->recs[g->start], xdf->recs[g->end])) {
-		xdf->rchg[g->start++] = 0;
-		xdf->rchg[g->end++] = 1;
+		XDL_CLR_CHANGED(xdf, g->start);
+		XDL_SET_CHANGED(xdf, g->end);
+		g->start++;
+		g->end++;
 
-		while (xdf->rchg[g->end])
+		while (XDL_CHANGED(xdf, g->end))
 			g->end++;
 
 		return 0;
@@ -782,10 +594,12 @@ static int group_slide_up(xdfile_t *xdf, struct xdlgroup *g)
 {
 	if (g->start > 0 &&
 	    recs_match(xdf->recs[g->start - 1], xdf->recs[g->end - 1])) {
-		xdf->rchg[--g->start] = 1;
-		xdf->rchg[--g->end] = 0;
+		g->start--;
+		g->end--;
+		XDL_SET_CHANGED(xdf, g->start);
+		XDL_CLR_CHANGED(xdf, g->end);
 
-		while (xdf->rchg[g->start - 1])
+		while (XDL_CHANGED(xdf, g->start - 1))
 			g->start--;
 
 		return 0;
@@ -803,6 +617,8 @@ int xdl_change_compact(xdfile_t *xdf, xdfile_t *xdfo, long flags) {
 	struct xdlgroup g, go;
 	long earliest_end, end_matching_other;
 	long groupsize;
+	unsigned char *indent = NULL;
+	struct split_score scores[2 * INDENT_HEURISTIC_MAX_SLIDING + 1];
 
 	group_init(xdf, &g);
 	group_init(xdfo, &go);
@@ -891,22 +707,46 @@ int xdl_change_compact(xdfile_t *xdf, xdfile_t *xdfo, long flags) {
 			 * position that the group can be shifted to. Then we
 			 * pick the shift with the lowest score.
 			 */
-			long shift, best_shift = -1;
-			struct split_score best_score;
+			long shift, best_shift = -1, base;
+			struct split_score best_score, score, lo, hi;
+			int memo;
+
+			if (!indent && !XDL_CALLOC_ARRAY(indent, xdf->nrec + 1))
+				return -1;
 
 			shift = earliest_end;
 			if (g.end - groupsize - 1 > shift)
 				shift = g.end - groupsize - 1;
 			if (g.end - INDENT_HEURISTIC_MAX_SLIDING > shift)
 				shift = g.end - INDENT_HEURISTIC_MAX_SLIDING;
-			for (; shift <= g.end; shift++) {
-				struct split_measurement m;
-				struct split_score score = {0, 0};
 
-				measure_split(xdf, shift, &m);
-				score_add_split(&m, &score);
-				measure_split(xdf, shift - groupsize, &m);
-				score_add_split(&m, &score);
+			/*
+			 * The score of a shift is the sum of the scores of the
+			 * splits at its two ends, which are independent. If
+			 * the group is shorter than the sliding range, the
+			 * upper split of one shift is the lower split of
+			 * another: score every split position only once.
+			 */
+			base = shift - groupsize;
+			memo = groupsize <= g.end - shift;
+			for (; shift <= g.end; shift++) {
+				if (memo) {
+					if (shift - groupsize < base + groupsize)
+						score_split(xdf, indent,
+							    shift - groupsize,
+							    &scores[shift - groupsize - base]);
+					score_split(xdf, indent, shift,
+						    &scores[shift - base]);
+					lo = scores[shift - groupsize - base];
+					hi = scores[shift - base];
+				} else {
+					score_split(xdf, indent, shift, &hi);
+					score_split(xdf, indent,
+						    shift - groupsize, &lo);
+				}
+				score.effective_indent = hi.effective_indent +
+					lo.effective_indent;
+				score.penalty = hi.penalty + lo.penalty;
 				if (best_shift == -1 ||
 				    score_cmp(&score, &best_score) <= 0) {
 					best_score.effective_indent = score.effective_indent;
@@ -924,39 +764,81 @@ int xdl_change_compact(xdfile_t *xdf, xdfile_t *xdfo, long flags) {
 		}
 
 	next:
-		/* Move past the just-processed group: */
-		if (group_next(xdf, &g))
+		/* Move past the just-processed group and the empty ones after it: */
+		if (group_skip_unchanged(xdf, &g, xdfo, &go))
 			break;
-		if (group_next(xdfo, &go))
-			XDL_BUG("group sync broken moving to next group");
 	}
 
 	if (!group_next(xdfo, &go))
 		XDL_BUG("group sync broken at end of file");
 
+	xdl_free(indent);
+
 	return 0;
 }
 
 
+/*
+ * Move i1 and i2 back over the unchanged records before them, in lockstep,
+ * and then over the group of changes found there, leaving its end in l1 and
+ * l2. Return 0 once there are no groups left.
+ */
+static int xdl_prev_change(xdfile_t const *xdf1, xdfile_t const *xdf2,
+			   long *i1, long *i2, long *l1, long *l2) {
+	long d1, d2;
+
+	d1 = *i1 - 1 - xdl_rchg_prev(xdf1, *i1, 0);
+	d2 = *i2 - 1 - xdl_rchg_prev(xdf2, *i2, 0);
+	*i1 -= XDL_MIN(d1, d2);
+	*i2 -= XDL_MIN(d1, d2);
+	if (!XDL_CHANGED(xdf1, *i1 - 1) && !XDL_CHANGED(xdf2, *i2 - 1))
+		return 0;
+
+	for (*l1 = *i1; XDL_CHANGED(xdf1, *i1 - 1); (*i1)--);
+	for (*l2 = *i2; XDL_CHANGED(xdf2, *i2 - 1); (*i2)--);
+
+	return 1;
+}
+
+
+/*
+ * Count the groups of changes, so that the script can be built in one
+ * array.
+ */
+static long xdl_count_changes(xdfenv_t *xe) {
+	long i1 = xe->xdf1.nrec, i2 = xe->xdf2.nrec, l1, l2, n = 0;
+
+	while (xdl_prev_change(&xe->xdf1, &xe->xdf2, &i1, &i2, &l1, &l2))
+		n++;
+
+	return n;
+}
+
+
 int xdl_build_script(xdfenv_t *xe, xdchange_t **xscr) {
-	xdchange_t *cscr = NULL, *xch;
-	char *rchg1 = xe->xdf1.rchg, *rchg2 = xe->xdf2.rchg;
-	long i1, i2, l1, l2;
+	xdchange_t *cscr, *xch;
+	long i1, i2, l1, l2, n, k;
+
+	*xscr = NULL;
+	if (!(n = xdl_count_changes(xe)))
+		return 0;
+	if (!XDL_ALLOC_ARRAY(cscr, n))
+		return -1;
 
 	/*
-	 * Trivial. Collects "groups" of changes and creates an edit script.
+	 * Trivial. Collects "groups" of changes and creates an edit script,
+	 * filling the array from its end.
 	 */
-	for (i1 = xe->xdf1.nrec, i2 = xe->xdf2.nrec; i1 >= 0 || i2 >= 0; i1--, i2--)
-		if (rchg1[i1 - 1] || rchg2[i2 - 1]) {
-			for (l1 = i1; rchg1[i1 - 1]; i1--);
-			for (l2 = i2; rchg2[i2 - 1]; i2--);
-
-			if (!(xch = xdl_add_change(cscr, i1, i2, l1 - i1, l2 - i2))) {
-				xdl_free_script(cscr);
-				return -1;
-			}
-			cscr = xch;
-		}
+	for (k = n, i1 = xe->xdf1.nrec, i2 = xe->xdf2.nrec;
+	     xdl_prev_change(&xe->xdf1, &xe->xdf2, &i1, &i2, &l1, &l2);) {
+		xch = cscr + --k;
+		xch->next = k + 1 < n ? xch + 1 : NULL;
+		xch->i1 = i1;
+		xch->i2 = i2;
+		xch->chg1 = l1 - i1;
+		xch->chg2 = l2 - i2;
+		xch->ignore = 0;
+	}
 
 	*xscr = cscr;
 
@@ -965,12 +847,8 @@ int xdl_build_script(xdfenv_t *xe, xdchange_t **xscr) {
 
 
 void xdl_free_script(xdchange_t *xscr) {
-	xdchange_t *xch;
 
-	while ((xch = xscr) != NULL) {
-		xscr = xscr->next;
-		xdl_free(xch);
-	}
+	xdl_free(xscr);
 }
 
 static int xdl_call_hunk_func(xdfenv_t *xe XDL_UNUSED, xdchange_t *xscr, xdemitcb_t *ecb,
@@ -1051,39 +929,200 @@ static void xdl_mark_ignorable_regex(xdchange_t *xscr, const xdfenv_t *xe,
 	}
 }
 
-int xdl_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
-	     xdemitconf_t const *xecfg, xdemitcb_t *ecb) {
-	xdchange_t *xscr;
-	xdfenv_t xe;
-	emit_func_t ef = xecfg->hunk_func ? xdl_call_hunk_func : xdl_emit_diff;
+/*
+ * Mark the changes of xscr that XDF_IGNORE_BLANK_LINES or ignore_regex
+ * hide.
+ */
+void xdl_mark_ignorable(xdchange_t *xscr, xdfenv_t *xe, xpparam_t const *xpp) {
 
-	if (xdl_do_diff(mf1, mf2, xpp, &xe) < 0) {
+	if (xscr) {
+		if (xpp->flags & XDF_IGNORE_BLANK_LINES)
+			xdl_mark_ignorable_lines(xscr, xe, xpp->flags);
+
+		if (xpp->ignore_regex)
+			xdl_mark_ignorable_regex(xscr, xe, xpp);
+	}
+}
+
+/*
+ * Diff the prepared environment xe into an edit script, with the changes
+ * that are to be ignored marked. On success the caller owns xe and *xscr;
+ * on failure xe is freed.
+ */
+int xdl_env_to_script(xpparam_t const *xpp, xdfenv_t *xe,
+		      xdchange_t **xscr) {
+
+	if (xdl_diff_env(xpp, xe) < 0) {
 
 		return -1;
 	}
-	if (xdl_change_compact(&xe.xdf1, &xe.xdf2, xpp->flags) < 0 ||
-	    xdl_change_compact(&xe.xdf2, &xe.xdf1, xpp->flags) < 0 ||
-	    xdl_build_script(&xe, &xscr) < 0) {
+	if (xdl_change_compact(&xe->xdf1, &xe->xdf2, xpp->flags) < 0 ||
+	    xdl_change_compact(&xe->xdf2, &xe->xdf1, xpp->flags) < 0 ||
+	    xdl_build_script(xe, xscr) < 0) {
 
-		xdl_free_env(&xe);
+		xdl_free_env(xe);
 		return -1;
 	}
-	if (xscr) {
-		if (xpp->flags & XDF_IGNORE_BLANK_LINES)
-			xdl_mark_ignorable_lines(xscr, &xe, xpp->flags);
+	xdl_mark_ignorable(*xscr, xe, xpp);
 
-		if (xpp->ignore_regex)
-			xdl_mark_ignorable_regex(xscr, &xe, xpp);
+	return 0;
+}
 
-		if (ef(&xe, xscr, ecb, xecfg) < 0) {
+/*
+ * Pass the changes of xscr to the hunk callback of xecfg, if it has one,
+ * or emit them as a unified diff.
+ */
+int xdl_emit_changes(xdfenv_t *xe, xdchange_t *xscr, xdemitcb_t *ecb,
+		     xdemitconf_t const *xecfg) {
+	emit_func_t ef = xecfg->hunk_func ? xdl_call_hunk_func : xdl_emit_diff;
+
+	return xscr ? ef(xe, xscr, ecb, xecfg) : 0;
+}
+
+static int xdl_emit_env(xpparam_t const *xpp, xdfenv_t *xe,
+			xdemitconf_t const *xecfg, xdemitcb_t *ecb) {
+	xdchange_t *xscr;
+
+	if (xdl_env_to_script(xpp, xe, &xscr) < 0)
+		return -1;
+	if (xscr) {
+		if ((xecfg->flags & XDL_EMIT_MOVES &&
+		     xdl_mark_moves(xe, xscr) < 0) ||
+		    xdl_emit_changes(xe, xscr, ecb, xecfg) < 0) {
 
 			xdl_free_script(xscr);
-			xdl_free_env(&xe);
+			xdl_free_env(xe);
 			return -1;
 		}
 		xdl_free_script(xscr);
 	}
-	xdl_free_env(&xe);
+	xdl_free_env(xe);
+
+	return 0;
+}
+
+int xdl_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
+	     xdemitconf_t const *xecfg, xdemitcb_t *ecb) {
+	xdfenv_t xe;
+
+	if (xdl_prepare_env(mf1, mf2, xpp, &xe) < 0)
+		return -1;
+
+	return xdl_emit_env(xpp, &xe, xecfg, ecb);
+}
+
+int xdl_diff_rope(mmrope_t *mr1, mmrope_t *mr2, xpparam_t const *xpp,
+		  xdemitconf_t const *xecfg, xdemitcb_t *ecb) {
+	xdfenv_t xe;
+
+	if (xdl_prepare_rope_env(mr1, mr2, xpp, &xe) < 0)
+		return -1;
+
+	return xdl_emit_env(xpp, &xe, xecfg, ecb);
+}
+
+int xdl_diff_lines(xdlines_t const *l1, xdlines_t const *l2, xpparam_t const *xpp,
+		   xdemitconf_t const *xecfg, xdemitcb_t *ecb) {
+	xdfenv_t xe;
+
+	if (xdl_prepare_lines_env(l1, l2, xpp, &xe) < 0)
+		return -1;
+
+	return xdl_emit_env(xpp, &xe, xecfg, ecb);
+}
+
+/*
+ * Copy the changes of xscr to the public array form.
+ */
+int xdl_script_edits(xdchange_t *xscr, xdscript_t *script) {
+	xdchange_t *xch;
+	xdedit_t *edit;
+	long n;
+
+	script->edit = NULL;
+	script->nr = 0;
+	for (n = 0, xch = xscr; xch; xch = xch->next)
+		n++;
+	if (n && !XDL_ALLOC_ARRAY(script->edit, n))
+		return -1;
+	for (edit = script->edit, xch = xscr; xch; xch = xch->next, edit++) {
+		edit->i1 = xch->i1;
+		edit->chg1 = xch->chg1;
+		edit->i2 = xch->i2;
+		edit->chg2 = xch->chg2;
+		edit->ignore = xch->ignore;
+	}
+	script->nr = n;
 
 	return 0;
 }
+
+/*
+ * The reverse of xdl_script_edits(): rebuild a script from nr edits.
+ */
+int xdl_edits_script(xdedit_t const *edit, long nr, xdchange_t **xscr) {
+	xdchange_t *cscr;
+	long k;
+
+	*xscr = NULL;
+	if (!nr)
+		return 0;
+	if (!XDL_ALLOC_ARRAY(cscr, nr))
+		return -1;
+	for (k = 0; k < nr; k++) {
+		cscr[k].next = k + 1 < nr ? cscr + k + 1 : NULL;
+		cscr[k].i1 = edit[k].i1;
+		cscr[k].chg1 = edit[k].chg1;
+		cscr[k].i2 = edit[k].i2;
+		cscr[k].chg2 = edit[k].chg2;
+		cscr[k].ignore = edit[k].ignore;
+	}
+	*xscr = cscr;
+
+	return 0;
+}
+
+static int xdl_env_edit_script(xpparam_t const *xpp, xdfenv_t *xe,
+			       xdscript_t *script) {
+	xdchange_t *xscr;
+	int res;
+
+	if (xdl_env_to_script(xpp, xe, &xscr) < 0)
+		return -1;
+	res = xdl_script_edits(xscr, script);
+	xdl_free_script(xscr);
+	xdl_free_env(xe);
+
+	return res;
+}
+
+int xdl_diff_script(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
+		    xdscript_t *script) {
+	xdfenv_t xe;
+
+	script->edit = NULL;
+	script->nr = 0;
+	if (xdl_prepare_env(mf1, mf2, xpp, &xe) < 0)
+		return -1;
+
+	return xdl_env_edit_script(xpp, &xe, script);
+}
+
+int xdl_diff_lines_script(xdlines_t const *l1, xdlines_t const *l2,
+			  xpparam_t const *xpp, xdscript_t *script) {
+	xdfenv_t xe;
+
+	script->edit = NULL;
+	script->nr = 0;
+	if (xdl_prepare_lines_env(l1, l2, xpp, &xe) < 0)
+		return -1;
+
+	return xdl_env_edit_script(xpp, &xe, script);
+}
+
+void xdl_free_edit_script(xdscript_t *script) {
+
+	xdl_free(script->edit);
+	script->edit = NULL;
+	script->nr = 0;
+}
@@ -28,7 +28,7 @@ typedef struct s_diffdata {
 	long nrec;
 	unsigned long const *ha;
 	long *rindex;
-	char *rchg;
+	xdfile_t *xdf;
 } diffdata_t;
 
 typedef struct s_xdalgoenv {
@@ -37,6 +37,11 @@ typedef struct s_xdalgoenv {
 	long heur_min;
 } xdalgoenv_t;
 
+/*
+ * Scripts are built as one array, in order; next links its entries for
+ * the code that walks them as a list, and xdl_free_script() frees the
+ * whole array.
+ */
 typedef struct s_xdchange {
 	struct s_xdchange *next;
 	long i1, i2;
@@ -44,6 +49,9 @@ typedef struct s_xdchange {
 	int ignore;
 } xdchange_t;
 
+/* rchg bit of changed lines that xdl_mark_moves() found moved */
+#define XDL_RCHG_MOVED 2
+
 
 
 int xdl_recs_cmp(diffdata_t *dd1, long off1, long lim1,
@@ -51,11 +59,20 @@ int xdl_recs_cmp(diffdata_t *dd1, long off1, long lim1,
 		 long *kvdf, long *kvdb, int need_min, xdalgoenv_t *xenv);
 int xdl_do_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 		xdfenv_t *xe);
+int xdl_diff_env(xpparam_t const *xpp, xdfenv_t *xe);
 int xdl_change_compact(xdfile_t *xdf, xdfile_t *xdfo, long flags);
 int xdl_build_script(xdfenv_t *xe, xdchange_t **xscr);
 void xdl_free_script(xdchange_t *xscr);
+void xdl_mark_ignorable(xdchange_t *xscr, xdfenv_t *xe, xpparam_t const *xpp);
+int xdl_script_edits(xdchange_t *xscr, xdscript_t *script);
+int xdl_edits_script(xdedit_t const *edit, long nr, xdchange_t **xscr);
+int xdl_env_to_script(xpparam_t const *xpp, xdfenv_t *xe,
+		      xdchange_t **xscr);
+int xdl_mark_moves(xdfenv_t *xe, xdchange_t *xscr);
 int xdl_emit_diff(xdfenv_t *xe, xdchange_t *xscr, xdemitcb_t *ecb,
 		  xdemitconf_t const *xecfg);
+int xdl_emit_changes(xdfenv_t *xe, xdchange_t *xscr, xdemitcb_t *ecb,
+		     xdemitconf_t const *xecfg);
 int xdl_do_patience_diff(xpparam_t const *xpp, xdfenv_t *env);
 int xdl_do_histogram_diff(xpparam_t const *xpp, xdfenv_t *env);
 
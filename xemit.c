@@ -164,6 +164,9 @@ static int is_empty_rec(xdfile_t *xdf, long ri)
 	return !len;
 }
 
+static char const moved_from[] = { XDL_ORIGIN_MOVED_FROM, 0 };
+static char const moved_to[] = { XDL_ORIGIN_MOVED_TO, 0 };
+
 int xdl_emit_diff(xdfenv_t *xe, xdchange_t *xscr, xdemitcb_t *ecb,
 		  xdemitconf_t const *xecfg) {
 	long s1, s2, e1, e2, lctx;
@@ -302,14 +305,18 @@ pre_context_calculation:
 			 * Removes lines from the first file.
 			 */
 			for (s1 = xch->i1; s1 < xch->i1 + xch->chg1; s1++)
-				if (xdl_emit_record(&xe->xdf1, s1, "-", ecb) < 0)
+				if (xdl_emit_record(&xe->xdf1, s1,
+						    XDL_MOVED(&xe->xdf1, s1) ?
+						    moved_from : "-", ecb) < 0)
 					return -1;
 
 			/*
 			 * Adds lines from the second file.
 			 */
 			for (s2 = xch->i2; s2 < xch->i2 + xch->chg2; s2++)
-				if (xdl_emit_record(&xe->xdf2, s2, "+", ecb) < 0)
+				if (xdl_emit_record(&xe->xdf2, s2,
+						    XDL_MOVED(&xe->xdf2, s2) ?
+						    moved_to : "+", ecb) < 0)
 					return -1;
 
 			if (xch == xche)
@@ -43,191 +43,167 @@
 
 #include "xinclude.h"
 
-#define MAX_PTR	UINT_MAX
+/*
+ * The index holds 32-bit line numbers; regions past MAX_PTR go to the
+ * classic diff. Test builds may lower it to exercise that path.
+ */
+#if !defined(XDL_HISTOGRAM_MAX_PTR)
+#define XDL_HISTOGRAM_MAX_PTR UINT_MAX
+#endif
+#define MAX_PTR	XDL_HISTOGRAM_MAX_PTR
 #define MAX_CNT	UINT_MAX
 
 #define LINE_END(n) (line##n + count##n - 1)
 #define LINE_END_PTR(n) (*line##n + *count##n - 1)
 
+/*
+ * The index is built from flat arrays addressed by class id (the "ha" of
+ * a prepared record), so no hashing or chain walking is needed. It is
+ * allocated once, for the top-level region, and reset by each find_lcs()
+ * for the next recursion level to reuse.
+ */
 struct histindex {
-	struct record {
-		unsigned int ptr, cnt;
-		struct record *next;
-	} **records, /* an occurrence */
-	  **line_map; /* map of line to record chain */
-	chastore_t rcha;
-	unsigned int *next_ptrs;
-	unsigned int table_bits,
-		     records_size,
-		     line_map_size;
-
-	unsigned int max_chain_length,
-		     key_shift,
-		     ptr_shift;
+	unsigned long *ha1, *ha2; /* class of each line, by side */
+	unsigned int *class_ptr; /* first occurrence of each class, 0 if none */
+	unsigned int *class_cnt; /* number of occurrences of each class */
+	unsigned int *next_ptrs; /* next occurrence of the same class */
+	unsigned long nclass;
+
+	unsigned int max_chain_length;
+	long ptr_shift;
 
 	unsigned int cnt,
 		     has_common;
 
 	xdfenv_t *env;
 	xpparam_t const *xpp;
+	xdpool_t *pool;
+};
+
+/* A region handed off to another thread, see histogram_diff(). */
+struct histtask {
+	xdtask_t task;
+	struct histindex index;
+	long line1, count1, line2, count2;
 };
 
 struct region {
-	unsigned int begin1, end1;
-	unsigned int begin2, end2;
+	long begin1, end1;
+	long begin2, end2;
 };
 
-#define LINE_MAP(i, a) (i->line_map[(a) - i->ptr_shift])
+#define CLASS(index, s, l) \
+	(index->ha##s[(l) - 1])
 
 #define NEXT_PTR(index, ptr) \
 	(index->next_ptrs[(ptr) - index->ptr_shift])
 
 #define CNT(index, ptr) \
-	((LINE_MAP(index, ptr))->cnt)
-
-#define REC(env, s, l) \
-	(env->xdf##s.recs[l - 1])
-
-static int cmp_recs(xrecord_t *r1, xrecord_t *r2)
-{
-	return r1->ha == r2->ha;
-
-}
+	(index->class_cnt[CLASS(index, 1, ptr)])
 
 #define CMP(i, s1, l1, s2, l2) \
-	(cmp_recs(REC(i->env, s1, l1), REC(i->env, s2, l2)))
-
-#define TABLE_HASH(index, side, line) \
-	XDL_HASHLONG((REC(index->env, side, line))->ha, index->table_bits)
+	(CLASS(i, s1, l1) == CLASS(i, s2, l2))
 
-static int scanA(struct histindex *index, int line1, int count1)
+static void scanA(struct histindex *index, long line1, long count1)
 {
-	unsigned int ptr, tbl_idx;
-	unsigned int chain_len;
-	struct record **rec_chain, *rec;
+	long ptr;
+	unsigned long ha;
 
 	for (ptr = LINE_END(1); line1 <= ptr; ptr--) {
-		tbl_idx = TABLE_HASH(index, 1, ptr);
-		rec_chain = index->records + tbl_idx;
-		rec = *rec_chain;
-
-		chain_len = 0;
-		while (rec) {
-			if (CMP(index, 1, rec->ptr, 1, ptr)) {
-				/*
-				 * ptr is identical to another element. Insert
-				 * it onto the front of the existing element
-				 * chain.
-				 */
-				NEXT_PTR(index, ptr) = rec->ptr;
-				rec->ptr = ptr;
-				/* cap rec->cnt at MAX_CNT */
-				rec->cnt = XDL_MIN(MAX_CNT, rec->cnt + 1);
-				LINE_MAP(index, ptr) = rec;
-				goto continue_scan;
-			}
-
-			rec = rec->next;
-			chain_len++;
-		}
-
-		if (chain_len == index->max_chain_length)
-			return -1;
-
+		ha = CLASS(index, 1, ptr);
 		/*
-		 * This is the first time we have ever seen this particular
-		 * element in the sequence. Construct a new chain for it.
+		 * Insert ptr onto the front of the chain of its class,
+		 * which is empty the first time we see the class.
 		 */
-		if (!(rec = xdl_cha_alloc(&index->rcha)))
-			return -1;
-		rec->ptr = ptr;
-		rec->cnt = 1;
-		rec->next = *rec_chain;
-		*rec_chain = rec;
-		LINE_MAP(index, ptr) = rec;
-
-continue_scan:
-		; /* no op */
+		NEXT_PTR(index, ptr) = index->class_ptr[ha];
+		index->class_ptr[ha] = ptr;
+		/* cap the count at MAX_CNT */
+		index->class_cnt[ha] = XDL_MIN(MAX_CNT, index->class_cnt[ha] + 1);
 	}
+}
 
-	return 0;
+static void reset_index(struct histindex *index, long line1, long count1)
+{
+	long ptr;
+	unsigned long ha;
+
+	for (ptr = line1; ptr <= LINE_END(1); ptr++) {
+		ha = CLASS(index, 1, ptr);
+		index->class_ptr[ha] = 0;
+		index->class_cnt[ha] = 0;
+	}
 }
 
-static int try_lcs(struct histindex *index, struct region *lcs, int b_ptr,
-	int line1, int count1, int line2, int count2)
+static long try_lcs(struct histindex *index, struct region *lcs, long b_ptr,
+	long line1, long count1, long line2, long count2)
 {
-	unsigned int b_next = b_ptr + 1;
-	struct record *rec = index->records[TABLE_HASH(index, 2, b_ptr)];
-	unsigned int as, ae, bs, be, np, rc;
+	long b_next = b_ptr + 1;
+	unsigned long ha = CLASS(index, 2, b_ptr);
+	long as, ae, bs, be, np;
+	unsigned int rc;
 	int should_break;
 
-	for (; rec; rec = rec->next) {
-		if (rec->cnt > index->cnt) {
-			if (!index->has_common)
-				index->has_common = CMP(index, 1, rec->ptr, 2, b_ptr);
-			continue;
+	if (!(as = index->class_ptr[ha]))
+		return b_next;
+
+	index->has_common = 1;
+	if (index->class_cnt[ha] > index->cnt)
+		return b_next;
+
+	for (;;) {
+		should_break = 0;
+		np = NEXT_PTR(index, as);
+		bs = b_ptr;
+		ae = as;
+		be = bs;
+		rc = index->class_cnt[ha];
+
+		while (line1 < as && line2 < bs
+			&& CMP(index, 1, as - 1, 2, bs - 1)) {
+			as--;
+			bs--;
+			if (1 < rc)
+				rc = XDL_MIN(rc, CNT(index, as));
+		}
+		while (ae < LINE_END(1) && be < LINE_END(2)
+			&& CMP(index, 1, ae + 1, 2, be + 1)) {
+			ae++;
+			be++;
+			if (1 < rc)
+				rc = XDL_MIN(rc, CNT(index, ae));
 		}
 
-		as = rec->ptr;
-		if (!CMP(index, 1, as, 2, b_ptr))
-			continue;
-
-		index->has_common = 1;
-		for (;;) {
-			should_break = 0;
-			np = NEXT_PTR(index, as);
-			bs = b_ptr;
-			ae = as;
-			be = bs;
-			rc = rec->cnt;
-
-			while (line1 < as && line2 < bs
-				&& CMP(index, 1, as - 1, 2, bs - 1)) {
-				as--;
-				bs--;
-				if (1 < rc)
-					rc = XDL_MIN(rc, CNT(index, as));
-			}
-			while (ae < LINE_END(1) && be < LINE_END(2)
-				&& CMP(index, 1, ae + 1, 2, be + 1)) {
-				ae++;
-				be++;
-				if (1 < rc)
-					rc = XDL_MIN(rc, CNT(index, ae));
-			}
+		if (b_next <= be)
+			b_next = be + 1;
+		if (lcs->end1 - lcs->begin1 < ae - as || rc < index->cnt) {
+			lcs->begin1 = as;
+			lcs->begin2 = bs;
+			lcs->end1 = ae;
+			lcs->end2 = be;
+			index->cnt = rc;
+		}
 
-			if (b_next <= be)
-				b_next = be + 1;
-			if (lcs->end1 - lcs->begin1 < ae - as || rc < index->cnt) {
-				lcs->begin1 = as;
-				lcs->begin2 = bs;
-				lcs->end1 = ae;
-				lcs->end2 = be;
-				index->cnt = rc;
-			}
+		if (np == 0)
+			break;
 
-			if (np == 0)
+		while (np <= ae) {
+			np = NEXT_PTR(index, np);
+			if (np == 0) {
+				should_break = 1;
 				break;
-
-			while (np <= ae) {
-				np = NEXT_PTR(index, np);
-				if (np == 0) {
-					should_break = 1;
-					break;
-				}
 			}
+		}
 
-			if (should_break)
-				break;
+		if (should_break)
+			break;
 
-			as = np;
-		}
+		as = np;
 	}
 	return b_next;
 }
 
 static int fall_back_to_classic_diff(xpparam_t const *xpp, xdfenv_t *env,
-		int line1, int count1, int line2, int count2)
+		long line1, long count1, long line2, long count2)
 {
 	xpparam_t xpparam;
 
@@ -238,72 +214,140 @@ static int fall_back_to_classic_diff(xpparam_t const *xpp, xdfenv_t *env,
 				  line1, count1, line2, count2);
 }
 
-static inline void free_index(struct histindex *index)
+static int alloc_tables(struct histindex *index, long count1)
 {
-	xdl_free(index->records);
-	xdl_free(index->line_map);
-	xdl_free(index->next_ptrs);
-	xdl_cha_free(&index->rcha);
+	if (!XDL_CALLOC_ARRAY(index->class_ptr, index->nclass + 1) ||
+	    !XDL_CALLOC_ARRAY(index->class_cnt, index->nclass + 1) ||
+	    !XDL_ALLOC_ARRAY(index->next_ptrs, count1 + 1)) {
+		xdl_free(index->class_cnt);
+		xdl_free(index->class_ptr);
+		return -1;
+	}
+	return 0;
 }
 
-static int find_lcs(xpparam_t const *xpp, xdfenv_t *env,
-		    struct region *lcs,
-		    int line1, int count1, int line2, int count2)
+static inline void free_tables(struct histindex *index)
 {
-	int b_ptr;
-	int ret = -1;
-	struct histindex index;
-
-	memset(&index, 0, sizeof(index));
+	xdl_free(index->class_ptr);
+	xdl_free(index->class_cnt);
+	xdl_free(index->next_ptrs);
+}
 
-	index.env = env;
-	index.xpp = xpp;
+static int init_index(struct histindex *index, xpparam_t const *xpp,
+		      xdfenv_t *env, long count1)
+{
+	long i, nrec1 = env->xdf1.nrec, nrec2 = env->xdf2.nrec;
 
-	index.records = NULL;
-	index.line_map = NULL;
-	/* in case of early xdl_cha_free() */
-	index.rcha.head = NULL;
+	memset(index, 0, sizeof(*index));
+	index->env = env;
+	index->xpp = xpp;
+	index->max_chain_length = 64;
 
-	index.table_bits = xdl_hashbits(count1);
-	index.records_size = 1 << index.table_bits;
-	if (!XDL_CALLOC_ARRAY(index.records, index.records_size))
-		goto cleanup;
+	if (!XDL_ALLOC_ARRAY(index->ha1, nrec1 + nrec2 + 1))
+		return -1;
+	index->ha2 = index->ha1 + nrec1;
+	for (i = 0; i < nrec1; i++)
+		index->ha1[i] = env->xdf1.recs[i]->ha;
+	for (i = 0; i < nrec2; i++)
+		index->ha2[i] = env->xdf2.recs[i]->ha;
+	index->nclass = env->nclass;
+
+	if (alloc_tables(index, count1) < 0) {
+		xdl_free(index->ha1);
+		return -1;
+	}
 
-	index.line_map_size = count1;
-	if (!XDL_CALLOC_ARRAY(index.line_map, index.line_map_size))
-		goto cleanup;
+	return 0;
+}
 
-	if (!XDL_CALLOC_ARRAY(index.next_ptrs, index.line_map_size))
-		goto cleanup;
+static inline void free_index(struct histindex *index)
+{
+	xdl_free(index->ha1);
+	free_tables(index);
+}
 
-	/* lines / 4 + 1 comes from xprepare.c:xdl_prepare_ctx() */
-	if (xdl_cha_init(&index.rcha, sizeof(struct record), count1 / 4 + 1) < 0)
-		goto cleanup;
+static int find_lcs(struct histindex *index, struct region *lcs,
+		    long line1, long count1, long line2, long count2)
+{
+	long b_ptr;
+	int ret;
 
-	index.ptr_shift = line1;
-	index.max_chain_length = 64;
+	index->ptr_shift = line1;
+	index->has_common = 0;
 
-	if (scanA(&index, line1, count1))
-		goto cleanup;
+	scanA(index, line1, count1);
 
-	index.cnt = index.max_chain_length + 1;
+	index->cnt = index->max_chain_length + 1;
 
 	for (b_ptr = line2; b_ptr <= LINE_END(2); )
-		b_ptr = try_lcs(&index, lcs, b_ptr, line1, count1, line2, count2);
+		b_ptr = try_lcs(index, lcs, b_ptr, line1, count1, line2, count2);
 
-	if (index.has_common && index.max_chain_length < index.cnt)
+	if (index->has_common && index->max_chain_length < index->cnt)
 		ret = 1;
 	else
 		ret = 0;
 
-cleanup:
-	free_index(&index);
+	reset_index(index, line1, count1);
 	return ret;
 }
 
-static int histogram_diff(xpparam_t const *xpp, xdfenv_t *env,
-	int line1, int count1, int line2, int count2)
+static int histogram_diff(struct histindex *index,
+	long line1, long count1, long line2, long count2);
+
+static int histogram_task(void *priv)
+{
+	struct histtask *ht = priv;
+
+	return histogram_diff(&ht->index,
+			      ht->line1, ht->count1, ht->line2, ht->count2);
+}
+
+/*
+ * Diff a region on another thread, if one is available, with an index of
+ * its own. Returns NULL if the caller should diff the region itself.
+ */
+static struct histtask *start_histogram_task(struct histindex *index,
+	long line1, long count1, long line2, long count2)
 {
+	struct histtask *ht;
+
+	if (xdl_pool_claim(index->pool, count1 + count2) < 0)
+		return NULL;
+	if (!(ht = xdl_malloc(sizeof(*ht))))
+		goto fail;
+	ht->index = *index;
+	if (alloc_tables(&ht->index, count1) < 0) {
+		xdl_free(ht);
+		goto fail;
+	}
+	ht->line1 = line1;
+	ht->count1 = count1;
+	ht->line2 = line2;
+	ht->count2 = count2;
+	ht->task.fn = histogram_task;
+	ht->task.priv = ht;
+	xdl_task_start(index->pool, &ht->task);
+	return ht;
+
+fail:
+	xdl_pool_unclaim(index->pool);
+	return NULL;
+}
+
+static int finish_histogram_task(struct histindex *index, struct histtask *ht)
+{
+	int result = xdl_task_wait(index->pool, &ht->task);
+
+	free_tables(&ht->index);
+	xdl_free(ht);
+	return result;
+}
+
+static int histogram_diff(struct histindex *index,
+	long line1, long count1, long line2, long count2)
+{
+	xdfenv_t *env = index->env;
+	struct histtask *ht;
 	struct region lcs;
 	int lcs_found;
 	int result;
@@ -313,40 +357,49 @@ redo:
 	if (count1 <= 0 && count2 <= 0)
 		return 0;
 
-	if (LINE_END(1) >= MAX_PTR)
-		return -1;
-
 	if (!count1) {
-		while(count2--)
-			env->xdf2.rchg[line2++ - 1] = 1;
+		xdl_rchg_fill(&env->xdf2, line2 - 1, count2);
 		return 0;
 	} else if (!count2) {
-		while(count1--)
-			env->xdf1.rchg[line1++ - 1] = 1;
+		xdl_rchg_fill(&env->xdf1, line1 - 1, count1);
 		return 0;
 	}
 
+	/* see MAX_PTR */
+	if (LINE_END(1) >= MAX_PTR)
+		return fall_back_to_classic_diff(index->xpp, env,
+						 line1, count1, line2, count2);
+
 	memset(&lcs, 0, sizeof(lcs));
-	lcs_found = find_lcs(xpp, env, &lcs, line1, count1, line2, count2);
+	lcs_found = find_lcs(index, &lcs, line1, count1, line2, count2);
 	if (lcs_found < 0)
 		goto out;
 	else if (lcs_found)
-		result = fall_back_to_classic_diff(xpp, env, line1, count1, line2, count2);
+		result = fall_back_to_classic_diff(index->xpp, env,
+						   line1, count1, line2, count2);
 	else {
 		if (lcs.begin1 == 0 && lcs.begin2 == 0) {
-			while (count1--)
-				env->xdf1.rchg[line1++ - 1] = 1;
-			while (count2--)
-				env->xdf2.rchg[line2++ - 1] = 1;
+			xdl_rchg_fill(&env->xdf1, line1 - 1, count1);
+			xdl_rchg_fill(&env->xdf2, line2 - 1, count2);
 			result = 0;
 		} else {
-			result = histogram_diff(xpp, env,
-						line1, lcs.begin1 - line1,
-						line2, lcs.begin2 - line2);
-			if (result)
-				goto out;
 			/*
-			 * result = histogram_diff(xpp, env,
+			 * The regions before and after the LCS are
+			 * independent; with XDF_PARALLEL the one before
+			 * may go to another thread.
+			 */
+			ht = start_histogram_task(index,
+						  line1, lcs.begin1 - line1,
+						  line2, lcs.begin2 - line2);
+			if (!ht) {
+				result = histogram_diff(index,
+							line1, lcs.begin1 - line1,
+							line2, lcs.begin2 - line2);
+				if (result)
+					goto out;
+			}
+			/*
+			 * result = histogram_diff(index,
 			 *            lcs.end1 + 1, LINE_END(1) - lcs.end1,
 			 *            lcs.end2 + 1, LINE_END(2) - lcs.end2);
 			 * but let's optimize tail recursion ourself:
@@ -355,7 +408,13 @@ redo:
 			line1 = lcs.end1 + 1;
 			count2 = LINE_END(2) - lcs.end2;
 			line2 = lcs.end2 + 1;
-			goto redo;
+			if (!ht)
+				goto redo;
+
+			result = histogram_diff(index,
+						line1, count1, line2, count2);
+			if (finish_histogram_task(index, ht))
+				result = -1;
 		}
 	}
 out:
@@ -364,7 +423,24 @@ out:
 
 int xdl_do_histogram_diff(xpparam_t const *xpp, xdfenv_t *env)
 {
-	return histogram_diff(xpp, env,
-		env->xdf1.dstart + 1, env->xdf1.dend - env->xdf1.dstart + 1,
+	struct histindex index;
+	xdpool_t pool;
+	long count1 = env->xdf1.dend - env->xdf1.dstart + 1;
+	int result;
+
+	if (xdl_pool_init(&pool, xpp) < 0)
+		return -1;
+	if (init_index(&index, xpp, env, count1) < 0) {
+		xdl_pool_free(&pool);
+		return -1;
+	}
+	index.pool = &pool;
+
+	result = histogram_diff(&index,
+		env->xdf1.dstart + 1, count1,
 		env->xdf2.dstart + 1, env->xdf2.dend - env->xdf2.dstart + 1);
+
+	free_index(&index);
+	xdl_pool_free(&pool);
+	return result;
 }
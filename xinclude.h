@@ -31,6 +31,7 @@
 #include "xprepare.h"
 #include "xdiffi.h"
 #include "xemit.h"
+#include "xscript.h"
 
 
 #endif /* #if !defined(XINCLUDE_H) */
@@ -0,0 +1,245 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+#include "xinclude.h"
+
+
+/*
+ * Keyed diffs do not look for a longest common subsequence: records are
+ * paired by key, with a hash join or, for sorted files, a merge join, and
+ * the pairs that keep their order become the lines the files have in
+ * common when their contents match, and changes when they do not. The
+ * result is an ordinary change map, turned into a script and emitted like
+ * any other diff.
+ */
+typedef struct s_xdkey {
+	char const *ptr;
+	long size;
+	unsigned long ha;
+} xdkey_t;
+
+static int keyed_keys(xdfile_t *xdf, xdkeyparam_t const *xkp, xdkey_t **keys)
+{
+	xdkey_t *key;
+	xrecord_t *rec;
+	char const *ptr;
+	long i;
+
+	*keys = NULL;
+	if (xdf->nrec && !XDL_ALLOC_ARRAY(*keys, xdf->nrec))
+		return -1;
+	for (i = 0; i < xdf->nrec; i++) {
+		rec = xdf->recs[i];
+		key = *keys + i;
+		if (!xkp->key_func ||
+		    (key->size = xkp->key_func(rec->ptr, rec->size, &key->ptr,
+					       xkp->key_priv)) < 0) {
+			key->ptr = rec->ptr;
+			key->size = rec->size;
+			if (key->size && key->ptr[key->size - 1] == '\n')
+				key->size--;
+		}
+		ptr = key->ptr;
+		key->ha = xdl_hash_record(&ptr, key->ptr + key->size,
+					  xkp->xpp.flags);
+	}
+
+	return 0;
+}
+
+/*
+ * Pair each record of the first file with the first record of the second
+ * that has the same key and is not paired yet. Paired records leave their
+ * chain, so repeated keys do not make the join quadratic.
+ */
+static int keyed_hash_join(xdkey_t const *k1, long n1, xdkey_t const *k2,
+			   long n2, long flags, long *match)
+{
+	unsigned int hbits;
+	long i, j, hi, *head, *next, *pj;
+
+	if (!n1 || !n2)
+		return 0;
+	hbits = xdl_hashbits((unsigned int) n2);
+	if (!XDL_ALLOC_ARRAY(head, 1L << hbits))
+		return -1;
+	if (!XDL_ALLOC_ARRAY(next, n2)) {
+		xdl_free(head);
+		return -1;
+	}
+	for (hi = 0; hi < 1L << hbits; hi++)
+		head[hi] = -1;
+	/* backwards, so that each chain is in file order */
+	for (j = n2 - 1; j >= 0; j--) {
+		hi = (long) XDL_HASHLONG(k2[j].ha, hbits);
+		next[j] = head[hi];
+		head[hi] = j;
+	}
+
+	for (i = 0; i < n1; i++)
+		for (pj = &head[XDL_HASHLONG(k1[i].ha, hbits)]; *pj >= 0;
+		     pj = &next[*pj]) {
+			j = *pj;
+			if (k2[j].ha == k1[i].ha &&
+			    xdl_recmatch(k1[i].ptr, k1[i].size,
+					 k2[j].ptr, k2[j].size, flags)) {
+				*pj = next[j];
+				match[i] = j;
+				break;
+			}
+		}
+
+	xdl_free(next);
+	xdl_free(head);
+
+	return 0;
+}
+
+/* keys in byte order, the order xkp->sorted files are expected in */
+static int keyed_cmp(xdkey_t const *k1, xdkey_t const *k2)
+{
+	int c = memcmp(k1->ptr, k2->ptr, XDL_MIN(k1->size, k2->size));
+
+	return c ? c : (k1->size > k2->size) - (k1->size < k2->size);
+}
+
+static void keyed_merge_join(xdkey_t const *k1, long n1, xdkey_t const *k2,
+			     long n2, long *match)
+{
+	long i = 0, j = 0;
+	int c;
+
+	while (i < n1 && j < n2)
+		if ((c = keyed_cmp(k1 + i, k2 + j)) < 0)
+			i++;
+		else if (c > 0)
+			j++;
+		else
+			match[i++] = j++;
+}
+
+/*
+ * A hash join pairs records wherever they are; keep the longest run of
+ * pairs in the same order in both files, and drop the others, which are
+ * shown as deleted and inserted.
+ */
+static int keyed_order(long *match, long n1)
+{
+	long i, j, lo, hi, mid, len, *tail, *prev;
+
+	for (i = 0, j = -1; i < n1; i++)
+		if (match[i] >= 0) {
+			if (match[i] < j)
+				break;
+			j = match[i];
+		}
+	if (i == n1)
+		return 0;
+
+	if (!XDL_ALLOC_ARRAY(tail, n1))
+		return -1;
+	if (!XDL_ALLOC_ARRAY(prev, n1)) {
+		xdl_free(tail);
+		return -1;
+	}
+	for (i = 0, len = 0; i < n1; i++) {
+		if (match[i] < 0)
+			continue;
+		for (lo = 0, hi = len; lo < hi;) {
+			mid = lo + (hi - lo) / 2;
+			if (match[tail[mid]] < match[i])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		prev[i] = lo ? tail[lo - 1] : -1;
+		tail[lo] = i;
+		if (lo == len)
+			len++;
+	}
+
+	/* mark the kept pairs by flipping them below -1 */
+	for (i = len ? tail[len - 1] : -1; i >= 0; i = prev[i])
+		match[i] = -2 - match[i];
+	for (i = 0; i < n1; i++)
+		match[i] = match[i] < -1 ? -2 - match[i] : -1;
+
+	xdl_free(prev);
+	xdl_free(tail);
+
+	return 0;
+}
+
+int xdl_diff_keyed(mmfile_t *mf1, mmfile_t *mf2, xdkeyparam_t const *xkp,
+		   xdemitconf_t const *xecfg, xdemitcb_t *ecb)
+{
+	xdfenv_t xe;
+	xdkey_t *k1 = NULL, *k2 = NULL;
+	xdchange_t *xscr = NULL;
+	long i, n1, n2, *match = NULL;
+	int res = -1;
+
+	if (xdl_prepare_env(mf1, mf2, &xkp->xpp, &xe) < 0)
+		return -1;
+	n1 = xe.xdf1.nrec;
+	n2 = xe.xdf2.nrec;
+	if (keyed_keys(&xe.xdf1, xkp, &k1) < 0 ||
+	    keyed_keys(&xe.xdf2, xkp, &k2) < 0 ||
+	    (n1 && !XDL_ALLOC_ARRAY(match, n1)))
+		goto cleanup;
+	for (i = 0; i < n1; i++)
+		match[i] = -1;
+
+	if (xkp->sorted)
+		keyed_merge_join(k1, n1, k2, n2, match);
+	else if (keyed_hash_join(k1, n1, k2, n2, xkp->xpp.flags, match) < 0 ||
+		 keyed_order(match, n1) < 0)
+		goto cleanup;
+
+	/* this also clears what xdl_prepare_env() marked on its own */
+	xdl_rchg_fill(&xe.xdf1, 0, n1);
+	xdl_rchg_fill(&xe.xdf2, 0, n2);
+	for (i = 0; i < n1; i++)
+		if (match[i] >= 0 &&
+		    xe.xdf1.recs[i]->ha == xe.xdf2.recs[match[i]]->ha) {
+			XDL_CLR_CHANGED(&xe.xdf1, i);
+			XDL_CLR_CHANGED(&xe.xdf2, match[i]);
+		}
+
+	if (xdl_build_script(&xe, &xscr) < 0)
+		goto cleanup;
+	xdl_mark_ignorable(xscr, &xe, &xkp->xpp);
+	if (xscr && xecfg->flags & XDL_EMIT_MOVES &&
+	    xdl_mark_moves(&xe, xscr) < 0)
+		goto cleanup;
+	res = xdl_emit_changes(&xe, xscr, ecb, xecfg);
+
+cleanup:
+	xdl_free_script(xscr);
+	xdl_free(match);
+	xdl_free(k2);
+	xdl_free(k1);
+	xdl_free_env(&xe);
+
+	return res;
+}
@@ -68,4 +68,28 @@ do { \
 	(-!((nr) <= (alloc) ||		\
 	    ((p) = xdl_alloc_grow_helper((p), (nr), &(alloc), sizeof(*(p))))))
 
+/*
+ * Change maps hold one byte per record in rchg, or with XDF_PACKED_CHANGES
+ * one bit in rbits (and another in rmoved once xdl_mark_moves() needs it).
+ * Either has room for the records at -1 and nrec, which stay unchanged.
+ */
+#define XDL_RBIT_TEST(m, i) (((m)[((i) + 1) >> 6] >> (((i) + 1) & 63)) & 1)
+#define XDL_RBIT_SET(m, i) ((m)[((i) + 1) >> 6] |= UINT64_C(1) << (((i) + 1) & 63))
+#define XDL_RBIT_CLR(m, i) ((m)[((i) + 1) >> 6] &= ~(UINT64_C(1) << (((i) + 1) & 63)))
+#define XDL_RBIT_WORDS(nrec) (((nrec) + 2 + 63) >> 6)
+#define XDL_CHANGED(xdf, i) \
+	((xdf)->rbits ? (int) XDL_RBIT_TEST((xdf)->rbits, i) : (xdf)->rchg[i] != 0)
+#define XDL_SET_CHANGED(xdf, i) \
+	((xdf)->rbits ? (void) XDL_RBIT_SET((xdf)->rbits, i) : \
+			(void) ((xdf)->rchg[i] = 1))
+#define XDL_CLR_CHANGED(xdf, i) \
+	((xdf)->rbits ? (void) XDL_RBIT_CLR((xdf)->rbits, i) : \
+			(void) ((xdf)->rchg[i] = 0))
+#define XDL_MOVED(xdf, i) \
+	((xdf)->rbits ? (xdf)->rmoved && XDL_RBIT_TEST((xdf)->rmoved, i) : \
+			((xdf)->rchg[i] & XDL_RCHG_MOVED) != 0)
+#define XDL_SET_MOVED(xdf, i) \
+	((xdf)->rbits ? (void) XDL_RBIT_SET((xdf)->rmoved, i) : \
+			(void) ((xdf)->rchg[i] |= XDL_RCHG_MOVED))
+
 #endif /* #if !defined(XMACROS_H) */
@@ -0,0 +1,147 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+#include "xinclude.h"
+
+
+/*
+ * The changes of the script, each as the start and end of its lines on
+ * both sides, in order. Every side is sorted on its own, so a line of
+ * either side is looked up with a binary search over the changes.
+ */
+typedef struct s_xdlmrange {
+	long s1, e1;
+	long s2, e2;
+} xdlmrange_t;
+
+struct s_xdlinemap {
+	xdlmrange_t *range;
+	long nr;
+};
+
+
+xdlinemap_t *xdl_linemap_new(xdscript_t const *script)
+{
+	xdlinemap_t *map;
+	xdedit_t const *e;
+	long k;
+
+	if (!(map = xdl_malloc(sizeof(*map))))
+		return NULL;
+	map->range = NULL;
+	map->nr = script->nr;
+	if (map->nr && !XDL_ALLOC_ARRAY(map->range, map->nr)) {
+		xdl_free(map);
+		return NULL;
+	}
+	for (k = 0; k < map->nr; k++) {
+		e = script->edit + k;
+		map->range[k].s1 = e->i1;
+		map->range[k].e1 = e->i1 + e->chg1;
+		map->range[k].s2 = e->i2;
+		map->range[k].e2 = e->i2 + e->chg2;
+	}
+
+	return map;
+}
+
+void xdl_linemap_free(xdlinemap_t *map)
+{
+	if (!map)
+		return;
+	xdl_free(map->range);
+	xdl_free(map);
+}
+
+static long linemap_start(xdlmrange_t const *r, int side)
+{
+	return side == 1 ? r->s1 : r->s2;
+}
+
+/*
+ * The number of changes starting at or before line of side.
+ */
+static long linemap_find(xdlinemap_t const *map, int side, long line)
+{
+	long lo = 0, hi = map->nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (linemap_start(map->range + mid, side) <= line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Map line of side through the k changes before it, the last of which
+ * may hold it.
+ */
+static long linemap_map(xdlinemap_t const *map, int side, long k, long line,
+			int *status)
+{
+	xdlmrange_t const *r;
+
+	*status = XDL_LINE_SAME;
+	if (!k)
+		return line;
+	r = map->range + k - 1;
+	if (side == 1) {
+		if (line < r->e1) {
+			*status = XDL_LINE_DELETED;
+			return r->s2;
+		}
+		return line - r->e1 + r->e2;
+	}
+	if (line < r->e2) {
+		*status = XDL_LINE_INSERTED;
+		return r->s1;
+	}
+	return line - r->e2 + r->e1;
+}
+
+long xdl_linemap_line(xdlinemap_t const *map, int side, long line, int *status)
+{
+	return linemap_map(map, side, linemap_find(map, side, line), line,
+			   status);
+}
+
+void xdl_linemap_lines(xdlinemap_t const *map, int side, long const *line,
+		       long nr, long *out, int *status)
+{
+	long i, k = 0;
+
+	for (i = 0; i < nr; i++) {
+		/* in sorted input, the next change is never far */
+		if (i && line[i] < line[i - 1])
+			k = linemap_find(map, side, line[i]);
+		else
+			while (k < map->nr &&
+			       linemap_start(map->range + k, side) <= line[i])
+				k++;
+		out[i] = linemap_map(map, side, k, line[i], status + i);
+	}
+}
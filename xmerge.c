@@ -93,60 +93,93 @@ static int xdl_cleanup_merge(xdmerge_t *c)
 	return count;
 }
 
-static int xdl_merge_cmp_lines(xdfenv_t *xe1, int i1, xdfenv_t *xe2, int i2,
-		int line_count, long flags)
+/*
+ * xe1 and xe2 are prepared with a shared classifier (see
+ * xdl_prepare_merge_env()), so lines from both sides match exactly when
+ * their class ids do.
+ */
+static int xdl_merge_cmp_lines(xdfenv_t *xe1, long i1, xdfenv_t *xe2, long i2,
+		long line_count)
 {
-	int i;
+	long i;
 	xrecord_t **rec1 = xe1->xdf2.recs + i1;
 	xrecord_t **rec2 = xe2->xdf2.recs + i2;
 
-	for (i = 0; i < line_count; i++) {
-		int result = xdl_recmatch(rec1[i]->ptr, rec1[i]->size,
-			rec2[i]->ptr, rec2[i]->size, flags);
-		if (!result)
+	for (i = 0; i < line_count; i++)
+		if (rec1[i]->ha != rec2[i]->ha)
+			return -1;
+	return 0;
+}
+
+/*
+ * The merge result is produced as a sequence of pieces: runs of records,
+ * which are passed as views into the input files, line endings and
+ * conflict markers. merge_emit() hands one piece to the sink.
+ */
+static int merge_emit(xdmergecb_t *cb, const char *ptr, long size)
+{
+	mmbuffer_t mb;
+
+	if (size <= 0)
+		return 0;
+	mb.ptr = (char *) ptr;
+	mb.size = size;
+	return cb->out(cb->priv, &mb, 1);
+}
+
+static int merge_emit_rope(xdmergecb_t *cb, mmrope_t const *mr)
+{
+	long c;
+
+	for (c = 0; c < mr->nr; c++)
+		if (merge_emit(cb, mr->chunk[c].ptr, mr->chunk[c].size) < 0)
 			return -1;
-	}
 	return 0;
 }
 
-static int xdl_recs_copy_0(int use_orig, xdfenv_t *xe, int i, int count, int needs_cr, int add_nl, char *dest)
+static int xdl_recs_copy_0(int use_orig, xdfenv_t *xe, long i, long count, int needs_cr, int add_nl, xdmergecb_t *cb)
 {
 	xrecord_t **recs;
-	int size = 0;
+	char const *start, *end;
+	long size;
 
 	recs = (use_orig ? xe->xdf1.recs : xe->xdf2.recs) + i;
 
 	if (count < 1)
 		return 0;
 
-	for (i = 0; i < count; size += recs[i++]->size)
-		if (dest)
-			memcpy(dest + size, recs[i]->ptr, recs[i]->size);
+	/* Pass on runs of adjacent records as a single view */
+	start = recs[0]->ptr;
+	end = start + recs[0]->size;
+	for (i = 1; i < count; i++) {
+		if (recs[i]->ptr != end) {
+			if (merge_emit(cb, start, end - start) < 0)
+				return -1;
+			start = recs[i]->ptr;
+		}
+		end = recs[i]->ptr + recs[i]->size;
+	}
+	if (merge_emit(cb, start, end - start) < 0)
+		return -1;
 	if (add_nl) {
-		i = recs[count - 1]->size;
-		if (i == 0 || recs[count - 1]->ptr[i - 1] != '\n') {
-			if (needs_cr) {
-				if (dest)
-					dest[size] = '\r';
-				size++;
-			}
-
-			if (dest)
-				dest[size] = '\n';
-			size++;
+		size = recs[count - 1]->size;
+		if (size == 0 || recs[count - 1]->ptr[size - 1] != '\n') {
+			if (needs_cr)
+				return merge_emit(cb, "\r\n", 2);
+			return merge_emit(cb, "\n", 1);
 		}
 	}
-	return size;
+	return 0;
 }
 
-static int xdl_recs_copy(xdfenv_t *xe, int i, int count, int needs_cr, int add_nl, char *dest)
+static int xdl_recs_copy(xdfenv_t *xe, long i, long count, int needs_cr, int add_nl, xdmergecb_t *cb)
 {
-	return xdl_recs_copy_0(0, xe, i, count, needs_cr, add_nl, dest);
+	return xdl_recs_copy_0(0, xe, i, count, needs_cr, add_nl, cb);
 }
 
-static int xdl_orig_copy(xdfenv_t *xe, int i, int count, int needs_cr, int add_nl, char *dest)
+static int xdl_orig_copy(xdfenv_t *xe, long i, long count, int needs_cr, int add_nl, xdmergecb_t *cb)
 {
-	return xdl_recs_copy_0(1, xe, i, count, needs_cr, add_nl, dest);
+	return xdl_recs_copy_0(1, xe, i, count, needs_cr, add_nl, cb);
 }
 
 /*
@@ -154,7 +187,7 @@ static int xdl_orig_copy(xdfenv_t *xe, int i, int count, int needs_cr, int add_n
  * has no eol, the preceding line, if any), 0 if it ends in LF-only, and
  * -1 if the line ending cannot be determined.
  */
-static int is_eol_crlf(xdfile_t *file, int i)
+static int is_eol_crlf(xdfile_t *file, long i)
 {
 	long size;
 
@@ -193,146 +226,141 @@ static int is_cr_needed(xdfenv_t *xe1, xdfenv_t *xe2, xdmerge_t *m)
 	return needs_cr < 0 ? 0 : needs_cr;
 }
 
-static int fill_conflict_hunk(xdfenv_t *xe1, const char *name1,
-			      xdfenv_t *xe2, const char *name2,
-			      const char *name3,
-			      int size, int i, int style,
-			      xdmerge_t *m, char *dest, int marker_size)
+/*
+ * The conflict marker lines, without their line ending, built once per
+ * merge: "<<<<<<< name1", "||||||| name3", "=======" and ">>>>>>> name2".
+ */
+struct merge_markers {
+	char *buf;
+	mmbuffer_t line[4];
+};
+
+static int init_markers(struct merge_markers *mk, const char *name1,
+			const char *name2, const char *name3, int marker_size)
 {
-	int marker1_size = (name1 ? strlen(name1) + 1 : 0);
-	int marker2_size = (name2 ? strlen(name2) + 1 : 0);
-	int marker3_size = (name3 ? strlen(name3) + 1 : 0);
-	int needs_cr = is_cr_needed(xe1, xe2, m);
+	static const char marker_char[4] = { '<', '|', '=', '>' };
+	const char *name[4];
+	long size = 0;
+	int k;
+	char *ptr;
+
+	name[0] = name1;
+	name[1] = name3;
+	name[2] = NULL;
+	name[3] = name2;
 
 	if (marker_size <= 0)
 		marker_size = DEFAULT_CONFLICT_MARKER_SIZE;
 
-	/* Before conflicting part */
-	size += xdl_recs_copy(xe1, i, m->i1 - i, 0, 0,
-			      dest ? dest + size : NULL);
+	for (k = 0; k < 4; k++)
+		size += marker_size + (name[k] ? strlen(name[k]) + 1 : 0);
+	if (!XDL_ALLOC_ARRAY(mk->buf, size))
+		return -1;
 
-	if (!dest) {
-		size += marker_size + 1 + needs_cr + marker1_size;
-	} else {
-		memset(dest + size, '<', marker_size);
-		size += marker_size;
-		if (marker1_size) {
-			dest[size] = ' ';
-			memcpy(dest + size + 1, name1, marker1_size - 1);
-			size += marker1_size;
+	for (ptr = mk->buf, k = 0; k < 4; k++) {
+		mk->line[k].ptr = ptr;
+		memset(ptr, marker_char[k], marker_size);
+		ptr += marker_size;
+		if (name[k]) {
+			*ptr++ = ' ';
+			memcpy(ptr, name[k], strlen(name[k]));
+			ptr += strlen(name[k]);
 		}
-		if (needs_cr)
-			dest[size++] = '\r';
-		dest[size++] = '\n';
+		mk->line[k].size = ptr - mk->line[k].ptr;
 	}
+	return 0;
+}
+
+static int emit_marker(struct merge_markers *mk, int k, int needs_cr,
+		       xdmergecb_t *cb)
+{
+	if (merge_emit(cb, mk->line[k].ptr, mk->line[k].size) < 0)
+		return -1;
+	if (needs_cr)
+		return merge_emit(cb, "\r\n", 2);
+	return merge_emit(cb, "\n", 1);
+}
+
+static int fill_conflict_hunk(xdfenv_t *xe1, xdfenv_t *xe2,
+			      struct merge_markers *mk,
+			      long i, int style,
+			      xdmerge_t *m, xdmergecb_t *cb)
+{
+	int needs_cr = is_cr_needed(xe1, xe2, m);
+
+	/* Before conflicting part */
+	if (xdl_recs_copy(xe1, i, m->i1 - i, 0, 0, cb) < 0 ||
+	    emit_marker(mk, 0, needs_cr, cb) < 0)
+		return -1;
 
 	/* Postimage from side #1 */
-	size += xdl_recs_copy(xe1, m->i1, m->chg1, needs_cr, 1,
-			      dest ? dest + size : NULL);
+	if (xdl_recs_copy(xe1, m->i1, m->chg1, needs_cr, 1, cb) < 0)
+		return -1;
 
 	if (style == XDL_MERGE_DIFF3 || style == XDL_MERGE_ZEALOUS_DIFF3) {
 		/* Shared preimage */
-		if (!dest) {
-			size += marker_size + 1 + needs_cr + marker3_size;
-		} else {
-			memset(dest + size, '|', marker_size);
-			size += marker_size;
-			if (marker3_size) {
-				dest[size] = ' ';
-				memcpy(dest + size + 1, name3, marker3_size - 1);
-				size += marker3_size;
-			}
-			if (needs_cr)
-				dest[size++] = '\r';
-			dest[size++] = '\n';
-		}
-		size += xdl_orig_copy(xe1, m->i0, m->chg0, needs_cr, 1,
-				      dest ? dest + size : NULL);
+		if (emit_marker(mk, 1, needs_cr, cb) < 0 ||
+		    xdl_orig_copy(xe1, m->i0, m->chg0, needs_cr, 1, cb) < 0)
+			return -1;
 	}
 
-	if (!dest) {
-		size += marker_size + 1 + needs_cr;
-	} else {
-		memset(dest + size, '=', marker_size);
-		size += marker_size;
-		if (needs_cr)
-			dest[size++] = '\r';
-		dest[size++] = '\n';
-	}
+	if (emit_marker(mk, 2, needs_cr, cb) < 0)
+		return -1;
 
 	/* Postimage from side #2 */
-	size += xdl_recs_copy(xe2, m->i2, m->chg2, needs_cr, 1,
-			      dest ? dest + size : NULL);
-	if (!dest) {
-		size += marker_size + 1 + needs_cr + marker2_size;
-	} else {
-		memset(dest + size, '>', marker_size);
-		size += marker_size;
-		if (marker2_size) {
-			dest[size] = ' ';
-			memcpy(dest + size + 1, name2, marker2_size - 1);
-			size += marker2_size;
-		}
-		if (needs_cr)
-			dest[size++] = '\r';
-		dest[size++] = '\n';
-	}
-	return size;
+	if (xdl_recs_copy(xe2, m->i2, m->chg2, needs_cr, 1, cb) < 0 ||
+	    emit_marker(mk, 3, needs_cr, cb) < 0)
+		return -1;
+	return 0;
 }
 
-static int xdl_fill_merge_buffer(xdfenv_t *xe1, const char *name1,
-				 xdfenv_t *xe2, const char *name2,
-				 const char *ancestor_name,
+static int xdl_fill_merge_buffer(xdfenv_t *xe1, xdfenv_t *xe2,
+				 struct merge_markers *mk,
 				 int favor,
-				 xdmerge_t *m, char *dest, int style,
-				 int marker_size)
+				 xdmerge_t *m, int style,
+				 xdmergecb_t *cb)
 {
-	int size, i;
+	long i;
 
-	for (size = i = 0; m; m = m->next) {
+	for (i = 0; m; m = m->next) {
 		if (favor && !m->mode)
 			m->mode = favor;
 
-		if (m->mode == 0)
-			size = fill_conflict_hunk(xe1, name1, xe2, name2,
-						  ancestor_name,
-						  size, i, style, m, dest,
-						  marker_size);
-		else if (m->mode & 3) {
+		if (m->mode == 0) {
+			if (fill_conflict_hunk(xe1, xe2, mk, i, style, m, cb) < 0)
+				return -1;
+		} else if (m->mode & 3) {
 			/* Before conflicting part */
-			size += xdl_recs_copy(xe1, i, m->i1 - i, 0, 0,
-					      dest ? dest + size : NULL);
+			if (xdl_recs_copy(xe1, i, m->i1 - i, 0, 0, cb) < 0)
+				return -1;
 			/* Postimage from side #1 */
 			if (m->mode & 1) {
 				int needs_cr = is_cr_needed(xe1, xe2, m);
 
-				size += xdl_recs_copy(xe1, m->i1, m->chg1, needs_cr, (m->mode & 2),
-						      dest ? dest + size : NULL);
+				if (xdl_recs_copy(xe1, m->i1, m->chg1, needs_cr,
+						  (m->mode & 2), cb) < 0)
+					return -1;
 			}
 			/* Postimage from side #2 */
-			if (m->mode & 2)
-				size += xdl_recs_copy(xe2, m->i2, m->chg2, 0, 0,
-						      dest ? dest + size : NULL);
+			if (m->mode & 2 &&
+			    xdl_recs_copy(xe2, m->i2, m->chg2, 0, 0, cb) < 0)
+				return -1;
 		} else
 			continue;
 		i = m->i1 + m->chg1;
 	}
-	size += xdl_recs_copy(xe1, i, xe1->xdf2.nrec - i, 0, 0,
-			      dest ? dest + size : NULL);
-	return size;
+	return xdl_recs_copy(xe1, i, xe1->xdf2.nrec - i, 0, 0, cb);
 }
 
-static int recmatch(xrecord_t *rec1, xrecord_t *rec2, unsigned long flags)
+static int recmatch(xrecord_t *rec1, xrecord_t *rec2)
 {
-	return xdl_recmatch(rec1->ptr, rec1->size,
-			    rec2->ptr, rec2->size, flags);
+	return rec1->ha == rec2->ha;
 }
 
 /*
  * Remove any common lines from the beginning and end of the conflicted region.
  */
-static void xdl_refine_zdiff3_conflicts(xdfenv_t *xe1, xdfenv_t *xe2, xdmerge_t *m,
-		xpparam_t const *xpp)
+static void xdl_refine_zdiff3_conflicts(xdfenv_t *xe1, xdfenv_t *xe2, xdmerge_t *m)
 {
 	xrecord_t **rec1 = xe1->xdf2.recs, **rec2 = xe2->xdf2.recs;
 	for (; m; m = m->next) {
@@ -341,7 +369,7 @@ static void xdl_refine_zdiff3_conflicts(xdfenv_t *xe1, xdfenv_t *xe2, xdmerge_t
 			continue;
 
 		while(m->chg1 && m->chg2 &&
-		      recmatch(rec1[m->i1], rec2[m->i2], xpp->flags)) {
+		      recmatch(rec1[m->i1], rec2[m->i2])) {
 			m->chg1--;
 			m->chg2--;
 			m->i1++;
@@ -349,13 +377,78 @@ static void xdl_refine_zdiff3_conflicts(xdfenv_t *xe1, xdfenv_t *xe2, xdmerge_t
 		}
 		while (m->chg1 && m->chg2 &&
 		       recmatch(rec1[m->i1 + m->chg1 - 1],
-				rec2[m->i2 + m->chg2 - 1], xpp->flags)) {
+				rec2[m->i2 + m->chg2 - 1])) {
 			m->chg1--;
 			m->chg2--;
 		}
 	}
 }
 
+/*
+ * One conflict to refine, and the diff between its two sides.
+ */
+struct refine {
+	xdmerge_t *m;
+	xdchange_t *xscr;
+};
+
+struct refine_all {
+	xdfenv_t *xe1, *xe2;
+	xpparam_t xpp;
+	struct refine *r;
+};
+
+/*
+ * Diff the two sides of conflict k directly on the records already
+ * prepared for the merge.
+ */
+static int refine_one(void *priv, long k)
+{
+	struct refine_all *ra = priv;
+	xdmerge_t *m = ra->r[k].m;
+	xdfenv_t xe;
+
+	if (xdl_prepare_range_env(&ra->xe1->xdf2, m->i1, m->chg1,
+				  &ra->xe2->xdf2, m->i2, m->chg2,
+				  &ra->xpp, &xe) < 0 ||
+	    xdl_diff_env(&ra->xpp, &xe) < 0)
+		return -1;
+	if (xdl_change_compact(&xe.xdf1, &xe.xdf2, ra->xpp.flags) < 0 ||
+	    xdl_change_compact(&xe.xdf2, &xe.xdf1, ra->xpp.flags) < 0 ||
+	    xdl_build_script(&xe, &ra->r[k].xscr) < 0) {
+		xdl_free_env(&xe);
+		return -1;
+	}
+	xdl_free_env(&xe);
+	return 0;
+}
+
+/*
+ * Refine all conflicts in r. With XDF_PARALLEL, they are spread over the
+ * pool, and each one is diffed serially.
+ */
+static int refine_all(xdfenv_t *xe1, xdfenv_t *xe2, xpparam_t const *xpp,
+		      struct refine *r, long nr)
+{
+	struct refine_all ra;
+	xdpool_t pool;
+	long i, lines;
+	int ret;
+
+	if (xdl_pool_init(&pool, xpp) < 0)
+		return -1;
+	ra.xe1 = xe1;
+	ra.xe2 = xe2;
+	ra.xpp = *xpp;
+	ra.xpp.flags &= ~XDF_PARALLEL;
+	ra.r = r;
+	for (i = 0, lines = 0; i < nr; i++)
+		lines += r[i].m->chg1 + r[i].m->chg2;
+	ret = xdl_pool_run(&pool, nr, lines, refine_one, &ra);
+	xdl_pool_free(&pool);
+	return ret;
+}
+
 /*
  * Sometimes, changes are not quite identical, but differ in only a few
  * lines. Try hard to show only these few lines as conflicting.
@@ -363,12 +456,11 @@ static void xdl_refine_zdiff3_conflicts(xdfenv_t *xe1, xdfenv_t *xe2, xdmerge_t
 static int xdl_refine_conflicts(xdfenv_t *xe1, xdfenv_t *xe2, xdmerge_t *m,
 		xpparam_t const *xpp)
 {
-	for (; m; m = m->next) {
-		mmfile_t t1, t2;
-		xdfenv_t xe;
-		xdchange_t *xscr, *x;
-		int i1 = m->i1, i2 = m->i2;
+	struct refine *r = NULL;
+	long nr = 0, alloc = 0, k;
+	int ret = -1;
 
+	for (; m; m = m->next) {
 		/* let's handle just the conflicts */
 		if (m->mode)
 			continue;
@@ -377,56 +469,56 @@ static int xdl_refine_conflicts(xdfenv_t *xe1, xdfenv_t *xe2, xdmerge_t *m,
 		if (m->chg1 == 0 || m->chg2 == 0)
 			continue;
 
-		/*
-		 * This probably does not work outside git, since
-		 * we have a very simple mmfile structure.
-		 */
-		t1.ptr = (char *)xe1->xdf2.recs[m->i1]->ptr;
-		t1.size = xe1->xdf2.recs[m->i1 + m->chg1 - 1]->ptr
-			+ xe1->xdf2.recs[m->i1 + m->chg1 - 1]->size - t1.ptr;
-		t2.ptr = (char *)xe2->xdf2.recs[m->i2]->ptr;
-		t2.size = xe2->xdf2.recs[m->i2 + m->chg2 - 1]->ptr
-			+ xe2->xdf2.recs[m->i2 + m->chg2 - 1]->size - t2.ptr;
-		if (xdl_do_diff(&t1, &t2, xpp, &xe) < 0)
-			return -1;
-		if (xdl_change_compact(&xe.xdf1, &xe.xdf2, xpp->flags) < 0 ||
-		    xdl_change_compact(&xe.xdf2, &xe.xdf1, xpp->flags) < 0 ||
-		    xdl_build_script(&xe, &xscr) < 0) {
-			xdl_free_env(&xe);
-			return -1;
-		}
+		if (XDL_ALLOC_GROW(r, nr + 1, alloc))
+			goto out;
+		r[nr].m = m;
+		r[nr].xscr = NULL;
+		nr++;
+	}
+	if (refine_all(xe1, xe2, xpp, r, nr) < 0)
+		goto out;
+
+	for (k = 0; k < nr; k++) {
+		xdchange_t *xscr = r[k].xscr;
+		long i1, i2, end0;
+
+		m = r[k].m;
 		if (!xscr) {
 			/* If this happens, the changes are identical. */
-			xdl_free_env(&xe);
 			m->mode = 4;
 			continue;
 		}
-		x = xscr;
+		i1 = m->i1;
+		i2 = m->i2;
+		end0 = m->i0 + m->chg0;
 		m->i1 = xscr->i1 + i1;
 		m->chg1 = xscr->chg1;
 		m->i2 = xscr->i2 + i2;
 		m->chg2 = xscr->chg2;
 		while (xscr->next) {
 			xdmerge_t *m2 = xdl_malloc(sizeof(xdmerge_t));
-			if (!m2) {
-				xdl_free_env(&xe);
-				xdl_free_script(x);
-				return -1;
-			}
+			if (!m2)
+				goto out;
 			xscr = xscr->next;
 			m2->next = m->next;
 			m->next = m2;
 			m = m2;
 			m->mode = 0;
+			/* the whole preimage stays with the first piece */
+			m->i0 = end0;
+			m->chg0 = 0;
 			m->i1 = xscr->i1 + i1;
 			m->chg1 = xscr->chg1;
 			m->i2 = xscr->i2 + i2;
 			m->chg2 = xscr->chg2;
 		}
-		xdl_free_env(&xe);
-		xdl_free_script(x);
 	}
-	return 0;
+	ret = 0;
+ out:
+	for (k = 0; k < nr; k++)
+		xdl_free_script(r[k].xscr);
+	xdl_free(r);
+	return ret;
 }
 
 static int line_contains_alnum(const char *ptr, long size)
@@ -437,7 +529,7 @@ static int line_contains_alnum(const char *ptr, long size)
 	return 0;
 }
 
-static int lines_contain_alnum(xdfenv_t *xe, int i, int chg)
+static int lines_contain_alnum(xdfenv_t *xe, long i, long chg)
 {
 	for (; chg; chg--, i++)
 		if (line_contains_alnum(xe->xdf2.recs[i]->ptr,
@@ -453,6 +545,7 @@ static int lines_contain_alnum(xdfenv_t *xe, int i, int chg)
 static void xdl_merge_two_conflicts(xdmerge_t *m)
 {
 	xdmerge_t *next_m = m->next;
+	m->chg0 = next_m->i0 + next_m->chg0 - m->i0;
 	m->chg1 = next_m->i1 + next_m->chg1 - m->i1;
 	m->chg2 = next_m->i2 + next_m->chg2 - m->i2;
 	m->next = next_m->next;
@@ -473,7 +566,7 @@ static int xdl_simplify_non_conflicts(xdfenv_t *xe1, xdmerge_t *m,
 		return result;
 	for (;;) {
 		xdmerge_t *next_m = m->next;
-		int begin, end;
+		long begin, end;
 
 		if (!next_m)
 			return result;
@@ -500,21 +593,17 @@ static int xdl_simplify_non_conflicts(xdfenv_t *xe1, xdmerge_t *m,
  * level == 3: analyze non-identical changes for minimal conflict set, but
  *             treat hunks not containing any letter or number as conflicting
  *
- * returns < 0 on error, == 0 for no conflicts, else number of conflicts
+ * returns < 0 on error, else 0 with the merged changes in *out
  */
-static int xdl_do_merge(xdfenv_t *xe1, xdchange_t *xscr1,
+static int xdl_build_merge(xdfenv_t *xe1, xdchange_t *xscr1,
 		xdfenv_t *xe2, xdchange_t *xscr2,
-		xmparam_t const *xmp, mmbuffer_t *result)
+		xmparam_t const *xmp, xdmerge_t **out)
 {
 	xdmerge_t *changes, *c;
 	xpparam_t const *xpp = &xmp->xpp;
-	const char *const ancestor_name = xmp->ancestor;
-	const char *const name1 = xmp->file1;
-	const char *const name2 = xmp->file2;
-	int i0, i1, i2, chg0, chg1, chg2;
+	long i0, i1, i2, chg0, chg1, chg2;
 	int level = xmp->level;
 	int style = xmp->style;
-	int favor = xmp->favor;
 
 	/*
 	 * XDL_MERGE_DIFF3 does not attempt to refine conflicts by looking
@@ -580,10 +669,10 @@ static int xdl_do_merge(xdfenv_t *xe1, xdchange_t *xscr1,
 				xscr1->chg2 != xscr2->chg2 ||
 				xdl_merge_cmp_lines(xe1, xscr1->i2,
 					xe2, xscr2->i2,
-					xscr1->chg2, xpp->flags)) {
+					xscr1->chg2)) {
 			/* conflict */
-			int off = xscr1->i1 - xscr2->i1;
-			int ffo = off + xscr1->chg1 - xscr2->chg1;
+			long off = xscr1->i1 - xscr2->i1;
+			long ffo = off + xscr1->chg1 - xscr2->chg1;
 
 			i0 = xscr1->i1;
 			i1 = xscr1->i2;
@@ -653,7 +742,7 @@ static int xdl_do_merge(xdfenv_t *xe1, xdchange_t *xscr1,
 		changes = c;
 	/* refine conflicts */
 	if (style == XDL_MERGE_ZEALOUS_DIFF3) {
-		xdl_refine_zdiff3_conflicts(xe1, xe2, changes, xpp);
+		xdl_refine_zdiff3_conflicts(xe1, xe2, changes);
 	} else if (XDL_MERGE_ZEALOUS <= level &&
 		   (xdl_refine_conflicts(xe1, xe2, changes, xpp) < 0 ||
 		    xdl_simplify_non_conflicts(xe1, changes,
@@ -661,79 +750,569 @@ static int xdl_do_merge(xdfenv_t *xe1, xdchange_t *xscr1,
 		xdl_cleanup_merge(changes);
 		return -1;
 	}
-	/* output */
-	if (result) {
-		int marker_size = xmp->marker_size;
-		int size = xdl_fill_merge_buffer(xe1, name1, xe2, name2,
-						 ancestor_name,
-						 favor, changes, NULL, style,
-						 marker_size);
-		result->ptr = xdl_malloc(size);
-		if (!result->ptr) {
-			xdl_cleanup_merge(changes);
-			return -1;
-		}
-		result->size = size;
-		xdl_fill_merge_buffer(xe1, name1, xe2, name2,
-				      ancestor_name, favor, changes,
-				      result->ptr, style, marker_size);
+	*out = changes;
+	return 0;
+}
+
+/*
+ * returns < 0 on error, == 0 for no conflicts, else number of conflicts
+ */
+static int xdl_do_merge(xdfenv_t *xe1, xdchange_t *xscr1,
+		xdfenv_t *xe2, xdchange_t *xscr2,
+		xmparam_t const *xmp, xdmergecb_t *cb)
+{
+	struct merge_markers mk;
+	xdmerge_t *changes;
+
+	if (xdl_build_merge(xe1, xscr1, xe2, xscr2, xmp, &changes) < 0)
+		return -1;
+
+	if (init_markers(&mk, xmp->file1, xmp->file2, xmp->ancestor,
+			 xmp->marker_size) < 0) {
+		xdl_cleanup_merge(changes);
+		return -1;
+	}
+	if (xdl_fill_merge_buffer(xe1, xe2, &mk, xmp->favor, changes,
+				  xmp->style, cb) < 0) {
+		xdl_free(mk.buf);
+		xdl_cleanup_merge(changes);
+		return -1;
 	}
+	xdl_free(mk.buf);
 	return xdl_cleanup_merge(changes);
 }
 
-int xdl_merge(mmfile_t *orig, mmfile_t *mf1, mmfile_t *mf2,
-		xmparam_t const *xmp, mmbuffer_t *result)
+/*
+ * Diff orig against both sides, in environments prepared by one of the
+ * xdl_prepare_merge_env*() functions. On success the caller owns both
+ * environments and scripts; on failure both environments are freed.
+ */
+static int xdl_merge_scripts(xpparam_t const *xpp,
+			     xdfenv_t *xe1, xdchange_t **xscr1,
+			     xdfenv_t *xe2, xdchange_t **xscr2)
 {
-	xdchange_t *xscr1 = NULL, *xscr2 = NULL;
-	xdfenv_t xe1, xe2;
-	int status = -1;
-	xpparam_t const *xpp = &xmp->xpp;
-
-	result->ptr = NULL;
-	result->size = 0;
+	*xscr1 = *xscr2 = NULL;
 
-	if (xdl_do_diff(orig, mf1, xpp, &xe1) < 0)
+	if (xdl_diff_env(xpp, xe1) < 0) {
+		xdl_free_env(xe2);
 		return -1;
+	}
 
-	if (xdl_do_diff(orig, mf2, xpp, &xe2) < 0)
+	if (xdl_diff_env(xpp, xe2) < 0)
 		goto free_xe1; /* avoid double free of xe2 */
 
-	if (xdl_change_compact(&xe1.xdf1, &xe1.xdf2, xpp->flags) < 0 ||
-	    xdl_change_compact(&xe1.xdf2, &xe1.xdf1, xpp->flags) < 0 ||
-	    xdl_build_script(&xe1, &xscr1) < 0)
+	if (xdl_change_compact(&xe1->xdf1, &xe1->xdf2, xpp->flags) < 0 ||
+	    xdl_change_compact(&xe1->xdf2, &xe1->xdf1, xpp->flags) < 0 ||
+	    xdl_build_script(xe1, xscr1) < 0)
 		goto out;
 
-	if (xdl_change_compact(&xe2.xdf1, &xe2.xdf2, xpp->flags) < 0 ||
-	    xdl_change_compact(&xe2.xdf2, &xe2.xdf1, xpp->flags) < 0 ||
-	    xdl_build_script(&xe2, &xscr2) < 0)
+	if (xdl_change_compact(&xe2->xdf1, &xe2->xdf2, xpp->flags) < 0 ||
+	    xdl_change_compact(&xe2->xdf2, &xe2->xdf1, xpp->flags) < 0 ||
+	    xdl_build_script(xe2, xscr2) < 0)
 		goto out;
 
+	return 0;
+
+ out:
+	xdl_free_script(*xscr1);
+	xdl_free_script(*xscr2);
+	*xscr1 = *xscr2 = NULL;
+
+	xdl_free_env(xe2);
+ free_xe1:
+	xdl_free_env(xe1);
+	return -1;
+}
+
+/*
+ * Merge the prepared environments and stream the result to cb. The
+ * environments are freed.
+ */
+static int xdl_merge_envs(xdfenv_t *xe1, xdfenv_t *xe2,
+			  mmrope_t const *mr1, mmrope_t const *mr2,
+			  xmparam_t const *xmp, xdmergecb_t *cb)
+{
+	xdchange_t *xscr1, *xscr2;
+	int status;
+
+	if (xdl_merge_scripts(&xmp->xpp, xe1, &xscr1, xe2, &xscr2) < 0)
+		return -1;
+
 	if (!xscr1) {
-		result->ptr = xdl_malloc(mf2->size);
-		if (!result->ptr)
-			goto out;
-		status = 0;
-		memcpy(result->ptr, mf2->ptr, mf2->size);
-		result->size = mf2->size;
+		status = merge_emit_rope(cb, mr2);
 	} else if (!xscr2) {
-		result->ptr = xdl_malloc(mf1->size);
-		if (!result->ptr)
-			goto out;
-		status = 0;
-		memcpy(result->ptr, mf1->ptr, mf1->size);
-		result->size = mf1->size;
+		status = merge_emit_rope(cb, mr1);
 	} else {
-		status = xdl_do_merge(&xe1, xscr1,
-				      &xe2, xscr2,
-				      xmp, result);
+		status = xdl_do_merge(xe1, xscr1,
+				      xe2, xscr2,
+				      xmp, cb);
 	}
- out:
+
 	xdl_free_script(xscr1);
 	xdl_free_script(xscr2);
+	xdl_free_env(xe2);
+	xdl_free_env(xe1);
 
+	return status;
+}
+
+int xdl_merge_rope_stream(mmrope_t *orig, mmrope_t *mr1, mmrope_t *mr2,
+			  xmparam_t const *xmp, xdmergecb_t *cb)
+{
+	xdfenv_t xe1, xe2;
+
+	if (xdl_prepare_merge_rope_env(orig, mr1, mr2, &xmp->xpp, &xe1, &xe2) < 0)
+		return -1;
+
+	return xdl_merge_envs(&xe1, &xe2, mr1, mr2, xmp, cb);
+}
+
+int xdl_merge_stream(mmfile_t *orig, mmfile_t *mf1, mmfile_t *mf2,
+		     xmparam_t const *xmp, xdmergecb_t *cb)
+{
+	mmbuffer_t c0, c1, c2;
+	mmrope_t mr0, mr1, mr2;
+
+	xdl_file_rope(orig, &c0, &mr0);
+	xdl_file_rope(mf1, &c1, &mr1);
+	xdl_file_rope(mf2, &c2, &mr2);
+
+	return xdl_merge_rope_stream(&mr0, &mr1, &mr2, xmp, cb);
+}
+
+static void range_view(xdfile_t *xdf, long i, long chg, mmbuffer_t *mb)
+{
+	xrecord_t *last;
+
+	if (!chg) {
+		if (i < xdf->nrec)
+			mb->ptr = (char *) xdf->recs[i]->ptr;
+		else if (xdf->nrec)
+			mb->ptr = (char *) xdf->recs[xdf->nrec - 1]->ptr +
+				xdf->recs[xdf->nrec - 1]->size;
+		else
+			mb->ptr = NULL;
+		mb->size = 0;
+		return;
+	}
+	last = xdf->recs[i + chg - 1];
+	mb->ptr = (char *) xdf->recs[i]->ptr;
+	mb->size = last->ptr + last->size - mb->ptr;
+}
+
+static int add_region(xdfenv_t *xe1, xdfenv_t *xe2, int type,
+		      long i0, long chg0, long i1, long chg1, long i2, long chg2,
+		      xdmregion_t **regions, long *nr, long *alloc)
+{
+	xdmregion_t *r;
+
+	if (XDL_ALLOC_GROW(*regions, *nr + 1, *alloc))
+		return -1;
+	r = *regions + (*nr)++;
+	r->type = type;
+	r->i0 = i0;
+	r->chg0 = chg0;
+	r->i1 = i1;
+	r->chg1 = chg1;
+	r->i2 = i2;
+	r->chg2 = chg2;
+	range_view(&xe1->xdf1, i0, chg0, &r->base);
+	range_view(&xe1->xdf2, i1, chg1, &r->ours);
+	range_view(&xe2->xdf2, i2, chg2, &r->theirs);
+	return 0;
+}
+
+/*
+ * Turn the merged changes into regions covering each of the three files
+ * from start to end, the way xdl_fill_merge_buffer() walks them.
+ */
+static int xdl_fill_merge_regions(xdfenv_t *xe1, xdfenv_t *xe2, int favor,
+				  xdmerge_t *m, xdmregion_t **regions, long *nr)
+{
+	static const int type[4] = {
+		XDL_REGION_CONFLICT, XDL_REGION_OURS,
+		XDL_REGION_THEIRS, XDL_REGION_BOTH
+	};
+	long i0 = 0, i1 = 0, i2 = 0, e0, e1, e2, alloc = 0;
+
+	for (;; m = m->next) {
+		/* identical changes are left to the clean region */
+		while (m && m->mode == 4)
+			m = m->next;
+
+		e0 = XDL_MAX(i0, m ? m->i0 : xe1->xdf1.nrec);
+		e1 = m ? m->i1 : xe1->xdf2.nrec;
+		e2 = m ? m->i2 : xe2->xdf2.nrec;
+		if ((e0 > i0 || e1 > i1 || e2 > i2) &&
+		    add_region(xe1, xe2, XDL_REGION_CLEAN, i0, e0 - i0,
+			       i1, e1 - i1, i2, e2 - i2, regions, nr, &alloc) < 0)
+			return -1;
+		if (!m)
+			return 0;
+
+		if (favor && !m->mode)
+			m->mode = favor;
+		if (add_region(xe1, xe2, type[m->mode & 3], m->i0, m->chg0,
+			       m->i1, m->chg1, m->i2, m->chg2,
+			       regions, nr, &alloc) < 0)
+			return -1;
+		i0 = XDL_MAX(e0, m->i0 + m->chg0);
+		i1 = m->i1 + m->chg1;
+		i2 = m->i2 + m->chg2;
+	}
+}
+
+int xdl_merge_regions(mmfile_t *orig, mmfile_t *mf1, mmfile_t *mf2,
+		      xmparam_t const *xmp, xdmregion_t **regions, long *nr)
+{
+	xdchange_t *xscr1, *xscr2;
+	xdmerge_t *changes;
+	xdfenv_t xe1, xe2;
+	int status = -1;
+
+	*regions = NULL;
+	*nr = 0;
+
+	if (xdl_prepare_merge_env(orig, mf1, mf2, &xmp->xpp, &xe1, &xe2) < 0 ||
+	    xdl_merge_scripts(&xmp->xpp, &xe1, &xscr1, &xe2, &xscr2) < 0)
+		return -1;
+
+	if (!xscr1 || !xscr2) {
+		/* as in xdl_merge_stream(), take the other side as a whole */
+		long alloc = 0;
+
+		if (add_region(&xe1, &xe2,
+			       xscr1 ? XDL_REGION_OURS : XDL_REGION_THEIRS,
+			       0, xe1.xdf1.nrec, 0, xe1.xdf2.nrec,
+			       0, xe2.xdf2.nrec, regions, nr, &alloc) == 0)
+			status = 0;
+		goto out;
+	}
+	if (xdl_build_merge(&xe1, xscr1, &xe2, xscr2, xmp, &changes) < 0)
+		goto out;
+	if (xdl_fill_merge_regions(&xe1, &xe2, xmp->favor, changes,
+				   regions, nr) < 0) {
+		xdl_cleanup_merge(changes);
+		xdl_free(*regions);
+		*regions = NULL;
+		*nr = 0;
+		goto out;
+	}
+	status = xdl_cleanup_merge(changes);
+ out:
+	xdl_free_script(xscr1);
+	xdl_free_script(xscr2);
 	xdl_free_env(&xe2);
- free_xe1:
 	xdl_free_env(&xe1);
 
 	return status;
 }
+
+void xdl_free_regions(xdmregion_t *regions)
+{
+	xdl_free(regions);
+}
+
+/*
+ * xdl_merge() collects the pieces of the result first, so the output
+ * buffer can be allocated at its final size and filled with one copy.
+ * Pieces pointing into the input chunks are kept as views; anything else
+ * (conflict markers, added line endings, lines gathered across chunks)
+ * only lives for the duration of the callback and is saved in order to a
+ * side buffer, marked by a NULL piece pointer.
+ */
+struct merge_pieces {
+	mmbuffer_t *span;	/* the input chunks, sorted by address */
+	long nspan;
+	mmbuffer_t *piece;
+	long nr, alloc;
+	char *lit;
+	long lit_nr, lit_alloc;
+	long size;
+};
+
+static int in_spans(struct merge_pieces *mp, const char *ptr, long size)
+{
+	long lo = 0, hi = mp->nspan, mid;
+
+	/* find the last span starting at or before ptr */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (mp->span[mid].ptr <= ptr)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo < mp->nspan && mp->span[lo].ptr <= ptr &&
+		ptr + size <= mp->span[lo].ptr + mp->span[lo].size;
+}
+
+static int merge_collect(void *priv, mmbuffer_t *mb, int nbuf)
+{
+	struct merge_pieces *mp = priv;
+	mmbuffer_t piece;
+	int i;
+
+	for (i = 0; i < nbuf; i++) {
+		piece = mb[i];
+		if (!in_spans(mp, piece.ptr, piece.size)) {
+			if (XDL_ALLOC_GROW(mp->lit, mp->lit_nr + piece.size,
+					   mp->lit_alloc))
+				return -1;
+			memcpy(mp->lit + mp->lit_nr, piece.ptr, piece.size);
+			mp->lit_nr += piece.size;
+			piece.ptr = NULL;
+		}
+		if (XDL_ALLOC_GROW(mp->piece, mp->nr + 1, mp->alloc))
+			return -1;
+		mp->piece[mp->nr++] = piece;
+		mp->size += piece.size;
+	}
+	return 0;
+}
+
+static int span_cmp(const void *a, const void *b)
+{
+	const mmbuffer_t *sa = a, *sb = b;
+
+	return sa->ptr < sb->ptr ? -1 : sa->ptr > sb->ptr;
+}
+
+static int init_pieces(struct merge_pieces *mp, xdmergecb_t *cb,
+		       mmrope_t *orig, mmrope_t *mr1, mmrope_t *mr2)
+{
+	mmrope_t *in[3];
+	long i, c;
+
+	memset(mp, 0, sizeof(*mp));
+	cb->priv = mp;
+	cb->out = merge_collect;
+
+	in[0] = orig;
+	in[1] = mr1;
+	in[2] = mr2;
+	if (!XDL_ALLOC_ARRAY(mp->span, orig->nr + mr1->nr + mr2->nr + 1))
+		return -1;
+	for (i = 0; i < 3; i++)
+		for (c = 0; c < in[i]->nr; c++)
+			if (in[i]->chunk[c].size > 0)
+				mp->span[mp->nspan++] = in[i]->chunk[c];
+	qsort(mp->span, mp->nspan, sizeof(*mp->span), span_cmp);
+	return 0;
+}
+
+/*
+ * Copy the collected pieces to result, if the merge went well, and
+ * release them. Returns status, or -1 if the copy failed.
+ */
+static int finish_pieces(struct merge_pieces *mp, int status,
+			 mmbuffer_t *result)
+{
+	long i;
+	char *dest, *lit;
+
+	result->ptr = NULL;
+	result->size = 0;
+	if (status < 0)
+		goto out;
+
+	if (!XDL_ALLOC_ARRAY(result->ptr, mp->size ? mp->size : 1)) {
+		status = -1;
+		goto out;
+	}
+	for (dest = result->ptr, lit = mp->lit, i = 0; i < mp->nr; i++) {
+		if (mp->piece[i].ptr) {
+			memcpy(dest, mp->piece[i].ptr, mp->piece[i].size);
+		} else {
+			memcpy(dest, lit, mp->piece[i].size);
+			lit += mp->piece[i].size;
+		}
+		dest += mp->piece[i].size;
+	}
+	result->size = mp->size;
+ out:
+	xdl_free(mp->span);
+	xdl_free(mp->piece);
+	xdl_free(mp->lit);
+	return status;
+}
+
+int xdl_merge_rope(mmrope_t *orig, mmrope_t *mr1, mmrope_t *mr2,
+		   xmparam_t const *xmp, mmbuffer_t *result)
+{
+	struct merge_pieces mp;
+	xdmergecb_t cb;
+	int status = -1;
+
+	if (!init_pieces(&mp, &cb, orig, mr1, mr2))
+		status = xdl_merge_rope_stream(orig, mr1, mr2, xmp, &cb);
+	return finish_pieces(&mp, status, result);
+}
+
+int xdl_merge(mmfile_t *orig, mmfile_t *mf1, mmfile_t *mf2,
+		xmparam_t const *xmp, mmbuffer_t *result)
+{
+	mmbuffer_t c0, c1, c2;
+	mmrope_t mr0, mr1, mr2;
+
+	xdl_file_rope(orig, &c0, &mr0);
+	xdl_file_rope(mf1, &c1, &mr1);
+	xdl_file_rope(mf2, &c2, &mr2);
+
+	return xdl_merge_rope(&mr0, &mr1, &mr2, xmp, result);
+}
+
+/*
+ * xdl_merge_batch() prepares every distinct input once. Each file of the
+ * batch maps to the first file with the same contents.
+ */
+struct batch_file {
+	mmfile_t *mf;
+	unsigned long ha;
+	xdfile_t *xdf;
+	long next;
+};
+
+struct merge_batch {
+	xmparam_t const *xmp;
+	xdmergejob_t *job;
+	struct batch_file *file;
+	long *file_of;	/* index in file of each job's orig, mf1, mf2 */
+};
+
+static unsigned long hash_mmfile(mmfile_t *mf)
+{
+	unsigned long ha = 5381;
+	long i;
+
+	for (i = 0; i < mf->size; i++) {
+		ha += (ha << 5);
+		ha ^= (unsigned long) (unsigned char) mf->ptr[i];
+	}
+	return ha;
+}
+
+static int same_mmfile(mmfile_t *a, mmfile_t *b)
+{
+	return a->size == b->size &&
+		(a->ptr == b->ptr || !memcmp(a->ptr, b->ptr, a->size));
+}
+
+/*
+ * Map the inputs of all jobs to distinct files and prepare each of them
+ * with a shared classifier.
+ */
+static int batch_prepare(struct merge_batch *mb, long nr, xdfileset_t **fs)
+{
+	struct batch_file *file = mb->file;
+	mmfile_t **mf = NULL;
+	long *head = NULL, i, k, nfile = 0;
+	unsigned int hbits;
+	int ret = -1;
+
+	hbits = xdl_hashbits((unsigned int) (3 * nr));
+	if (!XDL_ALLOC_ARRAY(head, 1 << hbits) ||
+	    !XDL_ALLOC_ARRAY(mf, 3 * nr + 1))
+		goto out;
+	for (i = 0; i < (1 << hbits); i++)
+		head[i] = -1;
+
+	for (i = 0; i < 3 * nr; i++) {
+		mmfile_t *cur = i % 3 == 0 ? &mb->job[i / 3].orig :
+			i % 3 == 1 ? &mb->job[i / 3].mf1 : &mb->job[i / 3].mf2;
+		unsigned long ha = hash_mmfile(cur);
+		long hi = (long) XDL_HASHLONG(ha, hbits);
+
+		for (k = head[hi]; k >= 0; k = file[k].next)
+			if (file[k].ha == ha && same_mmfile(file[k].mf, cur))
+				break;
+		if (k < 0) {
+			k = nfile++;
+			file[k].mf = mf[k] = cur;
+			file[k].ha = ha;
+			file[k].xdf = NULL;
+			file[k].next = head[hi];
+			head[hi] = k;
+		}
+		mb->file_of[i] = k;
+	}
+
+	if (!(*fs = xdl_fileset_new(&mb->xmp->xpp, mf, nfile)))
+		goto out;
+	for (k = 0; k < nfile; k++)
+		if (!(file[k].xdf = xdl_fileset_add(*fs, file[k].mf)))
+			goto out;
+	ret = 0;
+ out:
+	xdl_free(mf);
+	xdl_free(head);
+	return ret;
+}
+
+static int batch_merge(void *priv, long k)
+{
+	struct merge_batch *mb = priv;
+	struct batch_file *orig = mb->file + mb->file_of[3 * k];
+	struct batch_file *mf1 = mb->file + mb->file_of[3 * k + 1];
+	struct batch_file *mf2 = mb->file + mb->file_of[3 * k + 2];
+	struct merge_pieces mp;
+	xdmergecb_t cb;
+	xdfenv_t xe1, xe2;
+	mmbuffer_t c0, c1, c2;
+	mmrope_t mr0, mr1, mr2;
+	int status = -1;
+
+	xdl_file_rope(orig->mf, &c0, &mr0);
+	xdl_file_rope(mf1->mf, &c1, &mr1);
+	xdl_file_rope(mf2->mf, &c2, &mr2);
+	if (!init_pieces(&mp, &cb, &mr0, &mr1, &mr2) &&
+	    !xdl_prepare_merge_env_from(orig->xdf, mf1->xdf, mf2->xdf,
+					&mb->xmp->xpp, &xe1, &xe2))
+		status = xdl_merge_envs(&xe1, &xe2, &mr1, &mr2,
+					mb->xmp, &cb);
+	mb->job[k].status = finish_pieces(&mp, status, &mb->job[k].result);
+	return 0;
+}
+
+int xdl_merge_batch(xdmergejob_t *job, long nr, xmparam_t const *xmp)
+{
+	struct merge_batch mb;
+	xmparam_t job_xmp;
+	xdfileset_t *fs = NULL;
+	xdpool_t pool;
+	long k, lines;
+	int ret = -1;
+
+	for (k = 0; k < nr; k++) {
+		job[k].result.ptr = NULL;
+		job[k].result.size = 0;
+		job[k].status = -1;
+	}
+
+	/* the pool of the batch is the only one; each merge runs serially */
+	job_xmp = *xmp;
+	job_xmp.xpp.flags &= ~XDF_PARALLEL;
+	mb.xmp = &job_xmp;
+	mb.job = job;
+	mb.file = NULL;
+	mb.file_of = NULL;
+	if (!XDL_ALLOC_ARRAY(mb.file, 3 * nr + 1) ||
+	    !XDL_ALLOC_ARRAY(mb.file_of, 3 * nr + 1) ||
+	    batch_prepare(&mb, nr, &fs) < 0)
+		goto out;
+
+	if (xdl_pool_init(&pool, &xmp->xpp) < 0)
+		goto out;
+	for (k = 0, lines = 0; k < nr; k++)
+		lines += mb.file[mb.file_of[3 * k]].xdf->nrec +
+			mb.file[mb.file_of[3 * k + 1]].xdf->nrec +
+			mb.file[mb.file_of[3 * k + 2]].xdf->nrec;
+	xdl_pool_run(&pool, nr, lines, batch_merge, &mb);
+	xdl_pool_free(&pool);
+	ret = 0;
+ out:
+	xdl_fileset_free(fs);
+	xdl_free(mb.file_of);
+	xdl_free(mb.file);
+	return ret;
+}
@@ -0,0 +1,169 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+#include "xinclude.h"
+
+/* shortest run of lines reported as a move */
+#define XDL_MOVE_MIN_LINES 3
+/* index entries tried for each deleted block */
+#define XDL_MOVE_MAX_CAND 16
+#define XDL_MOVE_BASE UINT64_C(0x100000001b3)
+
+
+/*
+ * Moves are found after the script is built, from the class ids the
+ * records still carry: every window of XDL_MOVE_MIN_LINES inserted lines
+ * goes in a hash table under a rolling hash of its ids, then the deleted
+ * runs are rolled over the same way and each window is looked up there,
+ * grown to the longest matching insertion and marked on both sides.
+ */
+typedef struct s_xdmoveidx {
+	unsigned int hbits;
+	long *head;	/* first window of each bucket, or -1 */
+	long *next;	/* next window of the bucket, by its first line */
+} xdmoveidx_t;
+
+static uint64_t move_roll(uint64_t h, xrecord_t **recs, long i, long *run,
+			  uint64_t bk)
+{
+	h = h * XDL_MOVE_BASE + recs[i]->ha;
+	if (*run == XDL_MOVE_MIN_LINES)
+		h -= bk * recs[i - XDL_MOVE_MIN_LINES]->ha;
+	else
+		(*run)++;
+	return h;
+}
+
+static int move_index(xdmoveidx_t *idx, xdfenv_t *xe, xdchange_t *xscr,
+		      long nwin, uint64_t bk)
+{
+	xdchange_t *xch;
+	xrecord_t **recs = xe->xdf2.recs;
+	long i, s, hi, run;
+	uint64_t h;
+
+	idx->hbits = xdl_hashbits((unsigned int) nwin);
+	if (!XDL_ALLOC_ARRAY(idx->head, 1L << idx->hbits))
+		return -1;
+	if (!XDL_ALLOC_ARRAY(idx->next, xe->xdf2.nrec)) {
+		xdl_free(idx->head);
+		return -1;
+	}
+	for (i = 0; i < 1L << idx->hbits; i++)
+		idx->head[i] = -1;
+
+	for (xch = xscr; xch; xch = xch->next)
+		for (i = xch->i2, h = 0, run = 0; i < xch->i2 + xch->chg2; i++) {
+			h = move_roll(h, recs, i, &run, bk);
+			if (run < XDL_MOVE_MIN_LINES)
+				continue;
+			s = i - XDL_MOVE_MIN_LINES + 1;
+			hi = (long) XDL_HASHLONG(h, idx->hbits);
+			idx->next[s] = idx->head[hi];
+			idx->head[hi] = s;
+		}
+
+	return 0;
+}
+
+/*
+ * Number of lines, from s1 and s2, deleted and inserted alike, stopping
+ * at e1 or at the first insertion already taken by another move.
+ */
+static long move_match(xdfenv_t *xe, long s1, long e1, long s2)
+{
+	long n;
+
+	for (n = 0; s1 + n < e1 && XDL_CHANGED(&xe->xdf2, s2 + n) &&
+		     !XDL_MOVED(&xe->xdf2, s2 + n) &&
+		     xe->xdf1.recs[s1 + n]->ha == xe->xdf2.recs[s2 + n]->ha; n++);
+	return n;
+}
+
+/*
+ * Packed change maps have no room for the moved flag, give it a map of its
+ * own.
+ */
+static int move_map(xdfile_t *xdf)
+{
+	if (xdf->rbits && !xdf->rmoved &&
+	    !XDL_CALLOC_ARRAY(xdf->rmoved, XDL_RBIT_WORDS(xdf->nrec)))
+		return -1;
+	return 0;
+}
+
+int xdl_mark_moves(xdfenv_t *xe, xdchange_t *xscr)
+{
+	xdchange_t *xch;
+	xdmoveidx_t idx;
+	xrecord_t **recs = xe->xdf1.recs;
+	long i, j, k, s, e, n, best, nbest, run, nwin = 0, ndel = 0;
+	uint64_t h, bk = 1;
+
+	for (xch = xscr; xch; xch = xch->next) {
+		if (xch->chg1 >= XDL_MOVE_MIN_LINES)
+			ndel++;
+		if (xch->chg2 >= XDL_MOVE_MIN_LINES)
+			nwin += xch->chg2 - XDL_MOVE_MIN_LINES + 1;
+	}
+	if (!ndel || !nwin)
+		return 0;
+	for (i = 0; i < XDL_MOVE_MIN_LINES; i++)
+		bk *= XDL_MOVE_BASE;
+	if (move_map(&xe->xdf1) < 0 || move_map(&xe->xdf2) < 0 ||
+	    move_index(&idx, xe, xscr, nwin, bk) < 0)
+		return -1;
+
+	for (xch = xscr; xch; xch = xch->next) {
+		e = xch->i1 + xch->chg1;
+		for (i = xch->i1, h = 0, run = 0; i < e; i++) {
+			h = move_roll(h, recs, i, &run, bk);
+			if (run < XDL_MOVE_MIN_LINES)
+				continue;
+			s = i - XDL_MOVE_MIN_LINES + 1;
+			best = -1;
+			nbest = XDL_MOVE_MIN_LINES - 1;
+			j = idx.head[XDL_HASHLONG(h, idx.hbits)];
+			for (k = 0; j >= 0 && k < XDL_MOVE_MAX_CAND; j = idx.next[j], k++)
+				if ((n = move_match(xe, s, e, j)) > nbest) {
+					best = j;
+					nbest = n;
+				}
+			if (best < 0)
+				continue;
+
+			for (n = 0; n < nbest; n++) {
+				XDL_SET_MOVED(&xe->xdf1, s + n);
+				XDL_SET_MOVED(&xe->xdf2, best + n);
+			}
+			i = s + nbest - 1;
+			h = 0;
+			run = 0;
+		}
+	}
+
+	xdl_free(idx.next);
+	xdl_free(idx.head);
+
+	return 0;
+}
@@ -41,93 +41,230 @@
 #define NON_UNIQUE ULONG_MAX
 
 /*
- * This is a hash mapping from line hash to line numbers in the first and
- * second file.
+ * This is a mapping from line class to line numbers in the first and
+ * second file. After xdl_prepare_env() (or more precisely, due to
+ * xdl_classify_record()), the "ha" member of the records (AKA lines)
+ * is _not_ the hash anymore, but a dense class id below env->nclass,
+ * so the map is a set of plain arrays indexed by class.
+ *
+ * The arrays are allocated once per diff (and per thread, with
+ * XDF_PARALLEL); each recursion only clears the classes it has used.
  */
+struct patience_table {
+	/*
+	 * 0 = unused class, 1 = first line, 2 = second, etc.
+	 * line2 is NON_UNIQUE if the line is not unique
+	 * in either the first or the second file.
+	 */
+	unsigned long *line1, *line2;
+	/*
+	 * "next" & "previous" are used for the longest common
+	 * sequence, -1 ends the list;
+	 * initially, "next" reflects only the order in file1.
+	 */
+	long *next, *previous;
+	/* scratch space of find_longest_common_sequence() */
+	long *sequence;
+};
+
+/* What all recursions of one diff share. */
+struct patience_ctx {
+	xdfenv_t *env;
+	xpparam_t const *xpp;
+	xdpool_t *pool;
+	/*
+	 * 2 if a line can serve as an anchor, 1 if not. See
+	 * Documentation/diff-options.txt for more information.
+	 * Indexed by class, or by line in file1 when whitespace is
+	 * ignored, as the lines of a class may then differ.
+	 */
+	char *anchor;
+	int anchor_by_line;
+};
+
 struct hashmap {
-	int nr, alloc;
-	struct entry {
-		unsigned long hash;
-		/*
-		 * 0 = unused entry, 1 = first line, 2 = second, etc.
-		 * line2 is NON_UNIQUE if the line is not unique
-		 * in either the first or the second file.
-		 */
-		unsigned long line1, line2;
-		/*
-		 * "next" & "previous" are used for the longest common
-		 * sequence;
-		 * initially, "next" reflects only the order in file1.
-		 */
-		struct entry *next, *previous;
-
-		/*
-		 * If 1, this entry can serve as an anchor. See
-		 * Documentation/diff-options.txt for more information.
-		 */
-		unsigned anchor : 1;
-	} *entries, *first, *last;
+	long nr;
+	long first, last;
 	/* were common records found? */
 	unsigned long has_matches;
-	xdfenv_t *env;
-	xpparam_t const *xpp;
+	struct patience_table *tab;
+	struct patience_ctx *ctx;
 };
 
-static int is_anchor(xpparam_t const *xpp, const char *line)
+/* A pair of matching lines of the longest common sequence */
+struct common {
+	unsigned long line1, line2;
+};
+
+/* A gap handed off to another thread, see walk_common_sequence(). */
+struct patience_task {
+	struct patience_task *next;
+	xdtask_t task;
+	struct patience_ctx *ctx;
+	struct patience_table tab;
+	long line1, count1, line2, count2;
+};
+
+/*
+ * The anchors are compiled into a prefix trie once per diff, and every
+ * line class (or line) is looked up only once.
+ */
+struct anchor_trie {
+	struct anchor_node {
+		long child, sibling;
+		unsigned char c;
+		unsigned terminal : 1;
+	} *nodes;
+	long nr, alloc;
+};
+
+static long trie_child(struct anchor_trie *trie, long node, unsigned char c)
 {
-	int i;
-	for (i = 0; i < xpp->anchors_nr; i++) {
-		if (!strncmp(line, xpp->anchors[i], strlen(xpp->anchors[i])))
-			return 1;
+	long i;
+
+	for (i = trie->nodes[node].child; i >= 0; i = trie->nodes[i].sibling)
+		if (trie->nodes[i].c == c)
+			return i;
+	return -1;
+}
+
+static int trie_add(struct anchor_trie *trie, const char *anchor)
+{
+	long node = 0, child;
+
+	for (; *anchor; anchor++) {
+		if ((child = trie_child(trie, node, *anchor)) < 0) {
+			if (XDL_ALLOC_GROW(trie->nodes, trie->nr + 1, trie->alloc))
+				return -1;
+			child = trie->nr++;
+			trie->nodes[child].child = -1;
+			trie->nodes[child].sibling = trie->nodes[node].child;
+			trie->nodes[child].c = *anchor;
+			trie->nodes[child].terminal = 0;
+			trie->nodes[node].child = child;
+		}
+		node = child;
 	}
+	trie->nodes[node].terminal = 1;
 	return 0;
 }
 
+static int trie_match(struct anchor_trie *trie, const char *line, long size)
+{
+	long node = 0, i;
+
+	for (i = 0; !trie->nodes[node].terminal; i++)
+		if (i == size || (node = trie_child(trie, node, line[i])) < 0)
+			return 0;
+	return 1;
+}
+
+static int prepare_anchors(struct patience_ctx *ctx)
+{
+	xpparam_t const *xpp = ctx->xpp;
+	xdfile_t *xdf1 = &ctx->env->xdf1;
+	struct anchor_trie trie;
+	long i, key;
+	size_t j;
+
+	ctx->anchor = NULL;
+	if (!xpp->anchors_nr)
+		return 0;
+
+	trie.nr = 1;
+	trie.alloc = 0;
+	trie.nodes = NULL;
+	if (XDL_ALLOC_GROW(trie.nodes, 1, trie.alloc))
+		return -1;
+	trie.nodes[0].child = trie.nodes[0].sibling = -1;
+	trie.nodes[0].terminal = 0;
+	for (j = 0; j < xpp->anchors_nr; j++)
+		if (trie_add(&trie, xpp->anchors[j]) < 0)
+			return -1;
+
+	ctx->anchor_by_line = (xpp->flags & XDF_WHITESPACE_FLAGS) != 0;
+	if (!XDL_CALLOC_ARRAY(ctx->anchor,
+			      (ctx->anchor_by_line ? xdf1->nrec : ctx->env->nclass) + 1)) {
+		xdl_free(trie.nodes);
+		return -1;
+	}
+	for (i = 0; i < xdf1->nrec; i++) {
+		key = ctx->anchor_by_line ? i : (long) xdf1->recs[i]->ha;
+		if (!ctx->anchor[key])
+			ctx->anchor[key] = 1 + trie_match(&trie, xdf1->recs[i]->ptr,
+							  xdf1->recs[i]->size);
+	}
+
+	xdl_free(trie.nodes);
+	return 0;
+}
+
+static int is_anchor(struct hashmap *map, long c)
+{
+	struct patience_ctx *ctx = map->ctx;
+
+	if (!ctx->anchor)
+		return 0;
+	if (ctx->anchor_by_line)
+		return ctx->anchor[map->tab->line1[c] - 1] == 2;
+	return ctx->anchor[c] == 2;
+}
+
+static int alloc_table(struct patience_table *tab, xdfenv_t *env)
+{
+	long nclass = env->nclass + 1;
+
+	memset(tab, 0, sizeof(*tab));
+	if (!XDL_CALLOC_ARRAY(tab->line1, nclass) ||
+	    !XDL_CALLOC_ARRAY(tab->line2, nclass) ||
+	    !XDL_ALLOC_ARRAY(tab->next, nclass) ||
+	    !XDL_ALLOC_ARRAY(tab->previous, nclass) ||
+	    !XDL_ALLOC_ARRAY(tab->sequence, env->xdf1.nrec + 1)) {
+		xdl_free(tab->previous);
+		xdl_free(tab->next);
+		xdl_free(tab->line2);
+		xdl_free(tab->line1);
+		return -1;
+	}
+	return 0;
+}
+
+static void free_table(struct patience_table *tab)
+{
+	xdl_free(tab->line1);
+	xdl_free(tab->line2);
+	xdl_free(tab->next);
+	xdl_free(tab->previous);
+	xdl_free(tab->sequence);
+}
+
 /* The argument "pass" is 1 for the first file, 2 for the second. */
-static void insert_record(xpparam_t const *xpp, int line, struct hashmap *map,
-			  int pass)
+static void insert_record(long line, struct hashmap *map, int pass)
 {
 	xrecord_t **records = pass == 1 ?
-		map->env->xdf1.recs : map->env->xdf2.recs;
-	xrecord_t *record = records[line - 1];
-	/*
-	 * After xdl_prepare_env() (or more precisely, due to
-	 * xdl_classify_record()), the "ha" member of the records (AKA lines)
-	 * is _not_ the hash anymore, but a linearized version of it.  In
-	 * other words, the "ha" member is guaranteed to start with 0 and
-	 * the second record's ha can only be 0 or 1, etc.
-	 *
-	 * So we multiply ha by 2 in the hope that the hashing was
-	 * "unique enough".
-	 */
-	int index = (int)((record->ha << 1) % map->alloc);
+		map->ctx->env->xdf1.recs : map->ctx->env->xdf2.recs;
+	struct patience_table *tab = map->tab;
+	long c = (long) records[line - 1]->ha;
 
-	while (map->entries[index].line1) {
-		if (map->entries[index].hash != record->ha) {
-			if (++index >= map->alloc)
-				index = 0;
-			continue;
-		}
+	if (tab->line1[c]) {
 		if (pass == 2)
 			map->has_matches = 1;
-		if (pass == 1 || map->entries[index].line2)
-			map->entries[index].line2 = NON_UNIQUE;
+		if (pass == 1 || tab->line2[c])
+			tab->line2[c] = NON_UNIQUE;
 		else
-			map->entries[index].line2 = line;
+			tab->line2[c] = line;
 		return;
 	}
 	if (pass == 2)
 		return;
-	map->entries[index].line1 = line;
-	map->entries[index].hash = record->ha;
-	map->entries[index].anchor = is_anchor(xpp, map->env->xdf1.recs[line - 1]->ptr);
-	if (!map->first)
-		map->first = map->entries + index;
-	if (map->last) {
-		map->last->next = map->entries + index;
-		map->entries[index].previous = map->last;
-	}
-	map->last = map->entries + index;
+	tab->line1[c] = line;
+	tab->next[c] = -1;
+	tab->previous[c] = map->last;
+	if (map->first < 0)
+		map->first = c;
+	if (map->last >= 0)
+		tab->next[map->last] = c;
+	map->last = c;
 	map->nr++;
 }
 
@@ -138,42 +275,49 @@ static void insert_record(xpparam_t const *xpp, int line, struct hashmap *map,
  *
  * It is assumed that env has been prepared using xdl_prepare().
  */
-static int fill_hashmap(xpparam_t const *xpp, xdfenv_t *env,
-		struct hashmap *result,
-		int line1, int count1, int line2, int count2)
+static void fill_hashmap(struct hashmap *result,
+		long line1, long count1, long line2, long count2)
 {
-	result->xpp = xpp;
-	result->env = env;
-
-	/* We know exactly how large we want the hash map */
-	result->alloc = count1 * 2;
-	if (!XDL_CALLOC_ARRAY(result->entries, result->alloc))
-		return -1;
+	result->first = result->last = -1;
 
 	/* First, fill with entries from the first file */
 	while (count1--)
-		insert_record(xpp, line1++, result, 1);
+		insert_record(line1++, result, 1);
 
 	/* Then search for matches in the second file */
 	while (count2--)
-		insert_record(xpp, line2++, result, 2);
+		insert_record(line2++, result, 2);
+}
 
-	return 0;
+/*
+ * Forget about the classes of the given range of the first file, which
+ * are the only ones fill_hashmap() has set.
+ */
+static void clear_hashmap(struct hashmap *map, long line1, long count1)
+{
+	xrecord_t **recs = map->ctx->env->xdf1.recs + line1 - 1;
+	struct patience_table *tab = map->tab;
+	long c;
+
+	while (count1--) {
+		c = (long) (*recs++)->ha;
+		tab->line1[c] = tab->line2[c] = 0;
+	}
 }
 
 /*
  * Find the longest sequence with a smaller last element (meaning a smaller
  * line2, as we construct the sequence with entries ordered by line1).
  */
-static int binary_search(struct entry **sequence, int longest,
-		struct entry *entry)
+static long binary_search(struct patience_table *tab, long *sequence,
+		long longest, long c)
 {
-	int left = -1, right = longest;
+	long left = -1, right = longest;
 
 	while (left + 1 < right) {
-		int middle = left + (right - left) / 2;
+		long middle = left + (right - left) / 2;
 		/* by construction, no two entries can be equal */
-		if (sequence[middle]->line2 > entry->line2)
+		if (tab->line2[sequence[middle]] > tab->line2[c])
 			right = middle;
 		else
 			left = middle;
@@ -190,33 +334,35 @@ static int binary_search(struct entry **sequence, int longest,
  * For efficiency, the sequences are kept in a list containing exactly one
  * item per sequence length: the sequence with the smallest last
  * element (in terms of line2).
+ *
+ * The result is copied out of the map, so that the recursions into the
+ * gaps can reuse it.
  */
-static int find_longest_common_sequence(struct hashmap *map, struct entry **res)
+static int find_longest_common_sequence(struct hashmap *map,
+		struct common **res, long *nr)
 {
-	struct entry **sequence;
-	int longest = 0, i;
-	struct entry *entry;
+	struct patience_table *tab = map->tab;
+	long *sequence = tab->sequence;
+	long longest = 0, i, c;
+	struct common *seq;
 
 	/*
 	 * If not -1, this entry in sequence must never be overridden.
 	 * Therefore, overriding entries before this has no effect, so
 	 * do not do that either.
 	 */
-	int anchor_i = -1;
-
-	if (!XDL_ALLOC_ARRAY(sequence, map->nr))
-		return -1;
+	long anchor_i = -1;
 
-	for (entry = map->first; entry; entry = entry->next) {
-		if (!entry->line2 || entry->line2 == NON_UNIQUE)
+	for (c = map->first; c >= 0; c = tab->next[c]) {
+		if (!tab->line2[c] || tab->line2[c] == NON_UNIQUE)
 			continue;
-		i = binary_search(sequence, longest, entry);
-		entry->previous = i < 0 ? NULL : sequence[i];
+		i = binary_search(tab, sequence, longest, c);
+		tab->previous[c] = i < 0 ? -1 : sequence[i];
 		++i;
 		if (i <= anchor_i)
 			continue;
-		sequence[i] = entry;
-		if (entry->anchor) {
+		sequence[i] = c;
+		if (is_anchor(map, c)) {
 			anchor_i = i;
 			longest = anchor_i + 1;
 		} else if (i == longest) {
@@ -224,48 +370,115 @@ static int find_longest_common_sequence(struct hashmap *map, struct entry **res)
 		}
 	}
 
+	*res = NULL;
+	*nr = longest;
+
 	/* No common unique lines were found */
-	if (!longest) {
-		*res = NULL;
-		xdl_free(sequence);
+	if (!longest)
 		return 0;
-	}
 
-	/* Iterate starting at the last element, adjusting the "next" members */
-	entry = sequence[longest - 1];
-	entry->next = NULL;
-	while (entry->previous) {
-		entry->previous->next = entry;
-		entry = entry->previous;
+	if (!XDL_ALLOC_ARRAY(seq, longest))
+		return -1;
+
+	/* Iterate starting at the last element, following the "previous" links */
+	for (i = longest, c = sequence[longest - 1]; i--; c = tab->previous[c]) {
+		seq[i].line1 = tab->line1[c];
+		seq[i].line2 = tab->line2[c];
 	}
-	*res = entry;
-	xdl_free(sequence);
+	*res = seq;
 	return 0;
 }
 
-static int match(struct hashmap *map, int line1, int line2)
+static int match(struct patience_ctx *ctx, long line1, long line2)
 {
-	xrecord_t *record1 = map->env->xdf1.recs[line1 - 1];
-	xrecord_t *record2 = map->env->xdf2.recs[line2 - 1];
+	xrecord_t *record1 = ctx->env->xdf1.recs[line1 - 1];
+	xrecord_t *record2 = ctx->env->xdf2.recs[line2 - 1];
 	return record1->ha == record2->ha;
 }
 
-static int patience_diff(xpparam_t const *xpp, xdfenv_t *env,
-		int line1, int count1, int line2, int count2);
+static int patience_diff(struct patience_ctx *ctx, struct patience_table *tab,
+		long line1, long count1, long line2, long count2);
 
-static int walk_common_sequence(struct hashmap *map, struct entry *first,
-		int line1, int count1, int line2, int count2)
+static int patience_task(void *priv)
 {
-	int end1 = line1 + count1, end2 = line2 + count2;
-	int next1, next2;
+	struct patience_task *pt = priv;
+
+	return patience_diff(pt->ctx, &pt->tab,
+			     pt->line1, pt->count1, pt->line2, pt->count2);
+}
+
+/*
+ * Diff a gap on another thread, if one is available, with a table of its
+ * own. Returns -1 if the caller should diff the gap itself.
+ */
+static int start_patience_task(struct patience_ctx *ctx,
+		struct patience_task **tasks,
+		long line1, long count1, long line2, long count2)
+{
+	struct patience_task *pt;
+
+	if (xdl_pool_claim(ctx->pool, count1 + count2) < 0)
+		return -1;
+	if (!(pt = xdl_malloc(sizeof(*pt))))
+		goto fail;
+	if (alloc_table(&pt->tab, ctx->env) < 0) {
+		xdl_free(pt);
+		goto fail;
+	}
+	pt->ctx = ctx;
+	pt->line1 = line1;
+	pt->count1 = count1;
+	pt->line2 = line2;
+	pt->count2 = count2;
+	pt->task.fn = patience_task;
+	pt->task.priv = pt;
+	pt->next = *tasks;
+	*tasks = pt;
+	xdl_task_start(ctx->pool, &pt->task);
+	return 0;
+
+fail:
+	xdl_pool_unclaim(ctx->pool);
+	return -1;
+}
+
+static int finish_patience_tasks(struct patience_ctx *ctx,
+		struct patience_task *tasks)
+{
+	struct patience_task *pt;
+	int result = 0;
+
+	while ((pt = tasks) != NULL) {
+		if (xdl_task_wait(ctx->pool, &pt->task))
+			result = -1;
+		tasks = pt->next;
+		free_table(&pt->tab);
+		xdl_free(pt);
+	}
+	return result;
+}
+
+/*
+ * The gaps between the common lines are independent of each other; with
+ * XDF_PARALLEL, large ones are diffed on other threads.
+ */
+static int walk_common_sequence(struct patience_ctx *ctx,
+		struct patience_table *tab, struct common *seq, long nr,
+		long line1, long count1, long line2, long count2)
+{
+	long end1 = line1 + count1, end2 = line2 + count2;
+	long next1, next2;
+	struct patience_task *tasks = NULL;
+	int result = 0;
+	long k = 0;
 
 	for (;;) {
 		/* Try to grow the line ranges of common lines */
-		if (first) {
-			next1 = first->line1;
-			next2 = first->line2;
+		if (k < nr) {
+			next1 = seq[k].line1;
+			next2 = seq[k].line2;
 			while (next1 > line1 && next2 > line2 &&
-					match(map, next1 - 1, next2 - 1)) {
+					match(ctx, next1 - 1, next2 - 1)) {
 				next1--;
 				next2--;
 			}
@@ -274,43 +487,52 @@ static int walk_common_sequence(struct hashmap *map, struct entry *first,
 			next2 = end2;
 		}
 		while (line1 < next1 && line2 < next2 &&
-				match(map, line1, line2)) {
+				match(ctx, line1, line2)) {
 			line1++;
 			line2++;
 		}
 
 		/* Recurse */
 		if (next1 > line1 || next2 > line2) {
-			if (patience_diff(map->xpp, map->env,
+			if (start_patience_task(ctx, &tasks,
 					line1, next1 - line1,
-					line2, next2 - line2))
-				return -1;
+					line2, next2 - line2) &&
+			    patience_diff(ctx, tab,
+					line1, next1 - line1,
+					line2, next2 - line2)) {
+				result = -1;
+				break;
+			}
 		}
 
-		if (!first)
-			return 0;
+		if (k >= nr)
+			break;
 
-		while (first->next &&
-				first->next->line1 == first->line1 + 1 &&
-				first->next->line2 == first->line2 + 1)
-			first = first->next;
+		while (k + 1 < nr &&
+				seq[k + 1].line1 == seq[k].line1 + 1 &&
+				seq[k + 1].line2 == seq[k].line2 + 1)
+			k++;
 
-		line1 = first->line1 + 1;
-		line2 = first->line2 + 1;
+		line1 = seq[k].line1 + 1;
+		line2 = seq[k].line2 + 1;
 
-		first = first->next;
+		k++;
 	}
+
+	if (finish_patience_tasks(ctx, tasks))
+		result = -1;
+	return result;
 }
 
-static int fall_back_to_classic_diff(struct hashmap *map,
-		int line1, int count1, int line2, int count2)
+static int fall_back_to_classic_diff(struct patience_ctx *ctx,
+		long line1, long count1, long line2, long count2)
 {
 	xpparam_t xpp;
 
 	memset(&xpp, 0, sizeof(xpp));
-	xpp.flags = map->xpp->flags & ~XDF_DIFF_ALGORITHM_MASK;
+	xpp.flags = ctx->xpp->flags & ~XDF_DIFF_ALGORITHM_MASK;
 
-	return xdl_fall_back_diff(map->env, &xpp,
+	return xdl_fall_back_diff(ctx->env, &xpp,
 				  line1, count1, line2, count2);
 }
 
@@ -320,54 +542,76 @@ static int fall_back_to_classic_diff(struct hashmap *map,
  *
  * This function assumes that env was prepared with xdl_prepare_env().
  */
-static int patience_diff(xpparam_t const *xpp, xdfenv_t *env,
-		int line1, int count1, int line2, int count2)
+static int patience_diff(struct patience_ctx *ctx, struct patience_table *tab,
+		long line1, long count1, long line2, long count2)
 {
+	xdfenv_t *env = ctx->env;
 	struct hashmap map;
-	struct entry *first;
+	struct common *seq;
+	long nr;
 	int result = 0;
 
 	/* trivial case: one side is empty */
 	if (!count1) {
-		while(count2--)
-			env->xdf2.rchg[line2++ - 1] = 1;
+		xdl_rchg_fill(&env->xdf2, line2 - 1, count2);
 		return 0;
 	} else if (!count2) {
-		while(count1--)
-			env->xdf1.rchg[line1++ - 1] = 1;
+		xdl_rchg_fill(&env->xdf1, line1 - 1, count1);
 		return 0;
 	}
 
 	memset(&map, 0, sizeof(map));
-	if (fill_hashmap(xpp, env, &map,
-			line1, count1, line2, count2))
-		return -1;
+	map.tab = tab;
+	map.ctx = ctx;
+	fill_hashmap(&map, line1, count1, line2, count2);
 
 	/* are there any matching lines at all? */
 	if (!map.has_matches) {
-		while(count1--)
-			env->xdf1.rchg[line1++ - 1] = 1;
-		while(count2--)
-			env->xdf2.rchg[line2++ - 1] = 1;
-		xdl_free(map.entries);
+		clear_hashmap(&map, line1, count1);
+		xdl_rchg_fill(&env->xdf1, line1 - 1, count1);
+		xdl_rchg_fill(&env->xdf2, line2 - 1, count2);
 		return 0;
 	}
 
-	result = find_longest_common_sequence(&map, &first);
+	result = find_longest_common_sequence(&map, &seq, &nr);
+	clear_hashmap(&map, line1, count1);
 	if (result)
-		goto out;
-	if (first)
-		result = walk_common_sequence(&map, first,
+		return result;
+	if (seq)
+		result = walk_common_sequence(ctx, tab, seq, nr,
 			line1, count1, line2, count2);
 	else
-		result = fall_back_to_classic_diff(&map,
+		result = fall_back_to_classic_diff(ctx,
 			line1, count1, line2, count2);
- out:
-	xdl_free(map.entries);
+	xdl_free(seq);
 	return result;
 }
 
 int xdl_do_patience_diff(xpparam_t const *xpp, xdfenv_t *env)
 {
-	return patience_diff(xpp, env, 1, env->xdf1.nrec, 1, env->xdf2.nrec);
+	struct patience_ctx ctx;
+	struct patience_table tab;
+	xdpool_t pool;
+	int result = -1;
+
+	ctx.env = env;
+	ctx.xpp = xpp;
+	ctx.pool = &pool;
+	if (prepare_anchors(&ctx) < 0)
+		return -1;
+	if (alloc_table(&tab, env) < 0)
+		goto out;
+	if (xdl_pool_init(&pool, xpp) < 0) {
+		free_table(&tab);
+		goto out;
+	}
+
+	result = patience_diff(&ctx, &tab,
+			       1, env->xdf1.nrec, 1, env->xdf2.nrec);
+
+	xdl_pool_free(&pool);
+	free_table(&tab);
+ out:
+	xdl_free(ctx.anchor);
+	return result;
 }
@@ -36,7 +36,7 @@ typedef struct s_xdlclass {
 	char const *line;
 	long size;
 	long idx;
-	long len1, len2;
+	long len[3];
 } xdlclass_t;
 
 typedef struct s_xdlclassifier {
@@ -48,6 +48,8 @@ typedef struct s_xdlclassifier {
 	long alloc;
 	long count;
 	long flags;
+	int by_ha;	/* ha alone identifies a record: an outer class id or a
+			   caller hash trusted with XDF_TRUST_HASHES */
 } xdlclassifier_t;
 
 
@@ -57,13 +59,24 @@ static int xdl_init_classifier(xdlclassifier_t *cf, long size, long flags);
 static void xdl_free_classifier(xdlclassifier_t *cf);
 static int xdl_classify_record(unsigned int pass, xdlclassifier_t *cf, xrecord_t **rhash,
 			       unsigned int hbits, xrecord_t *rec);
-static int xdl_prepare_ctx(unsigned int pass, mmfile_t *mf, long narec, xpparam_t const *xpp,
+static long xdl_spill_record(mmrope_t const *mr, long *c, char const *prev,
+			     char const **cur, char const **top, xdspill_t **spill);
+static int xdl_prepare_ctx(unsigned int pass, mmrope_t const *mr, long narec, xpparam_t const *xpp,
 			   xdlclassifier_t *cf, xdfile_t *xdf);
+static int xdl_copy_ctx(unsigned int pass, xrecord_t *const *src, long nrec,
+			xpparam_t const *xpp, xdlclassifier_t *cf, xdfile_t *xdf);
+static int xdl_lines_ctx(unsigned int pass, xdlines_t const *lines, xpparam_t const *xpp,
+			 xdlclassifier_t *cf, xdfile_t *xdf);
+static int xdl_setup_ctx(long nrec, xrecord_t **recs, unsigned int hbits,
+			 xrecord_t **rhash, xpparam_t const *xpp, xdfile_t *xdf);
+static int xdl_split_ctx(mmfile_t *mf, xpparam_t const *xpp, xdfile_t *xdf);
 static void xdl_free_ctx(xdfile_t *xdf);
 static int xdl_clean_mmatch(char const *dis, long i, long s, long e);
-static int xdl_cleanup_records(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xdf2);
+static int xdl_cleanup_records(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xdf2,
+			       unsigned int pass2);
 static int xdl_trim_ends(xdfile_t *xdf1, xdfile_t *xdf2);
-static int xdl_optimize_ctxs(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xdf2);
+static int xdl_optimize_ctxs(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xdf2,
+			     unsigned int pass2);
 
 
 
@@ -116,8 +129,9 @@ static int xdl_classify_record(unsigned int pass, xdlclassifier_t *cf, xrecord_t
 	hi = (long) XDL_HASHLONG(rec->ha, cf->hbits);
 	for (rcrec = cf->rchash[hi]; rcrec; rcrec = rcrec->next)
 		if (rcrec->ha == rec->ha &&
-				xdl_recmatch(rcrec->line, rcrec->size,
-					rec->ptr, rec->size, cf->flags))
+				(cf->by_ha ||
+				 xdl_recmatch(rcrec->line, rcrec->size,
+					rec->ptr, rec->size, cf->flags)))
 			break;
 
 	if (!rcrec) {
@@ -132,12 +146,13 @@ static int xdl_classify_record(unsigned int pass, xdlclassifier_t *cf, xrecord_t
 		rcrec->line = line;
 		rcrec->size = rec->size;
 		rcrec->ha = rec->ha;
-		rcrec->len1 = rcrec->len2 = 0;
+		rcrec->len[0] = rcrec->len[1] = rcrec->len[2] = 0;
 		rcrec->next = cf->rchash[hi];
 		cf->rchash[hi] = rcrec;
 	}
 
-	(pass == 1) ? rcrec->len1++ : rcrec->len2++;
+	if (pass)
+		rcrec->len[pass - 1]++;
 
 	rec->ha = (unsigned long) rcrec->idx;
 
@@ -149,24 +164,72 @@ static int xdl_classify_record(unsigned int pass, xdlclassifier_t *cf, xrecord_t
 }
 
 
-static int xdl_prepare_ctx(unsigned int pass, mmfile_t *mf, long narec, xpparam_t const *xpp,
+/*
+ * The record starting at prev runs into the end of chunk *c. If it goes
+ * on in later chunks, gather it into a new spill block and move *c, *cur
+ * and *top past its end. Returns the size of the gathered record, 0 if
+ * the record ends with the rope, or -1 on failure.
+ */
+static long xdl_spill_record(mmrope_t const *mr, long *c, char const *prev,
+			     char const **cur, char const **top, xdspill_t **spill) {
+	long i, size, end;
+	char const *nl = NULL;
+	char *data;
+	xdspill_t *blk;
+
+	size = (long) (*top - prev);
+	for (i = *c + 1; i < mr->nr; i++) {
+		if (mr->chunk[i].size <= 0)
+			continue;
+		if ((nl = memchr(mr->chunk[i].ptr, '\n', mr->chunk[i].size)))
+			break;
+		size += mr->chunk[i].size;
+	}
+	if (size == (long) (*top - prev) && !nl)
+		return 0;
+	end = nl ? (long) (nl - mr->chunk[i].ptr) + 1 : 0;
+	if (!(blk = xdl_malloc(sizeof(*blk) + size + end)))
+		return -1;
+	blk->next = *spill;
+	*spill = blk;
+
+	data = (char *) (blk + 1);
+	memcpy(data, prev, *top - prev);
+	data += *top - prev;
+	for ((*c)++; *c < i; (*c)++) {
+		if (mr->chunk[*c].size <= 0)
+			continue;
+		memcpy(data, mr->chunk[*c].ptr, mr->chunk[*c].size);
+		data += mr->chunk[*c].size;
+	}
+	if (nl) {
+		memcpy(data, mr->chunk[i].ptr, end);
+		*cur = mr->chunk[i].ptr + end;
+		*top = mr->chunk[i].ptr + mr->chunk[i].size;
+	} else {
+		/* the record ends with the rope */
+		*c = mr->nr - 1;
+		*cur = *top = NULL;
+	}
+
+	return size + end;
+}
+
+
+static int xdl_prepare_ctx(unsigned int pass, mmrope_t const *mr, long narec, xpparam_t const *xpp,
 			   xdlclassifier_t *cf, xdfile_t *xdf) {
 	unsigned int hbits;
-	long nrec, hsize, bsize;
+	long nrec, hsize, size, spilled, c;
 	unsigned long hav;
-	char const *blk, *cur, *top, *prev;
+	char const *cur, *top, *prev, *data;
 	xrecord_t *crec;
 	xrecord_t **recs;
 	xrecord_t **rhash;
-	unsigned long *ha;
-	char *rchg;
-	long *rindex;
+	xdspill_t *spill, *blk;
 
-	ha = NULL;
-	rindex = NULL;
-	rchg = NULL;
 	rhash = NULL;
 	recs = NULL;
+	spill = NULL;
 
 	if (xdl_cha_init(&xdf->rcha, sizeof(xrecord_t), narec / 4 + 1) < 0)
 		goto abort;
@@ -179,16 +242,31 @@ static int xdl_prepare_ctx(unsigned int pass, mmfile_t *mf, long narec, xpparam_
 		goto abort;
 
 	nrec = 0;
-	if ((cur = blk = xdl_mmfile_first(mf, &bsize))) {
-		for (top = blk + bsize; cur < top; ) {
+	for (c = 0; c < mr->nr; c++) {
+		cur = mr->chunk[c].ptr;
+		for (top = cur + mr->chunk[c].size; cur < top; ) {
 			prev = cur;
 			hav = xdl_hash_record(&cur, top, xpp->flags);
+			size = (long) (cur - prev);
+			/*
+			 * Only records running across chunks are copied, to
+			 * be hashed in one piece.
+			 */
+			if (cur == top && cur[-1] != '\n' &&
+			    (spilled = xdl_spill_record(mr, &c, prev, &cur, &top,
+							&spill))) {
+				if (spilled < 0)
+					goto abort;
+				prev = data = (char const *) (spill + 1);
+				size = spilled;
+				hav = xdl_hash_record(&data, prev + size, xpp->flags);
+			}
 			if (XDL_ALLOC_GROW(recs, nrec + 1, narec))
 				goto abort;
 			if (!(crec = xdl_cha_alloc(&xdf->rcha)))
 				goto abort;
 			crec->ptr = prev;
-			crec->size = (long) (cur - prev);
+			crec->size = size;
 			crec->ha = hav;
 			recs[nrec++] = crec;
 			if (xdl_classify_record(pass, cf, rhash, hbits, crec) < 0)
@@ -196,7 +274,195 @@ static int xdl_prepare_ctx(unsigned int pass, mmfile_t *mf, long narec, xpparam_
 		}
 	}
 
-	if (!XDL_CALLOC_ARRAY(rchg, nrec + 2))
+	if (xdl_setup_ctx(nrec, recs, hbits, rhash, xpp, xdf) < 0)
+		goto abort;
+	xdf->spill = spill;
+
+	return 0;
+
+abort:
+	while ((blk = spill)) {
+		spill = blk->next;
+		xdl_free(blk);
+	}
+	xdl_free(rhash);
+	xdl_free(recs);
+	xdl_cha_free(&xdf->rcha);
+	return -1;
+}
+
+
+/*
+ * Set up xdf with its own copy of the nrec records in src, taken from
+ * already prepared files, so they can take part in another environment
+ * without being split and hashed again. If cf is given, the records are
+ * classified again by their class ids, so xdf gets dense class ids of
+ * its own.
+ */
+static int xdl_copy_ctx(unsigned int pass, xrecord_t *const *src, long nrec,
+			xpparam_t const *xpp, xdlclassifier_t *cf, xdfile_t *xdf) {
+	long i;
+	unsigned int hbits;
+	xrecord_t *crec;
+	xrecord_t **recs;
+	xrecord_t **rhash;
+
+	rhash = NULL;
+	recs = NULL;
+	hbits = 0;
+
+	if (xdl_cha_init(&xdf->rcha, sizeof(xrecord_t), nrec / 4 + 1) < 0)
+		goto abort;
+	if (!XDL_ALLOC_ARRAY(recs, nrec + 1))
+		goto abort;
+	if (cf) {
+		hbits = xdl_hashbits((unsigned int) nrec);
+		if (!XDL_CALLOC_ARRAY(rhash, 1 << hbits))
+			goto abort;
+	}
+	for (i = 0; i < nrec; i++) {
+		if (!(crec = xdl_cha_alloc(&xdf->rcha)))
+			goto abort;
+		*crec = *src[i];
+		crec->next = NULL;
+		recs[i] = crec;
+		if (cf && xdl_classify_record(pass, cf, rhash, hbits, crec) < 0)
+			goto abort;
+	}
+
+	if (xdl_setup_ctx(nrec, recs, hbits, rhash, xpp, xdf) < 0)
+		goto abort;
+
+	return 0;
+
+abort:
+	xdl_free(rhash);
+	xdl_free(recs);
+	xdl_cha_free(&xdf->rcha);
+	return -1;
+}
+
+
+/*
+ * Set up xdf from lines the caller has already split and hashed, so they
+ * only need to be classified.
+ */
+static int xdl_lines_ctx(unsigned int pass, xdlines_t const *lines, xpparam_t const *xpp,
+			 xdlclassifier_t *cf, xdfile_t *xdf) {
+	long i, nrec = lines->nr;
+	unsigned int hbits;
+	xrecord_t *crec;
+	xrecord_t **recs;
+	xrecord_t **rhash;
+
+	rhash = NULL;
+	recs = NULL;
+
+	if (xdl_cha_init(&xdf->rcha, sizeof(xrecord_t), nrec / 4 + 1) < 0)
+		goto abort;
+	if (!XDL_ALLOC_ARRAY(recs, nrec + 1))
+		goto abort;
+	hbits = xdl_hashbits((unsigned int) nrec);
+	if (!XDL_CALLOC_ARRAY(rhash, 1 << hbits))
+		goto abort;
+	for (i = 0; i < nrec; i++) {
+		if (!(crec = xdl_cha_alloc(&xdf->rcha)))
+			goto abort;
+		crec->ptr = lines->line[i].ptr;
+		crec->size = lines->line[i].size;
+#if ULONG_MAX < UINT64_MAX
+		crec->ha = (unsigned long) (lines->line[i].hash ^ (lines->line[i].hash >> 32));
+#else
+		crec->ha = (unsigned long) lines->line[i].hash;
+#endif
+		recs[i] = crec;
+		if (xdl_classify_record(pass, cf, rhash, hbits, crec) < 0)
+			goto abort;
+	}
+
+	if (xdl_setup_ctx(nrec, recs, hbits, rhash, xpp, xdf) < 0)
+		goto abort;
+
+	return 0;
+
+abort:
+	xdl_free(rhash);
+	xdl_free(recs);
+	xdl_cha_free(&xdf->rcha);
+	return -1;
+}
+
+
+/*
+ * Set up xdf with the records of mf, neither hashed nor classified, which
+ * is all emitting an already known script needs.
+ */
+static int xdl_split_ctx(mmfile_t *mf, xpparam_t const *xpp, xdfile_t *xdf) {
+	long nrec, narec;
+	char const *cur, *top, *eol;
+	xrecord_t *crec;
+	xrecord_t **recs;
+	mmbuffer_t chunk;
+	mmrope_t mr;
+
+	recs = NULL;
+	xdl_file_rope(mf, &chunk, &mr);
+	narec = xdl_guess_lines(&mr, XDL_GUESS_NLINES2) + 1;
+
+	if (xdl_cha_init(&xdf->rcha, sizeof(xrecord_t), narec / 4 + 1) < 0)
+		goto abort;
+	if (!XDL_ALLOC_ARRAY(recs, narec))
+		goto abort;
+
+	nrec = 0;
+	for (cur = mf->ptr, top = cur + mf->size; cur < top; cur = eol) {
+		if (!(eol = memchr(cur, '\n', top - cur)))
+			eol = top;
+		else
+			eol++;
+		if (XDL_ALLOC_GROW(recs, nrec + 1, narec))
+			goto abort;
+		if (!(crec = xdl_cha_alloc(&xdf->rcha)))
+			goto abort;
+		crec->next = NULL;
+		crec->ptr = cur;
+		crec->size = (long) (eol - cur);
+		crec->ha = 0;
+		recs[nrec++] = crec;
+	}
+
+	if (xdl_setup_ctx(nrec, recs, 0, NULL, xpp, xdf) < 0)
+		goto abort;
+
+	return 0;
+
+abort:
+	xdl_free(recs);
+	xdl_cha_free(&xdf->rcha);
+	return -1;
+}
+
+
+/*
+ * Allocate the per-record arrays of xdf, which takes over the nrec
+ * records in recs and their hash table.
+ */
+static int xdl_setup_ctx(long nrec, xrecord_t **recs, unsigned int hbits,
+			 xrecord_t **rhash, xpparam_t const *xpp, xdfile_t *xdf) {
+	unsigned long *ha;
+	char *rchg;
+	uint64_t *rbits;
+	long *rindex;
+
+	ha = NULL;
+	rindex = NULL;
+	rchg = NULL;
+	rbits = NULL;
+
+	if (xpp->flags & XDF_PACKED_CHANGES) {
+		if (!XDL_CALLOC_ARRAY(rbits, XDL_RBIT_WORDS(nrec)))
+			goto abort;
+	} else if (!XDL_CALLOC_ARRAY(rchg, nrec + 2))
 		goto abort;
 
 	if ((XDF_DIFF_ALG(xpp->flags) != XDF_PATIENCE_DIFF) &&
@@ -211,12 +477,15 @@ static int xdl_prepare_ctx(unsigned int pass, mmfile_t *mf, long narec, xpparam_
 	xdf->recs = recs;
 	xdf->hbits = hbits;
 	xdf->rhash = rhash;
-	xdf->rchg = rchg + 1;
+	xdf->rchg = rchg ? rchg + 1 : NULL;
+	xdf->rbits = rbits;
+	xdf->rmoved = NULL;
 	xdf->rindex = rindex;
 	xdf->nreff = 0;
 	xdf->ha = ha;
 	xdf->dstart = 0;
 	xdf->dend = nrec - 1;
+	xdf->spill = NULL;
 
 	return 0;
 
@@ -224,18 +493,25 @@ abort:
 	xdl_free(ha);
 	xdl_free(rindex);
 	xdl_free(rchg);
-	xdl_free(rhash);
-	xdl_free(recs);
-	xdl_cha_free(&xdf->rcha);
+	xdl_free(rbits);
 	return -1;
 }
 
 
 static void xdl_free_ctx(xdfile_t *xdf) {
+	xdspill_t *blk;
+
+	while ((blk = xdf->spill)) {
+		xdf->spill = blk->next;
+		xdl_free(blk);
+	}
 
 	xdl_free(xdf->rhash);
 	xdl_free(xdf->rindex);
-	xdl_free(xdf->rchg - 1);
+	if (xdf->rchg)
+		xdl_free(xdf->rchg - 1);
+	xdl_free(xdf->rbits);
+	xdl_free(xdf->rmoved);
 	xdl_free(xdf->ha);
 	xdl_free(xdf->recs);
 	xdl_cha_free(&xdf->rcha);
@@ -244,6 +520,18 @@ static void xdl_free_ctx(xdfile_t *xdf) {
 
 int xdl_prepare_env(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 		    xdfenv_t *xe) {
+	mmbuffer_t c1, c2;
+	mmrope_t mr1, mr2;
+
+	xdl_file_rope(mf1, &c1, &mr1);
+	xdl_file_rope(mf2, &c2, &mr2);
+
+	return xdl_prepare_rope_env(&mr1, &mr2, xpp, xe);
+}
+
+
+int xdl_prepare_rope_env(mmrope_t const *mr1, mmrope_t const *mr2,
+			 xpparam_t const *xpp, xdfenv_t *xe) {
 	long enl1, enl2, sample;
 	xdlclassifier_t cf;
 
@@ -259,18 +547,18 @@ int xdl_prepare_env(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 	sample = (XDF_DIFF_ALG(xpp->flags) == XDF_HISTOGRAM_DIFF
 		  ? XDL_GUESS_NLINES2 : XDL_GUESS_NLINES1);
 
-	enl1 = xdl_guess_lines(mf1, sample) + 1;
-	enl2 = xdl_guess_lines(mf2, sample) + 1;
+	enl1 = xdl_guess_lines(mr1, sample) + 1;
+	enl2 = xdl_guess_lines(mr2, sample) + 1;
 
 	if (xdl_init_classifier(&cf, enl1 + enl2 + 1, xpp->flags) < 0)
 		return -1;
 
-	if (xdl_prepare_ctx(1, mf1, enl1, xpp, &cf, &xe->xdf1) < 0) {
+	if (xdl_prepare_ctx(1, mr1, enl1, xpp, &cf, &xe->xdf1) < 0) {
 
 		xdl_free_classifier(&cf);
 		return -1;
 	}
-	if (xdl_prepare_ctx(2, mf2, enl2, xpp, &cf, &xe->xdf2) < 0) {
+	if (xdl_prepare_ctx(2, mr2, enl2, xpp, &cf, &xe->xdf2) < 0) {
 
 		xdl_free_ctx(&xe->xdf1);
 		xdl_free_classifier(&cf);
@@ -279,7 +567,7 @@ int xdl_prepare_env(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 
 	if ((XDF_DIFF_ALG(xpp->flags) != XDF_PATIENCE_DIFF) &&
 	    (XDF_DIFF_ALG(xpp->flags) != XDF_HISTOGRAM_DIFF) &&
-	    xdl_optimize_ctxs(&cf, &xe->xdf1, &xe->xdf2) < 0) {
+	    xdl_optimize_ctxs(&cf, &xe->xdf1, &xe->xdf2, 2) < 0) {
 
 		xdl_free_ctx(&xe->xdf2);
 		xdl_free_ctx(&xe->xdf1);
@@ -287,12 +575,385 @@ int xdl_prepare_env(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 		return -1;
 	}
 
+	xe->nclass = cf.count;
 	xdl_free_classifier(&cf);
 
 	return 0;
 }
 
 
+/*
+ * Prepare an environment from lines the caller has already split and
+ * hashed. Lines with different hashes never match; lines with equal
+ * hashes are compared byte by byte, unless XDF_TRUST_HASHES is set.
+ */
+int xdl_prepare_lines_env(xdlines_t const *l1, xdlines_t const *l2,
+			  xpparam_t const *xpp, xdfenv_t *xe) {
+	xdlclassifier_t cf;
+
+	memset(&cf, 0, sizeof(cf));
+
+	if (xdl_init_classifier(&cf, l1->nr + l2->nr + 1, xpp->flags) < 0)
+		return -1;
+#if ULONG_MAX >= UINT64_MAX
+	/* folded hashes are too weak to be trusted on their own */
+	cf.by_ha = !!(xpp->flags & XDF_TRUST_HASHES);
+#endif
+
+	if (xdl_lines_ctx(1, l1, xpp, &cf, &xe->xdf1) < 0)
+		goto free_cf;
+	if (xdl_lines_ctx(2, l2, xpp, &cf, &xe->xdf2) < 0)
+		goto free_xdf1;
+
+	if ((XDF_DIFF_ALG(xpp->flags) != XDF_PATIENCE_DIFF) &&
+	    (XDF_DIFF_ALG(xpp->flags) != XDF_HISTOGRAM_DIFF) &&
+	    xdl_optimize_ctxs(&cf, &xe->xdf1, &xe->xdf2, 2) < 0) {
+
+		xdl_free_ctx(&xe->xdf2);
+		goto free_xdf1;
+	}
+
+	xe->nclass = cf.count;
+	xdl_free_classifier(&cf);
+
+	return 0;
+
+free_xdf1:
+	xdl_free_ctx(&xe->xdf1);
+free_cf:
+	xdl_free_classifier(&cf);
+	return -1;
+}
+
+
+/*
+ * Split mf1 and mf2 into records for emitting a script computed before,
+ * skipping hashing and classification.
+ */
+int xdl_prepare_split_env(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
+			  xdfenv_t *xe) {
+
+	if (xdl_split_ctx(mf1, xpp, &xe->xdf1) < 0)
+		return -1;
+	if (xdl_split_ctx(mf2, xpp, &xe->xdf2) < 0) {
+
+		xdl_free_ctx(&xe->xdf1);
+		return -1;
+	}
+	xe->nclass = 0;
+
+	return 0;
+}
+
+
+/*
+ * Prepare the two environments of a three-way merge, orig against mf1
+ * and orig against mf2, with a single classifier. Class ids are then
+ * comparable across xe1 and xe2, and orig is only split and hashed once.
+ */
+int xdl_prepare_merge_env(mmfile_t *orig, mmfile_t *mf1, mmfile_t *mf2,
+			  xpparam_t const *xpp, xdfenv_t *xe1, xdfenv_t *xe2) {
+	mmbuffer_t c0, c1, c2;
+	mmrope_t mr0, mr1, mr2;
+
+	xdl_file_rope(orig, &c0, &mr0);
+	xdl_file_rope(mf1, &c1, &mr1);
+	xdl_file_rope(mf2, &c2, &mr2);
+
+	return xdl_prepare_merge_rope_env(&mr0, &mr1, &mr2, xpp, xe1, xe2);
+}
+
+
+int xdl_prepare_merge_rope_env(mmrope_t const *orig, mmrope_t const *mr1,
+			       mmrope_t const *mr2, xpparam_t const *xpp,
+			       xdfenv_t *xe1, xdfenv_t *xe2) {
+	long enl0, enl1, enl2, sample;
+	xdlclassifier_t cf;
+
+	memset(&cf, 0, sizeof(cf));
+
+	sample = (XDF_DIFF_ALG(xpp->flags) == XDF_HISTOGRAM_DIFF
+		  ? XDL_GUESS_NLINES2 : XDL_GUESS_NLINES1);
+
+	enl0 = xdl_guess_lines(orig, sample) + 1;
+	enl1 = xdl_guess_lines(mr1, sample) + 1;
+	enl2 = xdl_guess_lines(mr2, sample) + 1;
+
+	if (xdl_init_classifier(&cf, enl0 + enl1 + enl2 + 1, xpp->flags) < 0)
+		return -1;
+
+	if (xdl_prepare_ctx(1, orig, enl0, xpp, &cf, &xe1->xdf1) < 0)
+		goto free_cf;
+	if (xdl_prepare_ctx(2, mr1, enl1, xpp, &cf, &xe1->xdf2) < 0)
+		goto free_xe1_xdf1;
+	if (xdl_copy_ctx(1, xe1->xdf1.recs, xe1->xdf1.nrec, xpp, NULL, &xe2->xdf1) < 0)
+		goto free_xe1;
+	if (xdl_prepare_ctx(3, mr2, enl2, xpp, &cf, &xe2->xdf2) < 0)
+		goto free_xe2_xdf1;
+
+	if ((XDF_DIFF_ALG(xpp->flags) != XDF_PATIENCE_DIFF) &&
+	    (XDF_DIFF_ALG(xpp->flags) != XDF_HISTOGRAM_DIFF) &&
+	    (xdl_optimize_ctxs(&cf, &xe1->xdf1, &xe1->xdf2, 2) < 0 ||
+	     xdl_optimize_ctxs(&cf, &xe2->xdf1, &xe2->xdf2, 3) < 0)) {
+
+		xdl_free_env(xe2);
+		goto free_xe1;
+	}
+
+	xe1->nclass = xe2->nclass = cf.count;
+	xdl_free_classifier(&cf);
+
+	return 0;
+
+free_xe2_xdf1:
+	xdl_free_ctx(&xe2->xdf1);
+free_xe1:
+	xdl_free_ctx(&xe1->xdf2);
+free_xe1_xdf1:
+	xdl_free_ctx(&xe1->xdf1);
+free_cf:
+	xdl_free_classifier(&cf);
+	return -1;
+}
+
+
+/*
+ * Like xdl_prepare_merge_env(), for three files already prepared by one
+ * classifier, e.g. from the same xdfileset_t.
+ */
+int xdl_prepare_merge_env_from(xdfile_t const *orig, xdfile_t const *mf1,
+			       xdfile_t const *mf2, xpparam_t const *xpp,
+			       xdfenv_t *xe1, xdfenv_t *xe2) {
+	xdlclassifier_t cf;
+
+	memset(&cf, 0, sizeof(cf));
+
+	if (xdl_init_classifier(&cf, orig->nrec + mf1->nrec + mf2->nrec + 1,
+				xpp->flags) < 0)
+		return -1;
+	cf.by_ha = 1;
+
+	if (xdl_copy_ctx(1, orig->recs, orig->nrec, xpp, &cf, &xe1->xdf1) < 0)
+		goto free_cf;
+	if (xdl_copy_ctx(2, mf1->recs, mf1->nrec, xpp, &cf, &xe1->xdf2) < 0)
+		goto free_xe1_xdf1;
+	if (xdl_copy_ctx(1, xe1->xdf1.recs, xe1->xdf1.nrec, xpp, NULL, &xe2->xdf1) < 0)
+		goto free_xe1;
+	if (xdl_copy_ctx(3, mf2->recs, mf2->nrec, xpp, &cf, &xe2->xdf2) < 0)
+		goto free_xe2_xdf1;
+
+	if ((XDF_DIFF_ALG(xpp->flags) != XDF_PATIENCE_DIFF) &&
+	    (XDF_DIFF_ALG(xpp->flags) != XDF_HISTOGRAM_DIFF) &&
+	    (xdl_optimize_ctxs(&cf, &xe1->xdf1, &xe1->xdf2, 2) < 0 ||
+	     xdl_optimize_ctxs(&cf, &xe2->xdf1, &xe2->xdf2, 3) < 0)) {
+
+		xdl_free_env(xe2);
+		goto free_xe1;
+	}
+
+	xe1->nclass = xe2->nclass = cf.count;
+	xdl_free_classifier(&cf);
+
+	return 0;
+
+free_xe2_xdf1:
+	xdl_free_ctx(&xe2->xdf1);
+free_xe1:
+	xdl_free_ctx(&xe1->xdf2);
+free_xe1_xdf1:
+	xdl_free_ctx(&xe1->xdf1);
+free_cf:
+	xdl_free_classifier(&cf);
+	return -1;
+}
+
+
+/*
+ * A set of files split and classified once by a shared classifier, to be
+ * combined into environments with xdl_prepare_merge_env_from(). The class
+ * ids of the files are comparable, but not dense for any one of them.
+ */
+struct s_xdfileset {
+	xdlclassifier_t cf;
+	xpparam_t const *xpp;
+	xdfile_t **files;
+	long nr, alloc;
+};
+
+
+/*
+ * The classifier is sized after the nr files that are going to be added.
+ */
+xdfileset_t *xdl_fileset_new(xpparam_t const *xpp, mmfile_t **mf, long nr) {
+	xdfileset_t *fs;
+	long i, nlines = 0;
+	mmbuffer_t chunk;
+	mmrope_t mr;
+
+	for (i = 0; i < nr; i++) {
+		xdl_file_rope(mf[i], &chunk, &mr);
+		nlines += xdl_guess_lines(&mr, XDL_GUESS_NLINES1) + 1;
+	}
+	if (!(fs = xdl_malloc(sizeof(*fs))))
+		return NULL;
+	memset(fs, 0, sizeof(*fs));
+	if (xdl_init_classifier(&fs->cf, nlines + 1, xpp->flags) < 0) {
+
+		xdl_free(fs);
+		return NULL;
+	}
+	fs->xpp = xpp;
+
+	return fs;
+}
+
+
+xdfile_t *xdl_fileset_add(xdfileset_t *fs, mmfile_t *mf) {
+	xdfile_t *xdf;
+	long sample, alloc;
+	mmbuffer_t chunk;
+	mmrope_t mr;
+	void *tmp;
+
+	/* the files already added must survive a failure */
+	if (fs->nr == fs->alloc) {
+		alloc = 2 * fs->alloc + 16;
+		if (!(tmp = xdl_realloc(fs->files, alloc * sizeof(*fs->files))))
+			return NULL;
+		fs->files = tmp;
+		fs->alloc = alloc;
+	}
+	if (!(xdf = xdl_malloc(sizeof(*xdf))))
+		return NULL;
+
+	xdl_file_rope(mf, &chunk, &mr);
+	sample = (XDF_DIFF_ALG(fs->xpp->flags) == XDF_HISTOGRAM_DIFF
+		  ? XDL_GUESS_NLINES2 : XDL_GUESS_NLINES1);
+	if (xdl_prepare_ctx(0, &mr, xdl_guess_lines(&mr, sample) + 1, fs->xpp,
+			    &fs->cf, xdf) < 0) {
+
+		xdl_free(xdf);
+		return NULL;
+	}
+	fs->files[fs->nr++] = xdf;
+
+	return xdf;
+}
+
+
+/*
+ * Free xdf, added to fs before, once it is no longer needed. Its class
+ * ids stay taken.
+ */
+void xdl_fileset_drop(xdfileset_t *fs, xdfile_t *xdf) {
+	long i;
+
+	for (i = 0; i < fs->nr; i++)
+		if (fs->files[i] == xdf)
+			break;
+	if (i == fs->nr)
+		return;
+	xdl_free_ctx(xdf);
+	xdl_free(xdf);
+	fs->files[i] = fs->files[--fs->nr];
+}
+
+
+/*
+ * Free the arrays of xdf, added to fs before, and keep only its records,
+ * for callers that hold on to the records themselves.
+ */
+void xdl_fileset_trim(xdfileset_t *fs XDL_UNUSED, xdfile_t *xdf) {
+
+	xdl_free(xdf->rhash);
+	xdl_free(xdf->rindex);
+	if (xdf->rchg)
+		xdl_free(xdf->rchg - 1);
+	xdl_free(xdf->rbits);
+	xdl_free(xdf->rmoved);
+	xdl_free(xdf->ha);
+	xdl_free(xdf->recs);
+	xdf->rhash = NULL;
+	xdf->rindex = NULL;
+	xdf->rchg = NULL;
+	xdf->rbits = NULL;
+	xdf->rmoved = NULL;
+	xdf->ha = NULL;
+	xdf->recs = NULL;
+}
+
+
+void xdl_fileset_free(xdfileset_t *fs) {
+	long i;
+
+	if (!fs)
+		return;
+	for (i = 0; i < fs->nr; i++) {
+		xdl_free_ctx(fs->files[i]);
+		xdl_free(fs->files[i]);
+	}
+	xdl_free(fs->files);
+	xdl_free_classifier(&fs->cf);
+	xdl_free(fs);
+}
+
+
+/*
+ * Prepare an environment comparing records off1..off1+nrec1-1 of xdf1
+ * with records off2..off2+nrec2-1 of xdf2, both already classified by
+ * the same classifier.
+ */
+int xdl_prepare_range_env(xdfile_t const *xdf1, long off1, long nrec1,
+			  xdfile_t const *xdf2, long off2, long nrec2,
+			  xpparam_t const *xpp, xdfenv_t *xe) {
+
+	return xdl_prepare_recs_env(xdf1->recs + off1, nrec1,
+				    xdf2->recs + off2, nrec2, xpp, xe);
+}
+
+
+/*
+ * Prepare an environment comparing two arrays of records, all already
+ * classified by the same classifier. Nothing is hashed again: the
+ * records are copied and their class ids renumbered densely.
+ */
+int xdl_prepare_recs_env(xrecord_t *const *recs1, long nrec1,
+			 xrecord_t *const *recs2, long nrec2,
+			 xpparam_t const *xpp, xdfenv_t *xe) {
+	xdlclassifier_t cf;
+
+	memset(&cf, 0, sizeof(cf));
+
+	if (xdl_init_classifier(&cf, nrec1 + nrec2 + 1, xpp->flags) < 0)
+		return -1;
+	cf.by_ha = 1;
+
+	if (xdl_copy_ctx(1, recs1, nrec1, xpp, &cf, &xe->xdf1) < 0)
+		goto free_cf;
+	if (xdl_copy_ctx(2, recs2, nrec2, xpp, &cf, &xe->xdf2) < 0)
+		goto free_xdf1;
+
+	if ((XDF_DIFF_ALG(xpp->flags) != XDF_PATIENCE_DIFF) &&
+	    (XDF_DIFF_ALG(xpp->flags) != XDF_HISTOGRAM_DIFF) &&
+	    xdl_optimize_ctxs(&cf, &xe->xdf1, &xe->xdf2, 2) < 0) {
+
+		xdl_free_ctx(&xe->xdf2);
+		goto free_xdf1;
+	}
+
+	xe->nclass = cf.count;
+	xdl_free_classifier(&cf);
+
+	return 0;
+
+free_xdf1:
+	xdl_free_ctx(&xe->xdf1);
+free_cf:
+	xdl_free_classifier(&cf);
+	return -1;
+}
+
+
 void xdl_free_env(xdfenv_t *xe) {
 
 	xdl_free_ctx(&xe->xdf2);
@@ -363,7 +1024,8 @@ static int xdl_clean_mmatch(char const *dis, long i, long s, long e) {
  * matches on the other file. Also, lines that have multiple matches
  * might be potentially discarded if they happear in a run of discardable.
  */
-static int xdl_cleanup_records(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xdf2) {
+static int xdl_cleanup_records(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xdf2,
+			       unsigned int pass2) {
 	long i, nm, nreff, mlim;
 	xrecord_t **recs;
 	xdlclass_t *rcrec;
@@ -378,7 +1040,7 @@ static int xdl_cleanup_records(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xd
 		mlim = XDL_MAX_EQLIMIT;
 	for (i = xdf1->dstart, recs = &xdf1->recs[xdf1->dstart]; i <= xdf1->dend; i++, recs++) {
 		rcrec = cf->rcrecs[(*recs)->ha];
-		nm = rcrec ? rcrec->len2 : 0;
+		nm = rcrec ? rcrec->len[pass2 - 1] : 0;
 		dis1[i] = (nm == 0) ? 0: (nm >= mlim) ? 2: 1;
 	}
 
@@ -386,7 +1048,7 @@ static int xdl_cleanup_records(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xd
 		mlim = XDL_MAX_EQLIMIT;
 	for (i = xdf2->dstart, recs = &xdf2->recs[xdf2->dstart]; i <= xdf2->dend; i++, recs++) {
 		rcrec = cf->rcrecs[(*recs)->ha];
-		nm = rcrec ? rcrec->len1 : 0;
+		nm = rcrec ? rcrec->len[0] : 0;
 		dis2[i] = (nm == 0) ? 0: (nm >= mlim) ? 2: 1;
 	}
 
@@ -398,7 +1060,7 @@ static int xdl_cleanup_records(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xd
 			xdf1->ha[nreff] = (*recs)->ha;
 			nreff++;
 		} else
-			xdf1->rchg[i] = 1;
+			XDL_SET_CHANGED(xdf1, i);
 	}
 	xdf1->nreff = nreff;
 
@@ -410,7 +1072,7 @@ static int xdl_cleanup_records(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xd
 			xdf2->ha[nreff] = (*recs)->ha;
 			nreff++;
 		} else
-			xdf2->rchg[i] = 1;
+			XDL_SET_CHANGED(xdf2, i);
 	}
 	xdf2->nreff = nreff;
 
@@ -449,10 +1111,11 @@ static int xdl_trim_ends(xdfile_t *xdf1, xdfile_t *xdf2) {
 }
 
 
-static int xdl_optimize_ctxs(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xdf2) {
+static int xdl_optimize_ctxs(xdlclassifier_t *cf, xdfile_t *xdf1, xdfile_t *xdf2,
+			     unsigned int pass2) {
 
 	if (xdl_trim_ends(xdf1, xdf2) < 0 ||
-	    xdl_cleanup_records(cf, xdf1, xdf2) < 0) {
+	    xdl_cleanup_records(cf, xdf1, xdf2, pass2) < 0) {
 
 		return -1;
 	}
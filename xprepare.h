@@ -25,8 +25,35 @@
 
 
 
+typedef struct s_xdfileset xdfileset_t;
+
 int xdl_prepare_env(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 		    xdfenv_t *xe);
+int xdl_prepare_rope_env(mmrope_t const *mr1, mmrope_t const *mr2,
+			 xpparam_t const *xpp, xdfenv_t *xe);
+int xdl_prepare_split_env(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
+			  xdfenv_t *xe);
+int xdl_prepare_lines_env(xdlines_t const *l1, xdlines_t const *l2,
+			  xpparam_t const *xpp, xdfenv_t *xe);
+int xdl_prepare_merge_env(mmfile_t *orig, mmfile_t *mf1, mmfile_t *mf2,
+			  xpparam_t const *xpp, xdfenv_t *xe1, xdfenv_t *xe2);
+int xdl_prepare_merge_rope_env(mmrope_t const *orig, mmrope_t const *mr1,
+			       mmrope_t const *mr2, xpparam_t const *xpp,
+			       xdfenv_t *xe1, xdfenv_t *xe2);
+int xdl_prepare_merge_env_from(xdfile_t const *orig, xdfile_t const *mf1,
+			       xdfile_t const *mf2, xpparam_t const *xpp,
+			       xdfenv_t *xe1, xdfenv_t *xe2);
+xdfileset_t *xdl_fileset_new(xpparam_t const *xpp, mmfile_t **mf, long nr);
+xdfile_t *xdl_fileset_add(xdfileset_t *fs, mmfile_t *mf);
+void xdl_fileset_drop(xdfileset_t *fs, xdfile_t *xdf);
+void xdl_fileset_trim(xdfileset_t *fs, xdfile_t *xdf);
+void xdl_fileset_free(xdfileset_t *fs);
+int xdl_prepare_range_env(xdfile_t const *xdf1, long off1, long nrec1,
+			  xdfile_t const *xdf2, long off2, long nrec2,
+			  xpparam_t const *xpp, xdfenv_t *xe);
+int xdl_prepare_recs_env(xrecord_t *const *recs1, long nrec1,
+			 xrecord_t *const *recs2, long nrec2,
+			 xpparam_t const *xpp, xdfenv_t *xe);
 void xdl_free_env(xdfenv_t *xe);
 
 
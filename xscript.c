@@ -0,0 +1,362 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+#include "xinclude.h"
+
+#define XDL_SCRIPT_MAGIC "XDS1"
+#define XDL_SCRIPT_MAGIC_LEN 4
+/* the most bytes a varint of a long takes */
+#define XDL_SCRIPT_VARINT_MAX 10
+
+
+/*
+ * An encoded script is the magic, then the flags, the line counts of
+ * both files and the number of edits as varints, then each edit. Only
+ * the side 1 gap to the previous edit is stored, since unchanged runs
+ * have the same length on both sides, followed by chg1 shifted left
+ * once with the ignore bit below it, and chg2. With XDL_SCRIPT_HASHES,
+ * the edit goes on with the 32-bit hashes of its lines on each side,
+ * least significant byte first. With XDL_SCRIPT_TEXT, it ends with the
+ * size of its side 2 lines as a varint, and the lines themselves.
+ */
+
+
+static char *script_put(char *out, unsigned long val)
+{
+	while (val >= 0x80) {
+		*out++ = (char) (val | 0x80);
+		val >>= 7;
+	}
+	*out++ = (char) val;
+
+	return out;
+}
+
+static int script_get(char const **ptr, char const *top, long *val)
+{
+	unsigned long v = 0;
+	unsigned int shift;
+	unsigned char c;
+
+	for (shift = 0; *ptr < top && shift < CHAR_BIT * sizeof(long); shift += 7) {
+		c = (unsigned char) *(*ptr)++;
+		v |= (unsigned long) (c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			if ((v >> shift) != (c & 0x7f) || v > LONG_MAX)
+				return -1;
+			*val = (long) v;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static char *script_put32(char *out, unsigned int val)
+{
+	int i;
+
+	for (i = 0; i < 4; i++, val >>= 8)
+		*out++ = (char) (val & 0xff);
+
+	return out;
+}
+
+static int script_get32(char const **ptr, char const *top, unsigned int *val)
+{
+	int i;
+
+	if (top - *ptr < 4)
+		return -1;
+	for (*val = 0, i = 0; i < 4; i++)
+		*val |= (unsigned int) (unsigned char) *(*ptr)++ << (8 * i);
+
+	return 0;
+}
+
+/*
+ * Hash the n lines held in the size bytes at ptr. The hash is computed
+ * the same way everywhere, so that scripts can move between machines.
+ */
+unsigned int xdl_span_hash(char const *ptr, long size, long n)
+{
+	uint32_t ha = 2166136261u ^ (uint32_t) n;
+	char const *top;
+
+	for (top = ptr + size; ptr < top; ptr++)
+		ha = (ha ^ (unsigned char) *ptr) * 16777619u;
+
+	return (unsigned int) ha;
+}
+
+static mmbuffer_t script_span(xdfile_t *xdf, long i, long n)
+{
+	mmbuffer_t mb;
+
+	mb.ptr = n ? (char *) xdf->recs[i]->ptr : NULL;
+	mb.size = n ? (long) (xdf->recs[i + n - 1]->ptr +
+			      xdf->recs[i + n - 1]->size - mb.ptr) : 0;
+
+	return mb;
+}
+
+static unsigned int script_hash(xdfile_t *xdf, long i, long n)
+{
+	mmbuffer_t mb = script_span(xdf, i, n);
+
+	return xdl_span_hash(mb.ptr, mb.size, n);
+}
+
+/*
+ * Check that the edits of script are in order, within files of nrec1 and
+ * nrec2 lines, and keep both files aligned in between.
+ */
+static int script_check(xdedit_t const *edit, long nr, long nrec1, long nrec2)
+{
+	long k, end1 = 0, end2 = 0;
+
+	for (k = 0; k < nr; k++) {
+		if (edit[k].i1 < end1 || edit[k].chg1 < 0 || edit[k].chg2 < 0 ||
+		    !(edit[k].chg1 | edit[k].chg2) ||
+		    edit[k].i2 - end2 != edit[k].i1 - end1 ||
+		    edit[k].chg1 > nrec1 - edit[k].i1 ||
+		    edit[k].chg2 > nrec2 - edit[k].i2)
+			return -1;
+		end1 = edit[k].i1 + edit[k].chg1;
+		end2 = edit[k].i2 + edit[k].chg2;
+	}
+
+	return nrec1 - end1 == nrec2 - end2 ? 0 : -1;
+}
+
+int xdl_script_encode(xdscript_t const *script, mmfile_t *mf1, mmfile_t *mf2,
+		      unsigned long flags, mmbuffer_t *out)
+{
+	xpparam_t xpp;
+	xdfenv_t xe;
+	xdedit_t const *edit = script->edit;
+	mmbuffer_t text;
+	long k, end1, esize, tsize;
+	char *ptr;
+
+	memset(&xpp, 0, sizeof(xpp));
+	out->ptr = NULL;
+	out->size = 0;
+	if (xdl_prepare_split_env(mf1, mf2, &xpp, &xe) < 0)
+		return -1;
+
+	/* no edit takes more than esize bytes besides its text */
+	flags &= XDL_SCRIPT_HASHES | XDL_SCRIPT_TEXT;
+	esize = 4 * XDL_SCRIPT_VARINT_MAX + 8;
+	tsize = flags & XDL_SCRIPT_TEXT ? mf2->size : 0;
+	if (script_check(edit, script->nr, xe.xdf1.nrec, xe.xdf2.nrec) < 0 ||
+	    script->nr > (LONG_MAX - 64 - tsize) / esize ||
+	    !(ptr = xdl_malloc(XDL_SCRIPT_MAGIC_LEN + 4 * XDL_SCRIPT_VARINT_MAX +
+			       script->nr * esize + tsize))) {
+
+		xdl_free_env(&xe);
+		return -1;
+	}
+	out->ptr = ptr;
+
+	memcpy(ptr, XDL_SCRIPT_MAGIC, XDL_SCRIPT_MAGIC_LEN);
+	ptr += XDL_SCRIPT_MAGIC_LEN;
+	ptr = script_put(ptr, flags);
+	ptr = script_put(ptr, (unsigned long) xe.xdf1.nrec);
+	ptr = script_put(ptr, (unsigned long) xe.xdf2.nrec);
+	ptr = script_put(ptr, (unsigned long) script->nr);
+	for (k = 0, end1 = 0; k < script->nr; k++) {
+		ptr = script_put(ptr, (unsigned long) (edit[k].i1 - end1));
+		ptr = script_put(ptr, (unsigned long) edit[k].chg1 << 1 |
+				 (edit[k].ignore ? 1 : 0));
+		ptr = script_put(ptr, (unsigned long) edit[k].chg2);
+		if (flags & XDL_SCRIPT_HASHES) {
+			ptr = script_put32(ptr, script_hash(&xe.xdf1, edit[k].i1,
+							    edit[k].chg1));
+			ptr = script_put32(ptr, script_hash(&xe.xdf2, edit[k].i2,
+							    edit[k].chg2));
+		}
+		if (flags & XDL_SCRIPT_TEXT) {
+			text = script_span(&xe.xdf2, edit[k].i2, edit[k].chg2);
+			ptr = script_put(ptr, (unsigned long) text.size);
+			if (text.size)
+				memcpy(ptr, text.ptr, text.size);
+			ptr += text.size;
+		}
+		end1 = edit[k].i1 + edit[k].chg1;
+	}
+	out->size = ptr - out->ptr;
+	xdl_free_env(&xe);
+
+	return 0;
+}
+
+/*
+ * Decode enc into hdr and script. If hash is not NULL and the script has
+ * them, the two hashes of each edit are returned as an array in *hash;
+ * likewise for text and the side 2 lines of each edit, which point into
+ * enc.
+ */
+int xdl_script_parse(mmbuffer_t const *enc, xdsheader_t *hdr,
+		     xdscript_t *script, unsigned int **hash, mmbuffer_t **text)
+{
+	char const *ptr = enc->ptr, *top = enc->ptr + enc->size;
+	unsigned int *ha = NULL, h1, h2;
+	xdedit_t *edit = NULL;
+	mmbuffer_t *tx = NULL;
+	long k, nr, val, end1, end2;
+
+	script->edit = NULL;
+	script->nr = 0;
+	if (hash)
+		*hash = NULL;
+	if (text)
+		*text = NULL;
+	if (!xdl_script_magic(enc))
+		return -1;
+	ptr += XDL_SCRIPT_MAGIC_LEN;
+	if (script_get(&ptr, top, &val) < 0 ||
+	    script_get(&ptr, top, &hdr->nrec1) < 0 ||
+	    script_get(&ptr, top, &hdr->nrec2) < 0 ||
+	    script_get(&ptr, top, &nr) < 0)
+		return -1;
+	hdr->flags = (unsigned long) val;
+	/* every edit takes at least three bytes */
+	if ((hdr->flags & ~(XDL_SCRIPT_HASHES | XDL_SCRIPT_TEXT)) ||
+	    nr > (top - ptr) / 3)
+		return -1;
+	if (nr && !XDL_ALLOC_ARRAY(edit, nr))
+		goto abort;
+	if (hash && nr && (hdr->flags & XDL_SCRIPT_HASHES) &&
+	    !XDL_ALLOC_ARRAY(ha, 2 * nr))
+		goto abort;
+	if (text && nr && (hdr->flags & XDL_SCRIPT_TEXT) &&
+	    !XDL_ALLOC_ARRAY(tx, nr))
+		goto abort;
+
+	for (k = 0, end1 = end2 = 0; k < nr; k++) {
+		if (script_get(&ptr, top, &val) < 0 ||
+		    val > hdr->nrec1 - end1 || val > hdr->nrec2 - end2)
+			goto abort;
+		edit[k].i1 = end1 + val;
+		edit[k].i2 = end2 + val;
+		if (script_get(&ptr, top, &val) < 0)
+			goto abort;
+		edit[k].chg1 = val >> 1;
+		edit[k].ignore = (int) (val & 1);
+		if (script_get(&ptr, top, &edit[k].chg2) < 0)
+			goto abort;
+		if (hdr->flags & XDL_SCRIPT_HASHES) {
+			if (script_get32(&ptr, top, &h1) < 0 ||
+			    script_get32(&ptr, top, &h2) < 0)
+				goto abort;
+			if (ha) {
+				ha[2 * k] = h1;
+				ha[2 * k + 1] = h2;
+			}
+		}
+		if (hdr->flags & XDL_SCRIPT_TEXT) {
+			if (script_get(&ptr, top, &val) < 0 || val > top - ptr ||
+			    (val > 0) != (edit[k].chg2 > 0))
+				goto abort;
+			if (tx) {
+				tx[k].ptr = (char *) ptr;
+				tx[k].size = val;
+			}
+			ptr += val;
+		}
+		if (edit[k].chg1 > hdr->nrec1 - edit[k].i1 ||
+		    edit[k].chg2 > hdr->nrec2 - edit[k].i2)
+			goto abort;
+		end1 = edit[k].i1 + edit[k].chg1;
+		end2 = edit[k].i2 + edit[k].chg2;
+	}
+	if (ptr != top || script_check(edit, nr, hdr->nrec1, hdr->nrec2) < 0)
+		goto abort;
+
+	script->edit = edit;
+	script->nr = nr;
+	if (hash)
+		*hash = ha;
+	if (text)
+		*text = tx;
+
+	return 0;
+
+abort:
+	xdl_free(tx);
+	xdl_free(ha);
+	xdl_free(edit);
+	return -1;
+}
+
+int xdl_script_magic(mmbuffer_t const *buf)
+{
+	return buf->size >= XDL_SCRIPT_MAGIC_LEN &&
+		!memcmp(buf->ptr, XDL_SCRIPT_MAGIC, XDL_SCRIPT_MAGIC_LEN);
+}
+
+int xdl_script_decode(mmbuffer_t const *enc, xdscript_t *script)
+{
+	xdsheader_t hdr;
+
+	return xdl_script_parse(enc, &hdr, script, NULL, NULL);
+}
+
+int xdl_script_replay(mmbuffer_t const *enc, mmfile_t *mf1, mmfile_t *mf2,
+		      xdemitconf_t const *xecfg, xdemitcb_t *ecb)
+{
+	xdsheader_t hdr;
+	xdscript_t script;
+	unsigned int *hash = NULL;
+	xdchange_t *xscr = NULL;
+	xpparam_t xpp;
+	xdfenv_t xe;
+	long k;
+	int res = -1;
+
+	if (xdl_script_parse(enc, &hdr, &script, &hash, NULL) < 0)
+		return -1;
+	memset(&xpp, 0, sizeof(xpp));
+	if (xdl_prepare_split_env(mf1, mf2, &xpp, &xe) < 0)
+		goto out;
+	if (xe.xdf1.nrec != hdr.nrec1 || xe.xdf2.nrec != hdr.nrec2)
+		goto free_env;
+	for (k = 0; hash && k < script.nr; k++)
+		if (hash[2 * k] != script_hash(&xe.xdf1, script.edit[k].i1,
+					       script.edit[k].chg1) ||
+		    hash[2 * k + 1] != script_hash(&xe.xdf2, script.edit[k].i2,
+						   script.edit[k].chg2))
+			goto free_env;
+	if (xdl_edits_script(script.edit, script.nr, &xscr) < 0)
+		goto free_env;
+
+	res = xdl_emit_changes(&xe, xscr, ecb, xecfg);
+	xdl_free_script(xscr);
+free_env:
+	xdl_free_env(&xe);
+out:
+	xdl_free(hash);
+	xdl_free_edit_script(&script);
+	return res;
+}
@@ -0,0 +1,39 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+#if !defined(XSCRIPT_H)
+#define XSCRIPT_H
+
+
+typedef struct s_xdsheader {
+	unsigned long flags;
+	long nrec1, nrec2;
+} xdsheader_t;
+
+int xdl_script_magic(mmbuffer_t const *buf);
+unsigned int xdl_span_hash(char const *ptr, long size, long n);
+int xdl_script_parse(mmbuffer_t const *enc, xdsheader_t *hdr,
+		     xdscript_t *script, unsigned int **hash, mmbuffer_t **text);
+
+
+
+#endif /* #if !defined(XSCRIPT_H) */
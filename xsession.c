@@ -0,0 +1,442 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+#include "xinclude.h"
+
+/* unchanged lines re-diffed on each side of an edit */
+#define XDL_SESSION_MARGIN 16
+/* repack the text once this much of it is no longer used */
+#define XDL_SESSION_SLACK (64 * 1024)
+
+
+/*
+ * A session keeps both files as arrays of records, classified once by a
+ * file set, and their change maps. An edit only re-classifies the lines
+ * it inserts, and re-diffs the window of the files around it that could
+ * be affected: the edit plus a margin, widened to take in the changes it
+ * touches. Everything outside the window keeps its alignment.
+ */
+struct session_side {
+	xrecord_t **recs;
+	long nrec, alloc;
+	char *rchg;		/* rchg[-1] and rchg[nrec] are always 0 */
+};
+
+struct s_xdsession {
+	xpparam_t xpp;
+	xdfileset_t *fs;
+	char **text;		/* copies of the text the records point into */
+	long ntext, text_alloc;
+	long held, live;	/* bytes kept for text and records, and in use */
+	struct session_side side[2];
+	xdchange_t *xscr;
+	int stale;		/* xscr could not be rebuilt after the last edit */
+};
+
+
+static int session_reserve(struct session_side *sd, long nrec)
+{
+	long alloc;
+	void *tmp;
+
+	if (nrec < sd->alloc)
+		return 0;
+	alloc = XDL_MAX(nrec, 2 * sd->alloc + 16);
+	if (!(tmp = xdl_realloc(sd->recs, alloc * sizeof(*sd->recs))))
+		return -1;
+	sd->recs = tmp;
+	if (!(tmp = xdl_realloc(sd->rchg - 1, alloc + 2)))
+		return -1;
+	sd->rchg = (char *) tmp + 1;
+	sd->alloc = alloc;
+	return 0;
+}
+
+/*
+ * Keep a copy of text and prepare it in the session's file set. Once the
+ * caller has taken its records, it trims the prepared file; the struct
+ * and its records stay in the set until the next repack, and count as
+ * held like the text.
+ */
+static xdfile_t *session_add_text(xdsession_t *s, mmfile_t *text)
+{
+	mmfile_t mf;
+	xdfile_t *xdf;
+	long alloc;
+	void *tmp;
+
+	if (s->ntext == s->text_alloc) {
+		alloc = 2 * s->text_alloc + 16;
+		if (!(tmp = xdl_realloc(s->text, alloc * sizeof(*s->text))))
+			return NULL;
+		s->text = tmp;
+		s->text_alloc = alloc;
+	}
+	if (!(mf.ptr = xdl_malloc(text->size ? text->size : 1)))
+		return NULL;
+	memcpy(mf.ptr, text->ptr, text->size);
+	mf.size = text->size;
+	s->text[s->ntext++] = mf.ptr;
+	s->held += mf.size;
+
+	if (!(xdf = xdl_fileset_add(s->fs, &mf)))
+		return NULL;
+	s->held += sizeof(*xdf) + sizeof(chanode_t) +
+		xdf->nrec * sizeof(xrecord_t);
+	s->live += mf.size + xdf->nrec * sizeof(xrecord_t);
+	return xdf;
+}
+
+/*
+ * Build the script from the change maps. If that fails, the old script
+ * is dropped and the session is stale until a later call manages it.
+ */
+static int session_build(xdsession_t *s)
+{
+	xdfenv_t xe;
+	xdchange_t *xscr;
+
+	memset(&xe, 0, sizeof(xe));
+	xe.xdf1.nrec = s->side[0].nrec;
+	xe.xdf1.recs = s->side[0].recs;
+	xe.xdf1.rchg = s->side[0].rchg;
+	xe.xdf2.nrec = s->side[1].nrec;
+	xe.xdf2.recs = s->side[1].recs;
+	xe.xdf2.rchg = s->side[1].rchg;
+	xdl_free_script(s->xscr);
+	s->xscr = NULL;
+	if ((s->stale = xdl_build_script(&xe, &xscr) < 0))
+		return -1;
+	xdl_mark_ignorable(xscr, &xe, &s->xpp);
+
+	s->xscr = xscr;
+	return 0;
+}
+
+/*
+ * Diff lines s1..e1-1 of the first file against lines s2..e2-1 of the
+ * second one into the change maps, and rebuild the script. If the diff
+ * fails, the window is marked as changed, which is still a valid diff.
+ */
+static void session_rediff(xdsession_t *s, long s1, long e1, long s2, long e2)
+{
+	xdfenv_t xe;
+	int res = -1;
+
+	if (!xdl_prepare_recs_env(s->side[0].recs + s1, e1 - s1,
+				  s->side[1].recs + s2, e2 - s2, &s->xpp, &xe) &&
+	    !xdl_diff_env(&s->xpp, &xe)) {
+		if (!xdl_change_compact(&xe.xdf1, &xe.xdf2, s->xpp.flags) &&
+		    !xdl_change_compact(&xe.xdf2, &xe.xdf1, s->xpp.flags)) {
+			memcpy(s->side[0].rchg + s1, xe.xdf1.rchg, e1 - s1);
+			memcpy(s->side[1].rchg + s2, xe.xdf2.rchg, e2 - s2);
+			res = 0;
+		}
+		xdl_free_env(&xe);
+	}
+	if (res < 0) {
+		memset(s->side[0].rchg + s1, 1, e1 - s1);
+		memset(s->side[1].rchg + s2, 1, e2 - s2);
+	}
+
+	session_build(s);
+}
+
+/*
+ * Find the window around lines a..a+d-1 of side p that an edit there
+ * may change. win[0] and win[2] delimit it in the first file, win[1] and
+ * win[3] in the second one.
+ */
+static void session_window(xdsession_t *s, int p, long a, long d, long *win)
+{
+	xdchange_t *xch;
+	long st, en, hs, he, ds, de, delta;
+	int grown;
+
+	st = XDL_MAX(a - XDL_SESSION_MARGIN, 0);
+	en = XDL_MIN(a + d + XDL_SESSION_MARGIN, s->side[p].nrec);
+	do {
+		grown = 0;
+		for (xch = s->xscr; xch; xch = xch->next) {
+			hs = p ? xch->i2 : xch->i1;
+			he = hs + (p ? xch->chg2 : xch->chg1);
+			if (hs <= en && he >= st && (hs < st || he > en)) {
+				st = XDL_MIN(st, hs);
+				en = XDL_MAX(en, he);
+				grown = 1;
+			}
+		}
+	} while (grown);
+
+	/* changes ending before the window shift its start on the other side */
+	for (ds = de = 0, xch = s->xscr; xch; xch = xch->next) {
+		hs = p ? xch->i2 : xch->i1;
+		he = hs + (p ? xch->chg2 : xch->chg1);
+		delta = p ? xch->chg1 - xch->chg2 : xch->chg2 - xch->chg1;
+		if (he < st)
+			ds += delta;
+		if (hs <= en)
+			de += delta;
+	}
+
+	win[p] = st;
+	win[p + 2] = en;
+	win[!p] = st + ds;
+	win[!p + 2] = en + de;
+}
+
+static int rec_open(xrecord_t *rec)
+{
+	return !rec->size || rec->ptr[rec->size - 1] != '\n';
+}
+
+/*
+ * Rebuild the text from the records still in use, once enough of what is
+ * held has been replaced.
+ */
+static int session_repack(xdsession_t *s)
+{
+	mmfile_t mf[2], *pmf[2];
+	xdfileset_t *fs;
+	xdfile_t *xdf[2];
+	char *dest;
+	long i, p;
+
+	mf[0].ptr = mf[1].ptr = NULL;
+	for (p = 0; p < 2; p++) {
+		pmf[p] = &mf[p];
+		for (mf[p].size = 0, i = 0; i < s->side[p].nrec; i++)
+			mf[p].size += s->side[p].recs[i]->size;
+		if (!(mf[p].ptr = xdl_malloc(mf[p].size ? mf[p].size : 1)))
+			goto fail;
+		for (dest = mf[p].ptr, i = 0; i < s->side[p].nrec; i++) {
+			memcpy(dest, s->side[p].recs[i]->ptr, s->side[p].recs[i]->size);
+			dest += s->side[p].recs[i]->size;
+		}
+	}
+	if (!(fs = xdl_fileset_new(&s->xpp, pmf, 2)))
+		goto fail;
+	if (!(xdf[0] = xdl_fileset_add(fs, &mf[0])) ||
+	    !(xdf[1] = xdl_fileset_add(fs, &mf[1])) ||
+	    xdf[0]->nrec != s->side[0].nrec || xdf[1]->nrec != s->side[1].nrec) {
+
+		xdl_fileset_free(fs);
+		goto fail;
+	}
+
+	for (p = 0; p < 2; p++) {
+		memcpy(s->side[p].recs, xdf[p]->recs,
+		       s->side[p].nrec * sizeof(*s->side[p].recs));
+		xdl_fileset_trim(fs, xdf[p]);
+	}
+	xdl_fileset_free(s->fs);
+	s->fs = fs;
+	for (i = 0; i < s->ntext; i++)
+		xdl_free(s->text[i]);
+	s->text[0] = mf[0].ptr;
+	s->text[1] = mf[1].ptr;
+	s->ntext = 2;
+	s->held = s->live = mf[0].size + mf[1].size +
+		(s->side[0].nrec + s->side[1].nrec) * sizeof(xrecord_t);
+	return 0;
+
+fail:
+	xdl_free(mf[0].ptr);
+	xdl_free(mf[1].ptr);
+	return -1;
+}
+
+xdsession_t *xdl_session_new(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp)
+{
+	xdsession_t *s;
+	mmfile_t *mf[2];
+	xdfile_t *xdf;
+	long p;
+
+	if (!(s = xdl_malloc(sizeof(*s))))
+		return NULL;
+	memset(s, 0, sizeof(*s));
+	s->xpp = *xpp;
+	/* the session splices its own byte maps on every edit */
+	s->xpp.flags &= ~XDF_PACKED_CHANGES;
+	mf[0] = mf1;
+	mf[1] = mf2;
+	if (!(s->fs = xdl_fileset_new(&s->xpp, mf, 2)))
+		goto fail;
+	for (p = 0; p < 2; p++) {
+		if (!XDL_CALLOC_ARRAY(s->side[p].rchg, 2))
+			goto fail;
+		s->side[p].rchg++;
+		if (!(xdf = session_add_text(s, mf[p])) ||
+		    session_reserve(&s->side[p], xdf->nrec) < 0)
+			goto fail;
+		memcpy(s->side[p].recs, xdf->recs, xdf->nrec * sizeof(*xdf->recs));
+		memset(s->side[p].rchg, 0, xdf->nrec + 1);
+		s->side[p].nrec = xdf->nrec;
+		xdl_fileset_trim(s->fs, xdf);
+	}
+	session_rediff(s, 0, s->side[0].nrec, 0, s->side[1].nrec);
+	if (s->stale)
+		goto fail;
+
+	return s;
+
+fail:
+	xdl_session_free(s);
+	return NULL;
+}
+
+int xdl_session_replace(xdsession_t *s, int side, long line, long nr,
+			mmfile_t *text)
+{
+	struct session_side *sd;
+	xdfile_t *xdf;
+	long win[4], n, k, i;
+	int p = side - 1;
+
+	if (p < 0 || p > 1 || line < 0 || nr < 0 || line + nr > s->side[p].nrec)
+		return -1;
+	/* the window is found from the script */
+	if (s->stale && session_build(s) < 0)
+		return -1;
+	sd = &s->side[p];
+	n = sd->nrec;
+	if (!(xdf = session_add_text(s, text)))
+		return -1;
+	k = xdf->nrec;
+
+	/* only the last line of a file may lack its newline */
+	if ((k && line + k < n - nr + k && rec_open(xdf->recs[k - 1])) ||
+	    (line && line < n - nr + k && rec_open(sd->recs[line - 1])) ||
+	    session_reserve(sd, n - nr + k) < 0) {
+		xdl_fileset_trim(s->fs, xdf);
+		s->live -= text->size + k * sizeof(xrecord_t);
+		return -1;
+	}
+
+	session_window(s, p, line, nr, win);
+
+	for (i = line; i < line + nr; i++)
+		s->live -= sd->recs[i]->size + sizeof(xrecord_t);
+	memmove(sd->recs + line + k, sd->recs + line + nr,
+		(n - line - nr) * sizeof(*sd->recs));
+	memcpy(sd->recs + line, xdf->recs, k * sizeof(*sd->recs));
+	xdl_fileset_trim(s->fs, xdf);
+	memmove(sd->rchg + line + k, sd->rchg + line + nr, n - line - nr + 1);
+	memset(sd->rchg + line, 0, k);
+	sd->nrec = n - nr + k;
+	win[p + 2] += k - nr;
+
+	/* from here on the edit is made, even if the script is not rebuilt */
+	session_rediff(s, win[0], win[2], win[1], win[3]);
+	if (s->held - s->live > XDL_MAX(s->live, XDL_SESSION_SLACK))
+		session_repack(s);
+
+	return 0;
+}
+
+/*
+ * Widen the byte range to the lines it touches, and replace those with
+ * their untouched head and tail around text.
+ */
+int xdl_session_replace_bytes(xdsession_t *s, int side, long off, long len,
+			      mmfile_t *text)
+{
+	struct session_side *sd;
+	mmfile_t mf;
+	long a, e, pos, start, end, head, tail;
+	int res;
+
+	if (side < 1 || side > 2 || off < 0 || len < 0)
+		return -1;
+	sd = &s->side[side - 1];
+
+	/* the first line holding off, or the end if off starts a new line */
+	for (a = 0, pos = 0; a < sd->nrec && pos + sd->recs[a]->size <= off; a++)
+		pos += sd->recs[a]->size;
+	if (a == sd->nrec && a && off == pos && rec_open(sd->recs[a - 1]))
+		pos -= sd->recs[--a]->size;
+	if (off > pos && a == sd->nrec)
+		return -1;
+	start = pos;
+	for (e = a, end = pos; e < sd->nrec && (e == a || end < off + len); e++)
+		end += sd->recs[e]->size;
+	if (off + len > end)
+		return -1;
+
+	head = off - start;
+	tail = end - off - len;
+	/* take in the next line rather than leave one without its newline */
+	if (!tail && e < sd->nrec &&
+	    (text->size ? text->ptr[text->size - 1] != '\n' : head > 0)) {
+		end += sd->recs[e++]->size;
+		tail = end - off - len;
+	}
+	mf.size = head + text->size + tail;
+	if (!(mf.ptr = xdl_malloc(mf.size ? mf.size : 1)))
+		return -1;
+	for (pos = 0, start = a; start < e && pos < head; start++) {
+		long n = XDL_MIN(sd->recs[start]->size, head - pos);
+
+		memcpy(mf.ptr + pos, sd->recs[start]->ptr, n);
+		pos += n;
+	}
+	memcpy(mf.ptr + head, text->ptr, text->size);
+	for (pos = 0, end = e; end > a && pos < tail; ) {
+		long n = XDL_MIN(sd->recs[--end]->size, tail - pos);
+		xrecord_t *rec = sd->recs[end];
+
+		memcpy(mf.ptr + mf.size - pos - n, rec->ptr + rec->size - n, n);
+		pos += n;
+	}
+
+	res = xdl_session_replace(s, side, a, e - a, &mf);
+	xdl_free(mf.ptr);
+
+	return res;
+}
+
+int xdl_session_script(xdsession_t *s, xdscript_t *script)
+{
+	if (s->stale && session_build(s) < 0)
+		return -1;
+	return xdl_script_edits(s->xscr, script);
+}
+
+void xdl_session_free(xdsession_t *s)
+{
+	long i, p;
+
+	if (!s)
+		return;
+	for (p = 0; p < 2; p++) {
+		xdl_free(s->side[p].recs);
+		if (s->side[p].rchg)
+			xdl_free(s->side[p].rchg - 1);
+	}
+	xdl_free_script(s->xscr);
+	xdl_fileset_free(s->fs);
+	for (i = 0; i < s->ntext; i++)
+		xdl_free(s->text[i]);
+	xdl_free(s->text);
+	xdl_free(s);
+}
@@ -0,0 +1,295 @@
+/*
+ *  LibXDiff by Davide Libenzi ( File Differential Library )
+ *  Copyright (C) 2003  Davide Libenzi
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+
+#include "xinclude.h"
+
+/* an empty bin of a sketch */
+#define XDL_SKETCH_EMPTY UINT32_MAX
+
+
+/*
+ * A sketch is a one-permutation MinHash of the lines of a file: every
+ * line hash goes to one of XDL_SKETCH_BINS bins by its top bits, and
+ * each bin keeps the smallest of the rest. The k-th copy of a line is
+ * hashed as a distinct element, so that the sketch follows the multiset
+ * of lines rather than the set. Two sketches agree on a bin with about
+ * the probability that a line of either file is in both, which
+ * estimates their Jaccard similarity in a single pass over each file.
+ */
+static uint64_t sketch_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64_C(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+
+	return h;
+}
+
+static void sketch_add(xdsketch_t *sk, uint64_t h)
+{
+	uint32_t v, bin;
+
+	h = sketch_mix(h);
+	bin = (uint32_t) (h >> (64 - XDL_SKETCH_BITS));
+	v = (uint32_t) h;
+	if (v == XDL_SKETCH_EMPTY)
+		v--;
+	if (v < sk->min[bin])
+		sk->min[bin] = v;
+}
+
+/*
+ * An open addressed table counting the copies of each line, keyed by a
+ * mixed line hash that is never 0.
+ */
+struct sketch_table {
+	uint64_t *key;
+	long *count;
+	long size;	/* a power of two */
+};
+
+static int table_init(struct sketch_table *t, long size)
+{
+	t->size = size;
+	t->count = NULL;
+	if (!XDL_CALLOC_ARRAY(t->key, size) ||
+	    !XDL_CALLOC_ARRAY(t->count, size)) {
+		xdl_free(t->key);
+		return -1;
+	}
+
+	return 0;
+}
+
+static long table_slot(struct sketch_table *t, uint64_t key)
+{
+	long i;
+
+	for (i = (long) (key & (t->size - 1)); t->key[i] && t->key[i] != key;
+	     i = (i + 1) & (t->size - 1));
+
+	return i;
+}
+
+static int table_grow(struct sketch_table *t)
+{
+	struct sketch_table nt;
+	long i, j;
+
+	if (table_init(&nt, 2 * t->size) < 0)
+		return -1;
+	for (i = 0; i < t->size; i++)
+		if (t->key[i]) {
+			j = table_slot(&nt, t->key[i]);
+			nt.key[j] = t->key[i];
+			nt.count[j] = t->count[i];
+		}
+	xdl_free(t->key);
+	xdl_free(t->count);
+	*t = nt;
+
+	return 0;
+}
+
+int xdl_sketch(mmfile_t *mf, xpparam_t const *xpp, xdsketch_t *sk)
+{
+	char const *cur = mf->ptr, *top = mf->ptr + mf->size;
+	struct sketch_table t;
+	uint64_t key;
+	long nrec, i;
+	mmbuffer_t chunk;
+	mmrope_t mr;
+
+	for (i = 0; i < XDL_SKETCH_BINS; i++)
+		sk->min[i] = XDL_SKETCH_EMPTY;
+	sk->nrec = 0;
+
+	xdl_file_rope(mf, &chunk, &mr);
+	if (table_init(&t, 1L << xdl_hashbits((unsigned int)
+					      (2 * xdl_guess_lines(&mr, 256)))) < 0)
+		return -1;
+	for (nrec = 0; cur < top; nrec++) {
+		if (2 * (nrec + 1) > t.size && table_grow(&t) < 0) {
+			xdl_free(t.key);
+			xdl_free(t.count);
+			return -1;
+		}
+		key = sketch_mix((uint64_t) xdl_hash_record(&cur, top,
+							     xpp->flags)) | 1;
+		i = table_slot(&t, key);
+		t.key[i] = key;
+		sketch_add(sk, key + (uint64_t) t.count[i]++ *
+			   UINT64_C(0x9e3779b97f4a7c15));
+	}
+	sk->nrec = nrec;
+	xdl_free(t.key);
+	xdl_free(t.count);
+
+	return 0;
+}
+
+/*
+ * Turn a ratio of Jaccard similarity into the share of the lines of both
+ * files that they have in common, bounded by their sizes.
+ */
+static long sketch_score(long same, long used, long n1, long n2)
+{
+	long score, bound;
+
+	if (!used)
+		return XDL_SIMILARITY_MAX;
+	score = 2 * same * XDL_SIMILARITY_MAX / (used + same);
+	bound = (long) ((uint64_t) XDL_MIN(n1, n2) * 2 * XDL_SIMILARITY_MAX /
+			(uint64_t) (n1 + n2));
+
+	return XDL_MIN(score, bound);
+}
+
+long xdl_sketch_similarity(xdsketch_t const *a, xdsketch_t const *b)
+{
+	long same = 0, empty = 0, i;
+
+	/* no branches, so that the compiler can vectorize it */
+	for (i = 0; i < XDL_SKETCH_BINS; i++) {
+		same += (a->min[i] == b->min[i]) & (a->min[i] != XDL_SKETCH_EMPTY);
+		empty += (a->min[i] == XDL_SKETCH_EMPTY) & (b->min[i] == XDL_SKETCH_EMPTY);
+	}
+
+	return sketch_score(same, XDL_SKETCH_BINS - empty, a->nrec, b->nrec);
+}
+
+long xdl_similarity_estimate(mmfile_t *mf1, mmfile_t *mf2,
+			     xpparam_t const *xpp)
+{
+	xdsketch_t a, b;
+
+	if (xdl_sketch(mf1, xpp, &a) < 0 || xdl_sketch(mf2, xpp, &b) < 0)
+		return -1;
+
+	return xdl_sketch_similarity(&a, &b);
+}
+
+/*
+ * Diff mf1 and mf2 without building a script, and count the lines they
+ * have in common.
+ */
+long xdl_similarity(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp)
+{
+	xdfenv_t xe;
+	long i, same, n1, n2;
+
+	if (xdl_prepare_env(mf1, mf2, xpp, &xe) < 0)
+		return -1;
+	if (xdl_diff_env(xpp, &xe) < 0) {
+
+		xdl_free_env(&xe);
+		return -1;
+	}
+	n1 = xe.xdf1.nrec;
+	n2 = xe.xdf2.nrec;
+	for (i = 0, same = 0; i < n1; i++)
+		same += !XDL_CHANGED(&xe.xdf1, i);
+	xdl_free_env(&xe);
+
+	if (!n1 && !n2)
+		return XDL_SIMILARITY_MAX;
+	return (long) ((uint64_t) same * 2 * XDL_SIMILARITY_MAX /
+		       (uint64_t) (n1 + n2));
+}
+
+static int simpair_cmp(void const *p1, void const *p2)
+{
+	xdsimpair_t const *a = p1, *b = p2;
+
+	if (a->dst != b->dst)
+		return a->dst < b->dst ? -1 : 1;
+	if (a->score != b->score)
+		return a->score > b->score ? -1 : 1;
+	return a->src < b->src ? -1 : a->src > b->src;
+}
+
+int xdl_similar_pairs(mmfile_t *src, long nsrc, mmfile_t *dst, long ndst,
+		      xpparam_t const *xpp, long min_score, long ncand,
+		      xdsimpair_t **pairs, long *npairs)
+{
+	xdsketch_t *sk = NULL;
+	xdsimpair_t *cand = NULL, *out = NULL, c;
+	long i, j, k, n, nout = 0;
+	int ret = -1;
+
+	*pairs = NULL;
+	*npairs = 0;
+	if (ncand <= 0 || !nsrc || !ndst)
+		return 0;
+	if (!XDL_ALLOC_ARRAY(sk, nsrc + ndst) ||
+	    !XDL_ALLOC_ARRAY(cand, ncand) ||
+	    ndst > LONG_MAX / ncand ||
+	    !XDL_ALLOC_ARRAY(out, ndst * XDL_MIN(ncand, nsrc)))
+		goto out;
+	for (i = 0; i < nsrc; i++)
+		if (xdl_sketch(src + i, xpp, sk + i) < 0)
+			goto out;
+	for (j = 0; j < ndst; j++)
+		if (xdl_sketch(dst + j, xpp, sk + nsrc + j) < 0)
+			goto out;
+
+	for (j = 0; j < ndst; j++) {
+		/* the ncand best estimates for dst[j], best first */
+		for (i = 0, n = 0; i < nsrc; i++) {
+			c.src = i;
+			c.dst = j;
+			c.score = xdl_sketch_similarity(sk + i, sk + nsrc + j);
+			if (n == ncand && c.score <= cand[n - 1].score)
+				continue;
+			for (k = n < ncand ? n++ : n - 1;
+			     k > 0 && cand[k - 1].score < c.score; k--)
+				cand[k] = cand[k - 1];
+			cand[k] = c;
+		}
+		for (k = 0; k < n; k++) {
+			cand[k].score = xdl_similarity(src + cand[k].src, dst + j, xpp);
+			if (cand[k].score < 0)
+				goto out;
+			if (cand[k].score >= min_score)
+				out[nout++] = cand[k];
+		}
+	}
+	qsort(out, nout, sizeof(*out), simpair_cmp);
+
+	*pairs = out;
+	*npairs = nout;
+	out = NULL;
+	ret = 0;
+out:
+	xdl_free(out);
+	xdl_free(cand);
+	xdl_free(sk);
+	return ret;
+}
+
+void xdl_free_pairs(xdsimpair_t *pairs)
+{
+	xdl_free(pairs);
+}
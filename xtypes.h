@@ -45,6 +45,11 @@ typedef struct s_xrecord {
 	unsigned long ha;
 } xrecord_t;
 
+/* a record gathered from several chunks of a rope, data follows */
+typedef struct s_xdspill {
+	struct s_xdspill *next;
+} xdspill_t;
+
 typedef struct s_xdfile {
 	chastore_t rcha;
 	long nrec;
@@ -53,15 +58,35 @@ typedef struct s_xdfile {
 	long dstart, dend;
 	xrecord_t **recs;
 	char *rchg;
+	uint64_t *rbits, *rmoved;
 	long *rindex;
 	long nreff;
 	unsigned long *ha;
+	xdspill_t *spill;
 } xdfile_t;
 
 typedef struct s_xdfenv {
 	xdfile_t xdf1, xdf2;
+	long nclass;
 } xdfenv_t;
 
+typedef struct s_xdpool {
+#if defined(XDL_THREADS)
+	xdl_mutex_t lock;
+#endif
+	int live;
+	long idle;
+} xdpool_t;
+
+typedef struct s_xdtask {
+	int (*fn)(void *);
+	void *priv;
+	int result;
+#if defined(XDL_THREADS)
+	xdl_thread_t thread;
+#endif
+} xdtask_t;
+
 
 
 #endif /* #if !defined(XTYPES_H) */
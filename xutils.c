@@ -23,6 +23,12 @@
 #include "xinclude.h"
 
 
+/* Regions with fewer lines than this (both sides) are not worth a thread. */
+#if !defined(XDL_PARALLEL_MIN_LINES)
+#define XDL_PARALLEL_MIN_LINES 4096
+#endif
+
+
 long xdl_bogosqrt(long n) {
 	long i;
 
@@ -118,12 +124,15 @@ void *xdl_cha_alloc(chastore_t *cha) {
 	return data;
 }
 
-long xdl_guess_lines(mmfile_t *mf, long sample) {
-	long nl = 0, size, tsize = 0;
+long xdl_guess_lines(mmrope_t const *mr, long sample) {
+	long nl = 0, size = 0, tsize = 0, c;
 	char const *data, *cur, *top;
 
-	if ((cur = data = xdl_mmfile_first(mf, &size))) {
-		for (top = data + size; nl < sample && cur < top; ) {
+	for (c = 0; c < mr->nr; c++)
+		size += mr->chunk[c].size;
+	for (c = 0; c < mr->nr && nl < sample; c++) {
+		cur = data = mr->chunk[c].ptr;
+		for (top = data + mr->chunk[c].size; nl < sample && cur < top; ) {
 			nl++;
 			if (!(cur = memchr(cur, '\n', top - cur)))
 				cur = top;
@@ -134,11 +143,21 @@ long xdl_guess_lines(mmfile_t *mf, long sample) {
 	}
 
 	if (nl && tsize)
-		nl = xdl_mmfile_size(mf) / (tsize / nl);
+		nl = size / (tsize / nl);
 
 	return nl + 1;
 }
 
+/*
+ * Describe mf as a rope of a single chunk.
+ */
+void xdl_file_rope(mmfile_t *mf, mmbuffer_t *chunk, mmrope_t *mr) {
+	chunk->ptr = mf->ptr;
+	chunk->size = mf->size;
+	mr->chunk = chunk;
+	mr->nr = 1;
+}
+
 int xdl_blankline(const char *line, long size, long flags)
 {
 	long i;
@@ -403,36 +422,490 @@ int xdl_emit_hunk_hdr(long s1, long c1, long s2, long c2,
 }
 
 int xdl_fall_back_diff(xdfenv_t *diff_env, xpparam_t const *xpp,
-		int line1, int count1, int line2, int count2)
+		long line1, long count1, long line2, long count2)
 {
-	/*
-	 * This probably does not work outside Git, since
-	 * we have a very simple mmfile structure.
-	 *
-	 * Note: ideally, we would reuse the prepared environment, but
-	 * the libxdiff interface does not (yet) allow for diffing only
-	 * ranges of lines instead of the whole files.
-	 */
-	mmfile_t subfile1, subfile2;
 	xdfenv_t env;
 
-	subfile1.ptr = (char *)diff_env->xdf1.recs[line1 - 1]->ptr;
-	subfile1.size = diff_env->xdf1.recs[line1 + count1 - 2]->ptr +
-		diff_env->xdf1.recs[line1 + count1 - 2]->size - subfile1.ptr;
-	subfile2.ptr = (char *)diff_env->xdf2.recs[line2 - 1]->ptr;
-	subfile2.size = diff_env->xdf2.recs[line2 + count2 - 2]->ptr +
-		diff_env->xdf2.recs[line2 + count2 - 2]->size - subfile2.ptr;
-	if (xdl_do_diff(&subfile1, &subfile2, xpp, &env) < 0)
+	/*
+	 * Diff the range on copies of the already prepared records: they
+	 * need not be contiguous in memory, as with xdl_diff_lines().
+	 */
+	if (xdl_prepare_range_env(&diff_env->xdf1, line1 - 1, count1,
+				  &diff_env->xdf2, line2 - 1, count2, xpp, &env) < 0 ||
+	    xdl_diff_env(xpp, &env) < 0)
 		return -1;
 
-	memcpy(diff_env->xdf1.rchg + line1 - 1, env.xdf1.rchg, count1);
-	memcpy(diff_env->xdf2.rchg + line2 - 1, env.xdf2.rchg, count2);
+	xdl_rchg_copy(&diff_env->xdf1, line1 - 1, &env.xdf1, count1);
+	xdl_rchg_copy(&diff_env->xdf2, line2 - 1, &env.xdf2, count2);
 
 	xdl_free_env(&env);
 
 	return 0;
 }
 
+/*
+ * A minimal fork-join helper for XDF_PARALLEL. The pool only counts how
+ * many more threads may be started: a caller that wants to hand a region
+ * off first claims a thread for it (which fails if the region is small or
+ * all threads are busy, in which case the caller just does the work
+ * itself), then starts the task and eventually waits for it. Results are
+ * the same as when running serially, since tasks own disjoint regions.
+ */
+int xdl_pool_init(xdpool_t *pool, xpparam_t const *xpp)
+{
+#if defined(XDL_THREADS)
+	long nr = xpp->max_threads;
+#endif
+
+	pool->live = 0;
+	pool->idle = 0;
+	/* threads would share the words of packed change maps */
+	if (!(xpp->flags & XDF_PARALLEL) || xpp->flags & XDF_PACKED_CHANGES)
+		return 0;
+#if defined(XDL_THREADS)
+# if defined(xdl_online_cpus)
+	if (nr <= 0)
+		nr = (long) xdl_online_cpus();
+# endif
+	if (nr <= 1)
+		return 0;
+	if (xdl_mutex_init(&pool->lock))
+		return -1;
+	pool->live = 1;
+	pool->idle = nr - 1;
+#endif
+	return 0;
+}
+
+void xdl_pool_free(xdpool_t *pool)
+{
+#if defined(XDL_THREADS)
+	if (pool->live)
+		xdl_mutex_destroy(&pool->lock);
+#endif
+}
+
+int xdl_pool_claim(xdpool_t *pool, long size)
+{
+	int ret = -1;
+
+	if (!pool || !pool->live || size < XDL_PARALLEL_MIN_LINES)
+		return -1;
+#if defined(XDL_THREADS)
+	xdl_mutex_lock(&pool->lock);
+	if (pool->idle > 0) {
+		pool->idle--;
+		ret = 0;
+	}
+	xdl_mutex_unlock(&pool->lock);
+#endif
+	return ret;
+}
+
+void xdl_pool_unclaim(xdpool_t *pool)
+{
+#if defined(XDL_THREADS)
+	xdl_mutex_lock(&pool->lock);
+	pool->idle++;
+	xdl_mutex_unlock(&pool->lock);
+#endif
+}
+
+/*
+ * A shared cursor over the items of xdl_pool_run(); each runner takes
+ * the next item until there are none left.
+ */
+struct pool_run {
+	xdtask_t task;
+	xdpool_t *pool;
+	long *next, nr;
+	int (*fn)(void *, long);
+	void *priv;
+};
+
+static int pool_run_items(void *priv)
+{
+	struct pool_run *pr = priv;
+	long k;
+	int ret = 0;
+
+	for (;;) {
+#if defined(XDL_THREADS)
+		if (pr->pool->live)
+			xdl_mutex_lock(&pr->pool->lock);
+#endif
+		k = (*pr->next)++;
+#if defined(XDL_THREADS)
+		if (pr->pool->live)
+			xdl_mutex_unlock(&pr->pool->lock);
+#endif
+		if (k >= pr->nr)
+			break;
+		if (pr->fn(pr->priv, k) < 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Run fn(priv, k) for each k in 0..nr-1, where size is the number of
+ * lines all the items cover together. The caller and up to nr - 1 idle
+ * threads of the pool pull the items one at a time from a shared index,
+ * so uneven items still keep every thread busy. Returns -1 if any call
+ * did.
+ */
+int xdl_pool_run(xdpool_t *pool, long nr, long size,
+		 int (*fn)(void *, long), void *priv)
+{
+	struct pool_run self, *pr = NULL;
+	long next = 0, i, ntask = 0;
+	int ret;
+
+	self.pool = pool;
+	self.next = &next;
+	self.nr = nr;
+	self.fn = fn;
+	self.priv = priv;
+
+	if (nr > 1 && !xdl_pool_claim(pool, size)) {
+		for (ntask = 1; ntask < nr - 1 && !xdl_pool_claim(pool, size);)
+			ntask++;
+		if (!XDL_ALLOC_ARRAY(pr, ntask)) {
+			while (ntask--)
+				xdl_pool_unclaim(pool);
+			ntask = 0;
+		}
+	}
+	for (i = 0; i < ntask; i++) {
+		pr[i] = self;
+		pr[i].task.fn = pool_run_items;
+		pr[i].task.priv = pr + i;
+		xdl_task_start(pool, &pr[i].task);
+	}
+	ret = pool_run_items(&self);
+	for (i = 0; i < ntask; i++)
+		if (xdl_task_wait(pool, &pr[i].task) < 0)
+			ret = -1;
+	xdl_free(pr);
+
+	return ret;
+}
+
+#if defined(XDL_THREADS)
+static void *xdl_task_main(void *priv)
+{
+	xdtask_t *task = priv;
+
+	task->result = task->fn(task->priv);
+	xdl_free_thread_cache();
+	return NULL;
+}
+#endif
+
+/*
+ * Run task on the thread claimed with xdl_pool_claim(), or right away if
+ * no thread can be started.
+ */
+void xdl_task_start(xdpool_t *pool, xdtask_t *task)
+{
+#if defined(XDL_THREADS)
+	if (!xdl_thread_create(&task->thread, xdl_task_main, task))
+		return;
+	xdl_pool_unclaim(pool);
+#endif
+	task->result = task->fn(task->priv);
+	task->fn = NULL;
+}
+
+int xdl_task_wait(xdpool_t *pool, xdtask_t *task)
+{
+#if defined(XDL_THREADS)
+	if (task->fn) {
+		xdl_thread_join(task->thread);
+		xdl_pool_unclaim(pool);
+	}
+#endif
+	return task->result;
+}
+
+#if defined(XDL_THREAD_LOCAL)
+/*
+ * The K vectors of xdl_do_diff() are sized after the number of records,
+ * so for big files they are big, and allocating them afresh for every
+ * diff means page faults on every call. Keep them in a per-thread buffer
+ * that only ever grows. Nested users (there are none today) simply get
+ * a private allocation.
+ */
+static XDL_THREAD_LOCAL struct {
+	void *ptr;
+	size_t size;
+	int busy;
+} kvd_cache;
+#endif
+
+void *xdl_kvd_get(long nr, size_t size)
+{
+	size_t bytes;
+
+	if (nr < 0 || SIZE_MAX / size < (size_t) nr)
+		return NULL;
+	bytes = (size_t) nr * size;
+#if defined(XDL_THREAD_LOCAL)
+	if (!kvd_cache.busy) {
+		if (kvd_cache.size < bytes) {
+			xdl_free(kvd_cache.ptr);
+			kvd_cache.size = 0;
+			if (!(kvd_cache.ptr = xdl_malloc(bytes)))
+				return NULL;
+			kvd_cache.size = bytes;
+		}
+		kvd_cache.busy = 1;
+		return kvd_cache.ptr;
+	}
+#endif
+	return xdl_malloc(bytes);
+}
+
+void xdl_kvd_put(void *kvd)
+{
+#if defined(XDL_THREAD_LOCAL)
+	if (kvd == kvd_cache.ptr) {
+		kvd_cache.busy = 0;
+		return;
+	}
+#endif
+	xdl_free(kvd);
+}
+
+void xdl_free_thread_cache(void)
+{
+#if defined(XDL_THREAD_LOCAL)
+	if (kvd_cache.busy)
+		return;
+	xdl_free(kvd_cache.ptr);
+	kvd_cache.ptr = NULL;
+	kvd_cache.size = 0;
+#endif
+}
+
+/*
+ * Byte maps are read a word at a time: a zero word is eight unchanged
+ * records. Bytes are 0 or 1 until xdl_mark_moves() ORs XDL_RCHG_MOVED into
+ * changed ones, so rchg_word_set() first folds each byte down to bit 0 and
+ * then multiplies by 0x0101010101010101, which sums the bytes into the top
+ * one.
+ */
+#define RCHG_WORD 8
+#define RCHG_LOW UINT64_C(0x0101010101010101)
+
+static inline uint64_t rchg_word(char const *rchg)
+{
+	uint64_t w;
+
+	memcpy(&w, rchg, RCHG_WORD);
+	return w;
+}
+
+static inline long rchg_word_set(uint64_t w)
+{
+	return (long) ((((w | w >> 1) & RCHG_LOW) * RCHG_LOW) >> 56);
+}
+
+/*
+ * Packed maps keep record i at bit i + 1 (see XDL_RBIT_TEST()), so runs are
+ * found with a count of trailing or leading zeros, and counted with a
+ * popcount.
+ */
+#define RBITS 64
+
+static inline int rbits_ctz(uint64_t w)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(w);
+#else
+	int n = 0;
+
+	for (; !(w & 1); w >>= 1)
+		n++;
+	return n;
+#endif
+}
+
+static inline int rbits_top(uint64_t w)
+{
+#if defined(__GNUC__)
+	return RBITS - 1 - __builtin_clzll(w);
+#else
+	int n = RBITS - 1;
+
+	for (; !(w >> (RBITS - 1)); w <<= 1)
+		n--;
+	return n;
+#endif
+}
+
+static inline long rbits_count(uint64_t w)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(w);
+#else
+	w -= (w >> 1) & UINT64_C(0x5555555555555555);
+	w = (w & UINT64_C(0x3333333333333333)) +
+		((w >> 2) & UINT64_C(0x3333333333333333));
+	w = (w + (w >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+	return (long) ((w * RCHG_LOW) >> 56);
+#endif
+}
+
+/*
+ * Return the first set bit in [b, e) of m, or -1 if there is none.
+ */
+static long rbits_next(uint64_t const *m, long b, long e)
+{
+	uint64_t w;
+
+	for (; b < e; b = (b | (RBITS - 1)) + 1)
+		if ((w = m[b / RBITS] & (~UINT64_C(0) << (b % RBITS)))) {
+			b = (b & ~(long) (RBITS - 1)) + rbits_ctz(w);
+			return b < e ? b : -1;
+		}
+
+	return -1;
+}
+
+/*
+ * Return the k-th (counting from 1) clear bit in [b, e) of m, or -1 if
+ * there are fewer than k of them.
+ */
+static long rbits_nth_clear(uint64_t const *m, long b, long e, long k)
+{
+	uint64_t w;
+	long n;
+
+	for (; b < e; b = (b | (RBITS - 1)) + 1) {
+		w = ~m[b / RBITS] & (~UINT64_C(0) << (b % RBITS));
+		if (e / RBITS == b / RBITS)
+			w &= (UINT64_C(1) << (e % RBITS)) - 1;
+		if ((n = rbits_count(w)) < k) {
+			k -= n;
+			continue;
+		}
+		while (--k)
+			w &= w - 1;
+		return (b & ~(long) (RBITS - 1)) + rbits_ctz(w);
+	}
+
+	return -1;
+}
+
+/*
+ * Return the first changed record in [i, end), or end if there is none.
+ */
+long xdl_rchg_next(xdfile_t const *xdf, long i, long end)
+{
+	char const *rchg = xdf->rchg;
+
+	if (xdf->rbits) {
+		i = rbits_next(xdf->rbits, i + 1, end + 1);
+		return i < 0 ? end : i - 1;
+	}
+	for (; i + RCHG_WORD <= end; i += RCHG_WORD)
+		if (rchg_word(rchg + i))
+			break;
+	for (; i < end; i++)
+		if (rchg[i])
+			return i;
+
+	return end;
+}
+
+/*
+ * Return the last changed record in [start, i), or start - 1 if there is
+ * none.
+ */
+long xdl_rchg_prev(xdfile_t const *xdf, long i, long start)
+{
+	char const *rchg = xdf->rchg;
+	uint64_t w;
+	long b;
+
+	if (xdf->rbits) {
+		for (b = i + 1; b > start + 1; b = (b - 1) & ~(long) (RBITS - 1))
+			if ((w = xdf->rbits[(b - 1) / RBITS] &
+			     (~UINT64_C(0) >> (RBITS - 1 - (b - 1) % RBITS)))) {
+				b = ((b - 1) & ~(long) (RBITS - 1)) + rbits_top(w);
+				return b > start ? b - 1 : start - 1;
+			}
+		return start - 1;
+	}
+	for (; i - RCHG_WORD >= start; i -= RCHG_WORD)
+		if (rchg_word(rchg + i - RCHG_WORD))
+			break;
+	for (; i > start; i--)
+		if (rchg[i - 1])
+			return i - 1;
+
+	return start - 1;
+}
+
+/*
+ * Return the k-th (counting from 1) unchanged record in [i, end), or end if
+ * there are fewer than k of them.
+ */
+long xdl_rchg_nth_unchanged(xdfile_t const *xdf, long i, long end, long k)
+{
+	char const *rchg = xdf->rchg;
+	long zeros;
+
+	if (xdf->rbits) {
+		i = rbits_nth_clear(xdf->rbits, i + 1, end + 1, k);
+		return i < 0 ? end : i - 1;
+	}
+	for (; i + RCHG_WORD <= end; i += RCHG_WORD) {
+		zeros = RCHG_WORD - rchg_word_set(rchg_word(rchg + i));
+		if (zeros >= k)
+			break;
+		k -= zeros;
+	}
+	for (; i < end; i++)
+		if (!rchg[i] && !--k)
+			return i;
+
+	return end;
+}
+
+/*
+ * Mark the n records of xdf from i changed.
+ */
+void xdl_rchg_fill(xdfile_t *xdf, long i, long n)
+{
+	if (!xdf->rbits) {
+		memset(xdf->rchg + i, 1, n);
+		return;
+	}
+	for (; n > 0; i++, n--)
+		XDL_SET_CHANGED(xdf, i);
+}
+
+/*
+ * Copy the change flags of the first n records of src to those of xdf
+ * from i.
+ */
+void xdl_rchg_copy(xdfile_t *xdf, long i, xdfile_t const *src, long n)
+{
+	long j;
+
+	if (!xdf->rbits && !src->rbits) {
+		memcpy(xdf->rchg + i, src->rchg, n);
+		return;
+	}
+	for (j = 0; j < n; j++)
+		if (XDL_CHANGED(src, j))
+			XDL_SET_CHANGED(xdf, i + j);
+		else
+			XDL_CLR_CHANGED(xdf, i + j);
+}
+
 void* xdl_alloc_grow_helper(void *p, long nr, long *alloc, size_t size)
 {
 	void *tmp = NULL;
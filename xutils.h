@@ -31,7 +31,8 @@ int xdl_emit_diffrec(char const *rec, long size, char const *pre, long psize,
 int xdl_cha_init(chastore_t *cha, long isize, long icount);
 void xdl_cha_free(chastore_t *cha);
 void *xdl_cha_alloc(chastore_t *cha);
-long xdl_guess_lines(mmfile_t *mf, long sample);
+long xdl_guess_lines(mmrope_t const *mr, long sample);
+void xdl_file_rope(mmfile_t *mf, mmbuffer_t *chunk, mmrope_t *mr);
 int xdl_blankline(const char *line, long size, long flags);
 int xdl_recmatch(const char *l1, long s1, const char *l2, long s2, long flags);
 unsigned long xdl_hash_record(char const **data, char const *top, long flags);
@@ -40,7 +41,22 @@ int xdl_num_out(char *out, long val);
 int xdl_emit_hunk_hdr(long s1, long c1, long s2, long c2,
 		      const char *func, long funclen, xdemitcb_t *ecb);
 int xdl_fall_back_diff(xdfenv_t *diff_env, xpparam_t const *xpp,
-		       int line1, int count1, int line2, int count2);
+		       long line1, long count1, long line2, long count2);
+int xdl_pool_init(xdpool_t *pool, xpparam_t const *xpp);
+void xdl_pool_free(xdpool_t *pool);
+int xdl_pool_claim(xdpool_t *pool, long size);
+void xdl_pool_unclaim(xdpool_t *pool);
+int xdl_pool_run(xdpool_t *pool, long nr, long size,
+		 int (*fn)(void *, long), void *priv);
+void xdl_task_start(xdpool_t *pool, xdtask_t *task);
+int xdl_task_wait(xdpool_t *pool, xdtask_t *task);
+long xdl_rchg_next(xdfile_t const *xdf, long i, long end);
+long xdl_rchg_prev(xdfile_t const *xdf, long i, long start);
+long xdl_rchg_nth_unchanged(xdfile_t const *xdf, long i, long end, long k);
+void xdl_rchg_fill(xdfile_t *xdf, long i, long n);
+void xdl_rchg_copy(xdfile_t *xdf, long i, xdfile_t const *src, long n);
+void *xdl_kvd_get(long nr, size_t size);
+void xdl_kvd_put(void *kvd);
 
 /* Do not call this function, use XDL_ALLOC_GROW instead */
 void* xdl_alloc_grow_helper(void* p, long nr, long* alloc, size_t size);